@@ -10,19 +10,19 @@
 #include <assert.h>
 #include <uv.h>
 #include "fastcgi.h"
+#include "connection.h"
 #include "utilities.h"
 #include "buffer.h"
 
  struct my_server {
  	uv_handle_t		*server;
- 	fastcgi_context_t	*ctx;
+ 	fastcgi_manager_t	*manager;
  };
 
- struct my_service_request {
- 	uint16_t		id;
- 	fastcgi_context_t *ctx;
- 	buffer_t		*buffer;
- 	uv_handle_t		*client;
+ struct my_write {
+ 	uv_write_t		req;
+ 	uv_stream_t		*client;
+ 	char			*data;
  };
 
 uv_loop_t *loop;
@@ -32,8 +32,8 @@ void signal_handler(uv_signal_t *handle, int signum)
     printf("signal received: %d\n", signum);
 	struct my_server *server = (struct my_server*)loop->data;
 	if (server != 0) {
-    	fastcgi_destroy(server->ctx);
-    	server->ctx = 0;
+    	fastcgi_manager_destroy(server->manager);
+    	server->manager = 0;
 		uv_close(server->server, NULL);
     	free(server);
     	loop->data = 0;
@@ -48,6 +48,11 @@ uv_buf_t alloc_buffer(uv_handle_t *handle, size_t suggested_size)
 
 void client_destroy(uv_handle_t *handle)
 {
+	struct my_server *server = (struct my_server*)loop->data;
+	fastcgi_connection_t *conn = (fastcgi_connection_t*)handle->data;
+	if (server != 0 && conn != 0) {
+		fastcgi_connection_close(server->manager, conn);
+	}
 	free(handle);
 }
 
@@ -65,7 +70,7 @@ void print_params(llist_t *list)
 	uint32_t name_value_used = 0;
 	uint32_t name_value_hash = 0;
 	klunk_param_t *param = 0;
-	llist_item_t *ptr = list->items;
+	llist_item_t *ptr = list != 0 ? list->items : 0;
 	while (ptr != 0) {
 		param = (klunk_param_t*)(ptr->data);
 		name_len = strlen(param->name);
@@ -100,7 +105,7 @@ void format_params(llist_t *list, char *buffer, const int32_t len)
 	int32_t left = len;
 	int32_t result = 0;
 	klunk_param_t *param = 0;
-	llist_item_t *ptr = list->items;
+	llist_item_t *ptr = list != 0 ? list->items : 0;
 	while (ptr != 0) {
 		param = (klunk_param_t*)(ptr->data);
 		if (!klunk_param_is_free(param)) {
@@ -116,48 +121,58 @@ void format_params(llist_t *list, char *buffer, const int32_t len)
 	}
 }
 
-void fcgi_write(uv_write_t *req, int status)
+void fcgi_written(uv_write_t *req, int status)
 {
-	int32_t result = 0;
-	struct my_service_request *sr = 0;
-	int32_t kstate = 0;
+	struct my_write *w = (struct my_write*)req->data;
+	fastcgi_connection_t *conn = (fastcgi_connection_t*)w->client->data;
 
-	sr = (struct my_service_request*)req->data;
-		
 	if (status == -1) {
 		fprintf(stderr, "write error %s\n", uv_err_name(uv_last_error(loop)));
 		if (uv_last_error(loop).code == UV_EPIPE) {
-			uv_close(sr->client, client_destroy);
+			uv_close((uv_handle_t*)w->client, client_destroy);
 		}
 	}
-	else if (status == 0) {	
-		kstate = fastcgi_request_state(sr->ctx, sr->id);
+	else if (conn != 0 && fastcgi_connection_should_close(conn) > 0) {
+		/* The web server did not ask to keep the connection */
+		uv_close((uv_handle_t*)w->client, client_destroy);
+	}
+	free(w->data);
+	free(w);
+}
 
-		if (kstate >= 0) {
-			if ((kstate & FASTCGI_RS_FINISH) == 0) {
-				result = fastcgi_finish(sr->ctx, sr->id);
-				assert(result == 0);
-			}
-			result = fastcgi_write(sr->ctx, buffer_peek(sr->buffer), buffer_free(sr->buffer), sr->id);
-			// printf("fcgi_write: write content, %d\n", result);
-			if (result > 0) {
-				uv_buf_t b = { .len = result, .base = buffer_peek(sr->buffer) };
-				uv_write(req, (uv_stream_t*)sr->client, &b, 1, fcgi_write);
-				return;
-			}
+/* Send everything queued on the connection */
+void fcgi_flush(fastcgi_connection_t *conn, uv_stream_t *client)
+{
+	struct iovec iov[16];
+	int32_t count = 0;
+	int32_t n = 0;
+	size_t used = 0;
+	int32_t pending = fastcgi_connection_pending(conn);
+	if (pending <= 0) {
+		return;
+	}
+	struct my_write *w = (struct my_write*)malloc(sizeof(struct my_write));
+	assert(w != 0);
+	w->data = malloc(pending);
+	assert(w->data != 0);
+	w->client = client;
+	w->req.data = w;
+	while (used < (size_t)pending) {
+		count = fastcgi_connection_iov(conn, iov, 16, pending - used);
+		for (n = 0; n < count; n++) {
+			memcpy(w->data + used, iov[n].iov_base, iov[n].iov_len);
+			used += iov[n].iov_len;
+			fastcgi_connection_consume(conn, iov[n].iov_len);
 		}
 	}
-	/* close */
-	// uv_close(sr->client, client_destroy);
-	/* cleanup */
-	buffer_destroy(sr->buffer);
-	free(sr);
-	free(req);
+	uv_buf_t b = { .len = used, .base = w->data };
+	uv_write(&w->req, client, &b, 1, fcgi_written);
 }
 
 void fcgi_read(uv_stream_t *client, ssize_t nread, uv_buf_t buf)
 {
 	int32_t result = 0;
+	fastcgi_connection_t *conn = (fastcgi_connection_t*)client->data;
 	fastcgi_context_t *ctx = 0;
 	int32_t request_id = 0;
 	int32_t kstate = 0;
@@ -172,9 +187,9 @@ void fcgi_read(uv_stream_t *client, ssize_t nread, uv_buf_t buf)
 		uv_close((uv_handle_t*)client, client_destroy);
 	}
 	else if (nread > 0) {
-		if (loop->data != 0) {
-			ctx = ((struct my_server*)loop->data)->ctx;
-			result = fastcgi_read(ctx, buf.base, nread);
+		if (conn != 0) {
+			ctx = conn->ctx;
+			result = fastcgi_connection_read(conn, buf.base, nread);
 			result = fastcgi_current_request_id(ctx);
 			if (result > 0) {
 				request_id = result;
@@ -189,18 +204,6 @@ void fcgi_read(uv_stream_t *client, ssize_t nread, uv_buf_t buf)
 			}
 			if ((kstate & FASTCGI_RS_STDIN_DONE)) {
 				// printf("fcgi_read: stdin done\n");
-				struct my_service_request *sr = (struct my_service_request*)malloc(sizeof(struct my_service_request));
-				assert(sr != 0);
-
-				sr->id = request_id;
-				sr->ctx = ctx;
-				sr->buffer = buffer_create();
-				sr->client = (uv_handle_t*)client;
-				
-				uv_write_t *req = (uv_write_t*)malloc(sizeof(uv_write_t));
-				assert(req != 0);
-				req->data = sr;
-
 				char *params = malloc(2048);
 				assert(params != 0);
 				if (request != 0) {
@@ -243,17 +246,18 @@ void fcgi_read(uv_stream_t *client, ssize_t nread, uv_buf_t buf)
 				free(params);
 				// printf("fcgi_read: generate content, %d\n", content_len);
 
-				assert(result > 0);
 				// printf("fcgi_read: buffer content, %d\n", result);
 
-				result = fastcgi_write(ctx, buffer_peek(sr->buffer), buffer_free(sr->buffer), request_id);
-				assert(result > 0);
-				// printf("fcgi_read: write content, %d\n", result);
-
-				uv_buf_t b = { .len = result, .base = buffer_peek(sr->buffer) };
+				/* The response is complete, let the output policy flush it.
+				 * A request that went over a limit is ended already and
+				 * its END_REQUEST waits on the control queue. */
+				fastcgi_finish(ctx, request_id);
 
-				uv_write(req, client, &b, 1, fcgi_write);
+				result = fastcgi_connection_queue(conn, request_id);
+				assert(result >= 0);
+				// printf("fcgi_read: queue content, %d\n", result);
 			}
+			fcgi_flush(conn, client);
 		}
 		else {
 			uv_close((uv_handle_t*)client, client_destroy);
@@ -272,8 +276,22 @@ void on_new_connection(uv_stream_t *server, int status)
 	uv_tcp_t *client = (uv_tcp_t*)malloc(sizeof(uv_tcp_t));
 	assert(client != 0);
 	uv_tcp_init(loop, client);
+	client->data = 0;
 	int r = uv_accept(server, (uv_stream_t*)client);
-	if (r == 0) {
+	fastcgi_connection_t *conn = 0;
+	if (r == 0 && loop->data != 0) {
+		conn = fastcgi_connection_open(((struct my_server*)loop->data)->manager);
+	}
+	if (conn != 0) {
+		/* Send each response as one packet */
+		fastcgi_output_policy_t policy = {
+			.flush_bytes = 4096,
+			.flush_usec = 0,
+			.pack_records = 1
+		};
+		fastcgi_set_output_policy(conn->ctx, &policy);
+		conn->user_data = client;
+		client->data = conn;
 		uv_read_start((uv_stream_t*)client, alloc_buffer, fcgi_read);
 	}
 	else {
@@ -291,8 +309,9 @@ int main()
 	assert(server_ctx != 0);
 
 	// printf("create service\n");
-	server_ctx->ctx = fastcgi_create();
-	assert(server_ctx->ctx != 0);
+	/* One context per connection, keep some around for the next accept */
+	server_ctx->manager = fastcgi_manager_create(10000, 256);
+	assert(server_ctx->manager != 0);
 
 	uv_signal_t sigint;
     uv_signal_init(loop, &sigint);
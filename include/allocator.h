@@ -0,0 +1,59 @@
+/* Memory allocation hooks
+ * (C) 2021 Erik Svensson <erik.public@gmail.com>
+ * Licensed under the MIT license.
+ */
+
+#ifndef ES_ALLOCATOR_H
+#define ES_ALLOCATOR_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include "config.h"
+
+typedef void* (*fastcgi_malloc_func)(size_t size, void *user);
+typedef void* (*fastcgi_realloc_func)(void *ptr, size_t size, void *user);
+typedef void (*fastcgi_free_func)(void *ptr, void *user);
+
+/* An allocator, user is passed to every call */
+typedef struct fastcgi_allocator_ {
+	fastcgi_malloc_func		malloc;
+	fastcgi_realloc_func	realloc;
+	fastcgi_free_func		free;
+	void					*user;
+} fastcgi_allocator_t;
+
+/* Set the allocator used by objects created after the call, zero restores
+ * the build default, the system allocator or with FASTCGI_STATIC the static
+ * allocator. The allocator must outlive the objects created with
+ * it.
+ * Negative return value means error.
+ */
+int32_t fastcgi_set_allocator(const fastcgi_allocator_t *alloc);
+
+/* Get the allocator used by objects created now */
+const fastcgi_allocator_t* fastcgi_default_allocator();
+
+/* Get the allocator wrapping malloc, realloc and free */
+const fastcgi_allocator_t* fastcgi_system_allocator();
+
+#ifdef FASTCGI_STATIC
+/* Get the allocator taking memory from the static region, it keeps freed
+ * blocks in power of two size classes and never calls malloc. Not thread
+ * safe.
+ */
+const fastcgi_allocator_t* fastcgi_static_allocator();
+
+/* Get the number of bytes of the static region handed out so far */
+size_t fastcgi_static_used();
+#endif
+
+/* Allocate, reallocate and free through alloc, zero means the default
+ * allocator.
+ */
+void* fastcgi_malloc(const fastcgi_allocator_t *alloc, const size_t size);
+void* fastcgi_realloc(const fastcgi_allocator_t *alloc, void *ptr
+	, const size_t size);
+void fastcgi_free(const fastcgi_allocator_t *alloc, void *ptr);
+
+#endif /* ES_ALLOCATOR_H */
@@ -0,0 +1,50 @@
+/* A bump pointer memory arena
+ * (C) 2021 Erik Svensson <erik.public@gmail.com>
+ * Licensed under the MIT license.
+ */
+
+#ifndef ES_ARENA_H
+#define ES_ARENA_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include "slab.h"
+
+typedef struct arena_block_ {
+	struct arena_block_	*next;
+	size_t				size;
+	size_t				used;
+	char				data[];
+} arena_block_t;
+
+/* Allocations are taken from the head block, a full head is replaced by a
+ * new block. Nothing is freed until the arena is reset.
+ */
+typedef struct arena_ {
+	arena_block_t	*head;
+	size_t			block_size;
+	size_t			used;
+	slab_pool_t		*pool;
+	const fastcgi_allocator_t	*alloc;
+} arena_t;
+
+/* Create an arena allocating blocks of block_size bytes, the blocks are
+ * taken from pool when they fit a slab, pool may be zero. Other memory is
+ * allocated by the allocator of the pool.
+ */
+arena_t*	arena_create(slab_pool_t *pool, const size_t block_size);
+
+/* Destroy the arena and all memory allocated from it */
+void		arena_destroy(arena_t *arena);
+
+/* Allocate size bytes aligned to the pointer size, returns zero on failure */
+void*		arena_alloc(arena_t *arena, const size_t size);
+
+/* Release all allocations, the first block is kept for reuse */
+void		arena_reset(arena_t *arena);
+
+/* Get the number of bytes allocated from the arena */
+size_t		arena_used(arena_t *arena);
+
+#endif /* ES_ARENA_H */
@@ -9,15 +9,50 @@
 #include <stdint.h>
 #include <string.h>
 
+#include "slab.h"
+
+enum {
+	/* The data is an anonymous mapping */
+	BUFFER_MAPPED				= 1,
+	/* The data is a slab from the pool */
+	BUFFER_POOLED				= 2,
+	/* The data is the inline storage of the buffer */
+	BUFFER_INLINE				= 4,
+	/* The buffer has no memory until the first write */
+	BUFFER_LAZY					= 8,
+	/* Writes up to this size to an empty lazy buffer use inline storage */
+	BUFFER_INLINE_SIZE			= 64
+};
+
+/* The used bytes start at data + offset, reading moves the offset forward
+ * and the data is moved back to the start only when a write needs the room.
+ */
 typedef struct buffer_ {
 	size_t	size;
 	size_t	used;
+	size_t	offset;
+	uint32_t	flags;
 	char	*data;
+	slab_pool_t	*pool;
+	const fastcgi_allocator_t	*alloc;
+	char	inline_data[BUFFER_INLINE_SIZE];
 } buffer_t;
 
-/* Create a buffer */
+/* Create a buffer using the default allocator */
 buffer_t*	buffer_create();
 
+/* Create a buffer without memory, the memory is taken on the first write.
+ * Small writes use the inline storage, buffers up to SLAB_MAX_SIZE use slabs
+ * from the pool, pool may be zero. Other memory comes from the allocator of
+ * the pool.
+ */
+buffer_t*	buffer_create_pooled(slab_pool_t *pool);
+
+/* Set up a buffer embedded in another object like buffer_create_pooled does,
+ * release its memory with buffer_reset.
+ */
+void		buffer_init_pooled(buffer_t *buf, slab_pool_t *pool);
+
 /* Destroy the buffer */
 void		buffer_destroy(buffer_t *buf);
 
@@ -44,10 +79,25 @@ char* 		buffer_peek(buffer_t *buf);
 /* Clear the data in the buffer while retain the memory */
 void		buffer_clear(buffer_t *buf);
 
-/* Clear the data in the buffer and reset the memory allocated to the minimum
+/* Clear the data in the buffer and reset the memory allocated to the minimum,
+ * buffers created by buffer_create_pooled release all their memory.
  */
 int32_t		buffer_reset(buffer_t *buf);
 
+/* Make room for len bytes in total, allocating exactly that much if the
+ * buffer has to grow. Returns the new size.
+ */
 int32_t		buffer_reserve(buffer_t *buf, const size_t len);
 
+/* Set how much a full buffer grows, in percent of its current size.
+ * The default is 200, doubling the size.
+ */
+int32_t		buffer_set_growth_factor(const uint32_t percent);
+
+/* Set the size from which buffers are backed by anonymous mappings and
+ * grown using mremap, zero disables mappings. Only buffers using the system
+ * allocator are mapped.
+ */
+void		buffer_set_mmap_threshold(const size_t size);
+
 #endif /* ES_BUFFER_H */
@@ -0,0 +1,79 @@
+/* A chained memory buffer
+ * (C) 2021 Erik Svensson <erik.public@gmail.com>
+ * Licensed under the MIT license.
+ */
+
+#ifndef ES_BUFFERLIST_H
+#define ES_BUFFERLIST_H
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#include "slab.h"
+
+/* A segment fills one slab, the used bytes are data[start] to data[end] */
+typedef struct bufferlist_segment_ {
+	struct bufferlist_segment_	*next;
+	size_t						size;
+	size_t						start;
+	size_t						end;
+	char						data[];
+} bufferlist_segment_t;
+
+/* Appending adds segments without moving stored data, reading releases
+ * segments as soon as they are empty.
+ */
+typedef struct bufferlist_ {
+	bufferlist_segment_t	*head;
+	bufferlist_segment_t	*tail;
+	size_t					used;
+	slab_pool_t				*pool;
+	const fastcgi_allocator_t	*alloc;
+} bufferlist_t;
+
+/* Create a buffer list taking its segments from pool, if pool is zero the
+ * segments are allocated individually. The list uses the allocator of pool.
+ */
+bufferlist_t*	bufferlist_create(slab_pool_t *pool);
+
+/* Destroy the buffer list */
+void			bufferlist_destroy(bufferlist_t *list);
+
+/* Get the number of used bytes in the buffer list */
+size_t			bufferlist_used(bufferlist_t *list);
+
+/* Write data to the end of the buffer list */
+int32_t			bufferlist_write(bufferlist_t *list, const char *data
+	, const size_t len);
+
+/* Get room for at least len bytes at the end of the buffer list so data
+ * can be generated in place, a new segment is added when the last one has
+ * less room. len is capped at the largest segment. The size of the room is
+ * put in room_len. Returns zero on failure.
+ */
+char*			bufferlist_reserve(bufferlist_t *list, const size_t len
+	, size_t *room_len);
+
+/* Add len bytes written to the room from bufferlist_reserve to the list */
+int32_t			bufferlist_commit(bufferlist_t *list, const size_t len);
+
+/* Read data from the buffer list, this removes the data from the list.
+ * If data is zero the bytes are only removed.
+ */
+int32_t			bufferlist_read(bufferlist_t *list, char *data, const size_t len);
+
+/* Describe the first len bytes of the buffer list as iovecs.
+ * Returns the number of iovecs used.
+ */
+int32_t			bufferlist_iov(bufferlist_t *list, struct iovec *iov
+	, const int32_t iov_count, const size_t len);
+
+/* Same as bufferlist_iov but start offset bytes into the buffer list */
+int32_t			bufferlist_iov_at(bufferlist_t *list, const size_t offset
+	, struct iovec *iov, const int32_t iov_count, const size_t len);
+
+/* Clear the data in the buffer list and release the segments */
+void			bufferlist_clear(bufferlist_t *list);
+
+#endif /* ES_BUFFERLIST_H */
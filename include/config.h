@@ -0,0 +1,70 @@
+/* Build configuration
+ * (C) 2021 Erik Svensson <erik.public@gmail.com>
+ * Licensed under the MIT license.
+ */
+
+#ifndef FASTCGI_CONFIG_H
+#define FASTCGI_CONFIG_H
+
+/* Bytes of returned slabs kept for reuse by the slab pool of a context
+ * created without a shared pool, or by the pool a connection manager shares
+ * between its contexts, see fastcgi_create_with_pool.
+ */
+#ifndef FASTCGI_POOL_FREE_BYTES
+#define FASTCGI_POOL_FREE_BYTES		(1024 * 1024)
+#endif
+
+/* Define FASTCGI_STATIC to build without malloc. All memory is then taken
+ * from a static region of FASTCGI_STATIC_MEMORY bytes and every context
+ * enforces the limits below. A request going over a limit is ended with
+ * FCGI_OVERLOADED. Any of the values can be set on the compiler command line.
+ *
+ * The static allocator hands out power of two blocks and keeps freed blocks
+ * per size class without merging them, memory once used for a class stays
+ * with it. A mix of sizes that shifts over time can therefore run out of
+ * memory while less than FASTCGI_STATIC_MEMORY is in use, size the region
+ * for the peak of every class. Running out of memory ends the request being
+ * decoded with FCGI_OVERLOADED. The region is shared by all contexts and is
+ * not thread safe, use it from one thread or install a locking allocator
+ * with fastcgi_set_allocator.
+ */
+#ifdef FASTCGI_STATIC
+
+/* Size of the static memory region */
+#ifndef FASTCGI_STATIC_MEMORY
+#define FASTCGI_STATIC_MEMORY		(16 * 1024 * 1024)
+#endif
+
+/* Concurrent requests per context */
+#ifndef FASTCGI_MAX_REQUESTS
+#define FASTCGI_MAX_REQUESTS		64
+#endif
+
+/* Parameters per request */
+#ifndef FASTCGI_MAX_PARAMS
+#define FASTCGI_MAX_PARAMS			128
+#endif
+
+/* Name plus value bytes of a single parameter */
+#ifndef FASTCGI_MAX_PARAM_LENGTH
+#define FASTCGI_MAX_PARAM_LENGTH	(8 * 1024)
+#endif
+
+/* STDIN bytes per request */
+#ifndef FASTCGI_MAX_CONTENT
+#define FASTCGI_MAX_CONTENT			(64 * 1024)
+#endif
+
+/* Buffered STDOUT and STDERR bytes per request */
+#ifndef FASTCGI_MAX_OUTPUT
+#define FASTCGI_MAX_OUTPUT			(64 * 1024)
+#endif
+
+/* Parameter, STDIN and output bytes buffered by all requests of a context */
+#ifndef FASTCGI_MAX_BUFFERED
+#define FASTCGI_MAX_BUFFERED		(1024 * 1024)
+#endif
+
+#endif /* FASTCGI_STATIC */
+
+#endif /* FASTCGI_CONFIG_H */
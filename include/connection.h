@@ -0,0 +1,115 @@
+/* Connections, each with its own klunk context
+ * (C) 2021 Erik Svensson <erik.public@gmail.com>
+ * Licensed under the MIT license.
+ */
+
+#ifndef FASTCGI_CONNECTION_H
+#define FASTCGI_CONNECTION_H
+
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include "fastcgi.h"
+#include "contextpool.h"
+
+/* Request ids are only unique within a connection, so every connection
+ * parses its records with its own context.
+ */
+typedef struct fastcgi_connection_ {
+	/* Parser and requests of the connection, zero while the slot is free */
+	fastcgi_context_t		*ctx;
+	/* Records waiting to be sent, created on first use */
+	bufferlist_t			*output;
+	/* Index in the manager while open, the next free slot while closed */
+	uint32_t				slot;
+	void					*user_data;
+} fastcgi_connection_t;
+
+/* A fixed table of connections, opening, closing and finding a connection
+ * by its slot take constant time.
+ */
+typedef struct fastcgi_manager_ {
+	fastcgi_connection_t	*connections;
+	uint32_t				max_connections;
+	uint32_t				open_count;
+	/* First free slot, max_connections when all are open */
+	uint32_t				free_slot;
+	fastcgi_context_pool_t	*contexts;
+	/* Slabs of all contexts and output queues, returned slabs are kept for
+	 * reuse by any connection */
+	slab_pool_t				*slabs;
+	const fastcgi_allocator_t	*alloc;
+} fastcgi_manager_t;
+
+/* Create a manager of at most max_connections connections, keeping the
+ * contexts of up to free_contexts closed connections for reuse.
+ */
+fastcgi_manager_t* fastcgi_manager_create(const uint32_t max_connections
+	, const uint32_t free_contexts);
+
+/* Same as fastcgi_manager_create with the manager and its contexts
+ * allocated by alloc, zero means the default allocator.
+ */
+fastcgi_manager_t* fastcgi_manager_create_with_allocator(
+	const uint32_t max_connections, const uint32_t free_contexts
+	, const fastcgi_allocator_t *alloc);
+
+/* Destroy the manager, open connections are closed */
+void fastcgi_manager_destroy(fastcgi_manager_t *manager);
+
+/* Open a connection with a fresh context. Returns zero when the manager is
+ * full or on failure.
+ */
+fastcgi_connection_t* fastcgi_connection_open(fastcgi_manager_t *manager);
+
+/* Close the connection, queued output is dropped */
+void fastcgi_connection_close(fastcgi_manager_t *manager
+	, fastcgi_connection_t *conn);
+
+/* Find the open connection in slot, zero if the slot is free */
+fastcgi_connection_t* fastcgi_connection_find(fastcgi_manager_t *manager
+	, const uint32_t slot);
+
+/* Parse data read from the connection. Control records generated while
+ * parsing are queued for sending. Fewer bytes than input_len are used when
+ * the flow policy holds a record back, see fastcgi_paused.
+ * Returns number of bytes used.
+ * Negative return value means error.
+ */
+int32_t fastcgi_connection_read(fastcgi_connection_t *conn
+	, const char *input, const size_t input_len);
+
+/* Queue the records the output policy lets out for the request, followed
+ * by any control records waiting, such as the END_REQUEST of a request
+ * ended for going over a limit.
+ * Returns number of bytes queued.
+ * Negative return value means error.
+ */
+int32_t fastcgi_connection_queue(fastcgi_connection_t *conn
+	, const uint16_t request_id);
+
+/* Get the number of bytes queued for sending.
+ * Negative return value means error.
+ */
+int32_t fastcgi_connection_pending(fastcgi_connection_t *conn);
+
+/* Describe up to len queued bytes as iovecs for writev.
+ * Returns the number of iovecs used.
+ * Negative return value means error.
+ */
+int32_t fastcgi_connection_iov(fastcgi_connection_t *conn
+	, struct iovec *iov, const int32_t iov_count, const size_t len);
+
+/* Remove len sent bytes from the queue.
+ * Negative return value means error.
+ */
+int32_t fastcgi_connection_consume(fastcgi_connection_t *conn
+	, const size_t len);
+
+/* Check if the connection should be closed, see fastcgi_should_close.
+ * Queued output is sent first.
+ * Negative return value means error.
+ */
+int32_t fastcgi_connection_should_close(fastcgi_connection_t *conn);
+
+#endif /* FASTCGI_CONNECTION_H */
@@ -0,0 +1,52 @@
+/* A pool of reusable klunk contexts
+ * (C) 2021 Erik Svensson <erik.public@gmail.com>
+ * Licensed under the MIT license.
+ */
+
+#ifndef FASTCGI_CONTEXTPOOL_H
+#define FASTCGI_CONTEXTPOOL_H
+
+#include <stdint.h>
+
+#include "fastcgi.h"
+
+/* Contexts released to the pool are reset and handed out again, so a
+ * connection accept/close cycle costs no allocations once the pool is warm.
+ */
+typedef struct fastcgi_context_pool_ {
+	/* Released contexts kept for reuse */
+	fastcgi_context_t	**free;
+	uint32_t			free_count;
+	uint32_t			free_max;
+	const fastcgi_allocator_t	*alloc;
+	/* Slab pool shared by the contexts created, zero gives each context a
+	 * pool of its own, see fastcgi_create_with_pool */
+	slab_pool_t			*slabs;
+} fastcgi_context_pool_t;
+
+/* Create a pool keeping at most free_max released contexts */
+fastcgi_context_pool_t* fastcgi_context_pool_create(const uint32_t free_max);
+
+/* Same as fastcgi_context_pool_create with the pool and its contexts
+ * allocated by alloc, zero means the default allocator.
+ */
+fastcgi_context_pool_t* fastcgi_context_pool_create_with_allocator(
+	const uint32_t free_max, const fastcgi_allocator_t *alloc);
+
+/* Destroy the pool and the contexts kept in it. Contexts handed out by the
+ * pool are not affected.
+ */
+void fastcgi_context_pool_destroy(fastcgi_context_pool_t *pool);
+
+/* Get a context from the pool, a new one is created when the pool is
+ * empty. Returns zero on failure.
+ */
+fastcgi_context_t* fastcgi_context_acquire(fastcgi_context_pool_t *pool);
+
+/* Reset the context and keep it for reuse, the context is destroyed when
+ * the pool is full.
+ */
+void fastcgi_context_release(fastcgi_context_pool_t *pool
+	, fastcgi_context_t *ctx);
+
+#endif /* FASTCGI_CONTEXTPOOL_H */
@@ -27,6 +27,7 @@ enum {
 	E_REQUEST_INVALID				= (E_FCGI_ERRORS - 20),
 	E_REQUEST_NOT_FOUND				= (E_FCGI_ERRORS - 21),
 	E_REQUEST_DUPLICATE				= (E_FCGI_ERRORS - 22),
+	E_REQUEST_LIMIT					= (E_FCGI_ERRORS - 23),
 	E_OS_ERROR						= -32768,
 };
 
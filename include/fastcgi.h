@@ -9,6 +9,10 @@
 #include <stdint.h>
 #include "llist.h"
 #include "buffer.h"
+#include "slab.h"
+#include "bufferlist.h"
+#include "allocator.h"
+#include "config.h"
 #include "protocol.h"
 #include "request.h"
 #include "parameter.h"
@@ -16,22 +20,229 @@
 void fastcgi_version(int32_t *version_major, int32_t *version_minor
 	, int32_t *version_patch);
 
+/* Output coalescing policy, buffered output is held back by fastcgi_write
+ * until one of the limits is reached or the request is finished.
+ */
+typedef struct fastcgi_output_policy_  {
+	/* Flush when this many bytes are buffered, zero flushes on every write */
+	size_t					flush_bytes;
+	/* Flush when the oldest buffered byte is this old, zero disables */
+	uint32_t				flush_usec;
+	/* Put as many records as fits into the output of each fastcgi_write */
+	uint8_t					pack_records;
+} fastcgi_output_policy_t;
+
+/* Record sizing targets, used to pick the content length of generated
+ * STDOUT/STDERR records. Zero means unknown.
+ */
+typedef struct fastcgi_record_policy_  {
+	/* Socket send buffer size, no record is larger than this */
+	uint32_t				sndbuf;
+	/* Maximum segment size, records are sized to a multiple of this */
+	uint32_t				mss;
+	/* Page size, records are sized to a multiple of this if mss is unknown */
+	uint32_t				page_size;
+	/* Omit the optional 8-byte padding of records */
+	uint8_t					no_padding;
+} fastcgi_record_policy_t;
+
+/* Input flow control, zero means no bound. fastcgi_read stops in front of a
+ * record that would take the context past a bound and returns the number of
+ * bytes used so far. The caller stops reading the socket until
+ * fastcgi_paused returns zero and then passes the remaining bytes again.
+ */
+typedef struct fastcgi_flow_policy_  {
+	/* Hold back BEGIN_REQUEST while this many requests are live */
+	uint32_t				max_requests;
+	/* Hold back PARAMS, STDIN and FCGI_DATA while this many bytes are
+	 * buffered, spilled and discarded input does not count. Records of a
+	 * request holding all buffered bytes still pass, it may be waiting for
+	 * the rest of its input, so the bound is soft. Requests that together
+	 * hold the bytes while each waits for more input stall until one of
+	 * them is finished or aborted. A spill threshold below max_buffered
+	 * keeps large bodies from filling the bound, spilled content is
+	 * credited back, limits.max_buffered is the hard cap.
+	 */
+	size_t					max_buffered;
+} fastcgi_flow_policy_t;
+
+/* Capacity limits, zero means unlimited. The limits are checked as records
+ * are decoded and as output is buffered, a request going over a limit is
+ * ended with FCGI_OVERLOADED without affecting the other requests.
+ */
+typedef struct fastcgi_limits_  {
+	/* Concurrent requests */
+	uint32_t				max_requests;
+	/* Parameters per request */
+	uint32_t				max_params;
+	/* Name plus value bytes of a single parameter */
+	uint32_t				max_param_length;
+	/* STDIN bytes per request, and FCGI_DATA bytes of filter requests */
+	size_t					max_content;
+	/* Buffered STDOUT and STDERR bytes per request */
+	size_t					max_output;
+	/* Parameter, STDIN and output bytes buffered by all requests */
+	size_t					max_buffered;
+} fastcgi_limits_t;
+
+/* Values answered to FCGI_GET_VALUES queries */
+typedef struct fastcgi_values_  {
+	/* FCGI_MAX_CONNS, concurrent transport connections accepted */
+	uint32_t				max_conns;
+	/* FCGI_MAX_REQS, concurrent requests accepted */
+	uint32_t				max_reqs;
+	/* FCGI_MPXS_CONNS, non-zero when connections are multiplexed */
+	uint8_t					mpxs_conns;
+} fastcgi_values_t;
+
+/* Room for the three name-value pairs with ten digit values */
+enum {
+	FASTCGI_VALUES_SIZE		= 96
+};
+
+/* Live requests are found by id through a directory of pages, a page holds
+ * the requests of FASTCGI_REQUEST_PAGE_SIZE consecutive ids. The directory
+ * and the pages are allocated when an id in them is first used.
+ */
+enum {
+	FASTCGI_REQUEST_PAGE_BITS	= 8,
+	FASTCGI_REQUEST_PAGE_SIZE	= (1 << FASTCGI_REQUEST_PAGE_BITS),
+	FASTCGI_REQUEST_PAGES		= (0x10000 >> FASTCGI_REQUEST_PAGE_BITS),
+	/* Recycled requests kept for reuse, more are destroyed */
+	FASTCGI_FREE_REQUESTS		= 32
+};
+
+typedef struct fastcgi_request_page_  {
+	fastcgi_request_t		*requests[FASTCGI_REQUEST_PAGE_SIZE];
+} fastcgi_request_page_t;
+
+struct fastcgi_context_;
+
+/* Called when the web server aborts a request, the request is recycled
+ * when the function returns, or once described output is consumed.
+ */
+typedef void (*fastcgi_abort_func)(struct fastcgi_context_ *ctx
+	, fastcgi_request_t *request, void *user_data);
+
+/* Called for each new request after the built in admission checks, returns
+ * FCGI_REQUEST_COMPLETE to admit the request or the protocol status it is
+ * ended with, FCGI_OVERLOADED or FCGI_CANT_MPX_CONN.
+ */
+typedef uint8_t (*fastcgi_admit_func)(struct fastcgi_context_ *ctx
+	, const uint16_t request_id, const uint16_t role, void *user_data);
+
+/* Admission control of new requests, zero disables a check. A request
+ * turned away is ended at once with END_REQUEST on the control queue and
+ * nothing is allocated for it. Concurrency is bounded by max_requests of
+ * fastcgi_limits_t, a second concurrent request is ended with
+ * FCGI_CANT_MPX_CONN when mpxs_conns of fastcgi_values_t is zero.
+ */
+typedef struct fastcgi_admission_policy_  {
+	/* End new requests with FCGI_OVERLOADED while the shortest queue delay
+	 * sampled within the last interval_usec stays above target_usec, the
+	 * CoDel test for a standing queue. The queue delay of a request is the
+	 * time from BEGIN_REQUEST until the handler first writes output or an
+	 * error, finishes, responds, authorizes or discards the input. An
+	 * interval without a sample clears the state. interval_usec must not
+	 * be zero when target_usec is set */
+	uint32_t				target_usec;
+	uint32_t				interval_usec;
+	fastcgi_admit_func		admit_func;
+	void					*admit_user_data;
+} fastcgi_admission_policy_t;
+
+/* Fields touched for every record come first so they share the leading
+ * cache lines, settings read when requests begin or output is generated
+ * follow after the input buffer.
+ */
 typedef struct fastcgi_context_  {
-	llist_t					*requests;
-	buffer_t				*input;
-	fcgi_record_header_t	*current_header;
+	fcgi_record_header_t	current_header;
+	/* Header of the next record, it stays here while the record is held */
+	fcgi_record_header_t	held_header;
 	uint8_t					read_state;
+	/* Set when fastcgi_read stopped in front of held_header */
+	uint8_t					read_held;
 	int32_t					read_bytes;
-	char					*read_buffer;
-	int32_t					read_buffer_len;
+	/* Live requests by id, zero until the first request */
+	fastcgi_request_page_t	**request_pages;
+	/* Number of requests begun and not yet recycled */
+	uint32_t				request_count;
+	/* Bytes buffered by all requests, checked against max_buffered */
+	size_t					buffered;
+	fastcgi_flow_policy_t	flow_policy;
+	fastcgi_limits_t		limits;
+	/* Partial records, its storage is taken from pool */
+	buffer_t				input;
+	/* Records not tied to a live request, created on first use */
+	bufferlist_t			*control;
+	/* Output segments shared by the requests */
+	slab_pool_t				*pool;
+	/* Set when pool was created with the context and is destroyed by it */
+	uint8_t					owns_pool;
+	fastcgi_output_policy_t	output_policy;
+	uint16_t				record_size;
+	uint8_t					record_padding;
+	/* Block size of the request arenas, zero when requests have no arena */
+	size_t					arena_block_size;
+	/* STDIN size beyond which request content goes to a file, zero never */
+	size_t					spill_threshold;
+	/* Allocator of the context and its requests */
+	const fastcgi_allocator_t	*alloc;
+	/* Recycled requests linked through next_free */
+	fastcgi_request_t		*free_requests;
+	uint32_t				free_count;
+	/* Set when a request without FCGI_KEEP_CONN has ended */
+	uint8_t					close_requested;
+	/* Close an idle connection after this long, zero never */
+	uint32_t				idle_timeout_usec;
+	/* Time of the last read or write, kept when idle_timeout_usec is set */
+	uint64_t				last_active;
+	/* Called for aborted requests, may be zero */
+	fastcgi_abort_func		abort_func;
+	void					*abort_user_data;
+	fastcgi_values_t		values;
+	/* The values encoded as FCGI_GET_VALUES_RESULT name-value pairs */
+	char					values_pairs[FASTCGI_VALUES_SIZE];
+	uint8_t					values_pair_len[3];
+	fastcgi_admission_policy_t	admission;
+	/* Start of the current admission interval and the shortest time a
+	 * request took during it */
+	uint64_t				interval_start;
+	uint64_t				interval_min_usec;
+	/* Set while the last interval showed a standing queue */
+	uint8_t					overloaded;
 } fastcgi_context_t;
 
 /* Create a klunk context used for handling FCGI requests */
 fastcgi_context_t* fastcgi_create();
 
+/* Create a klunk context where the context, its requests and their buffers
+ * are allocated by alloc, zero means the default allocator. The default
+ * allocator is set with fastcgi_set_allocator.
+ */
+fastcgi_context_t* fastcgi_create_with_allocator(
+	const fastcgi_allocator_t *alloc);
+
+/* Same as fastcgi_create_with_allocator with the buffers taking their
+ * slabs from pool, so contexts can share the slabs they keep for reuse.
+ * pool must outlive the context, zero gives the context a pool of its own
+ * keeping up to FASTCGI_POOL_FREE_BYTES.
+ */
+fastcgi_context_t* fastcgi_create_with_pool(const fastcgi_allocator_t *alloc
+	, slab_pool_t *pool);
+
 /* Destroy the klunk context */
 void fastcgi_destroy(fastcgi_context_t *ctx);
 
+/* Return the context to the state of a newly created one so it can serve
+ * another connection. Requests are recycled, buffered input and control
+ * records are dropped. Memory is kept for reuse and the policies and
+ * limits set on the context stay in effect. The abort handler is cleared,
+ * its user data usually belongs to the connection.
+ * Negative return value means error.
+ */
+int32_t fastcgi_context_reset(fastcgi_context_t *ctx);
+
 /* Get the current request id.
  * Negative return value means error.
  */
@@ -68,20 +279,218 @@ int32_t fastcgi_write_error(fastcgi_context_t *ctx
  */
 int32_t fastcgi_finish(fastcgi_context_t *ctx, const uint16_t request_id);
 
-/* 
+/* Generate records for the request into output. Returns number of bytes
+ * written, zero when the output policy holds the buffered data back.
  * Negative return value means error.
  */
 int32_t fastcgi_write(fastcgi_context_t *ctx
 	, char *output, const size_t output_len
 	, const uint16_t request_id);
 
+/* Same as fastcgi_write but describe the records as iovecs for writev,
+ * content is referenced where it is buffered, see
+ * fastcgi_request_output_iov. Call fastcgi_write_consume once the iovecs
+ * have been written. Returns number of bytes described by the iovecs.
+ * Negative return value means error.
+ */
+int32_t fastcgi_write_iov(fastcgi_context_t *ctx, fastcgi_iovec_t *vec
+	, const uint16_t request_id);
+
+/* Remove what fastcgi_write_iov described, len is the length it returned.
+ * A finished or aborted request is returned to the pool.
+ * Negative return value means error.
+ */
+int32_t fastcgi_write_consume(fastcgi_context_t *ctx
+	, const uint16_t request_id, const size_t len);
+
+/* Set the output coalescing policy used by fastcgi_write.
+ * Negative return value means error.
+ */
+int32_t fastcgi_set_output_policy(fastcgi_context_t *ctx
+	, const fastcgi_output_policy_t *policy);
+
+/* Set the record sizing targets, applies to requests begun after the call.
+ * Negative return value means error.
+ */
+int32_t fastcgi_set_record_policy(fastcgi_context_t *ctx
+	, const fastcgi_record_policy_t *policy);
+
+/* Set the admission control applied to new requests.
+ * Negative return value means error.
+ */
+int32_t fastcgi_set_admission_policy(fastcgi_context_t *ctx
+	, const fastcgi_admission_policy_t *policy);
+
+/* Set the input flow control bounds.
+ * Negative return value means error.
+ */
+int32_t fastcgi_set_flow_policy(fastcgi_context_t *ctx
+	, const fastcgi_flow_policy_t *policy);
+
+/* Check if reading is paused by the flow policy. Returns 1 while the record
+ * fastcgi_read stopped in front of is still held back, 0 once it may be
+ * passed again.
+ * Negative return value means error.
+ */
+int32_t fastcgi_paused(fastcgi_context_t *ctx);
+
+/* Give requests begun after the call an arena of block_size byte blocks for
+ * their parameters and fastcgi_request_alloc, zero disables arenas for new
+ * requests. The arena is released at once when the request is recycled.
+ * Negative return value means error.
+ */
+int32_t fastcgi_set_request_arena(fastcgi_context_t *ctx
+	, const size_t block_size);
+
+/* Set the function called when the web server aborts a request. The
+ * request has FASTCGI_RS_ABORT set during the call, afterwards it is ended
+ * and recycled so the id of an aborted request is no longer found. When
+ * fastcgi_write_iov has described output not yet consumed the request stays
+ * until fastcgi_write_consume, nothing more is sent for it and no second
+ * END_REQUEST is queued if the described one holds it. func may
+ * be zero. fastcgi_context_reset, and so fastcgi_context_release, clears
+ * the handler, set it again for every connection.
+ * Negative return value means error.
+ */
+int32_t fastcgi_set_abort_handler(fastcgi_context_t *ctx
+	, fastcgi_abort_func func, void *user_data);
+
+/* Check if the connection of the context should be closed now. Never
+ * while a request is live or control records are waiting, otherwise when a
+ * request begun without FCGI_KEEP_CONN has ended or when the connection
+ * has been idle for longer than the idle timeout. Returns 1 to close, 0 to
+ * keep the connection.
+ * Negative return value means error.
+ */
+int32_t fastcgi_should_close(fastcgi_context_t *ctx);
+
+/* Close connections without live requests after usec microseconds without
+ * reads or writes, zero disables idle reaping. Poll fastcgi_should_close
+ * when fastcgi_idle_timeout expires.
+ * Negative return value means error.
+ */
+int32_t fastcgi_set_idle_timeout(fastcgi_context_t *ctx, const uint32_t usec);
+
+/* Get the number of microseconds until the connection is idle for longer
+ * than the idle timeout, zero if it already is. Returns 0x7fffffff when no
+ * reaping is pending, like while requests are live.
+ * Negative return value means error.
+ */
+int32_t fastcgi_idle_timeout(fastcgi_context_t *ctx);
+
+/* Set the values answered to FCGI_GET_VALUES queries. The answers are
+ * encoded once here, queries are answered on the control queue. With
+ * mpxs_conns zero a second concurrent request is ended with
+ * FCGI_CANT_MPX_CONN.
+ * Negative return value means error.
+ */
+int32_t fastcgi_set_values(fastcgi_context_t *ctx
+	, const fastcgi_values_t *values);
+
+/* Move the content of requests begun after the call to a file once it
+ * grows beyond threshold bytes, zero keeps all content in memory. The whole
+ * content is still available at STDIN_DONE through
+ * fastcgi_request_content_view or fastcgi_request_content_fd. The FCGI_DATA
+ * of filter requests is spilled the same way, see fastcgi_request_data_view.
+ * Spilled bytes do not count against max_buffered.
+ * Negative return value means error.
+ */
+int32_t fastcgi_set_spill_threshold(fastcgi_context_t *ctx
+	, const size_t threshold);
+
+/* Set the capacity limits. Requests already over a lowered limit are ended
+ * the next time they buffer data.
+ * Negative return value means error.
+ */
+int32_t fastcgi_set_limits(fastcgi_context_t *ctx
+	, const fastcgi_limits_t *limits);
+
+/* Get the number of bytes of control records waiting to be sent. Control
+ * records, like the END_REQUEST of a rejected request, are not tied to a
+ * live request and are taken out with fastcgi_write_control.
+ * Negative return value means error.
+ */
+int32_t fastcgi_control_pending(fastcgi_context_t *ctx);
+
+/* Generate queued control records into output, only whole records are
+ * written. Returns number of bytes written.
+ * Negative return value means error.
+ */
+int32_t fastcgi_write_control(fastcgi_context_t *ctx
+	, char *output, const size_t output_len);
+
+/* Get the usage statistics of the memory pool shared by the requests.
+ * Negative return value means error.
+ */
+int32_t fastcgi_pool_stats(fastcgi_context_t *ctx, slab_stats_t *stats);
+
+/* Get the number of microseconds until buffered output for the request is
+ * due, zero if it is due now. Returns 0x7fffffff when no timed flush is
+ * pending.
+ * Negative return value means error.
+ */
+int32_t fastcgi_flush_timeout(fastcgi_context_t *ctx, const uint16_t request_id);
+
+/* Get the number of bytes fastcgi_respond needs for content_len bytes of
+ * headers and body.
+ * Negative return value means error.
+ */
+int32_t fastcgi_respond_size(fastcgi_context_t *ctx, const uint16_t request_id
+	, const size_t content_len);
+
+/* Respond with a complete response in one pass. Generates the STDOUT
+ * records, the closing empty STDOUT and END_REQUEST into output and returns
+ * the request to the pool. Returns number of bytes written.
+ * Negative return value means error.
+ */
+int32_t fastcgi_respond(fastcgi_context_t *ctx, const uint16_t request_id
+	, const char *headers, const size_t headers_len
+	, const char *body, const size_t body_len
+	, const uint32_t app_status
+	, char *output, const size_t output_len);
+
+/* Same as fastcgi_respond but describe the response as iovecs for writev.
+ * Returns number of bytes described by the iovecs.
+ * Negative return value means error.
+ */
+int32_t fastcgi_respond_iov(fastcgi_context_t *ctx, const uint16_t request_id
+	, const char *headers, const size_t headers_len
+	, const char *body, const size_t body_len
+	, const uint32_t app_status
+	, fastcgi_iovec_t *vec);
+
+/* Drop the STDIN and FCGI_DATA received so far for the request, and drop
+ * the rest as it arrives without buffering it. The request still reaches
+ * FASTCGI_RS_STDIN_DONE when the body ends.
+ *
+ * A handler may start at FASTCGI_RS_PARAMS_DONE instead of STDIN_DONE. It
+ * can read the body as it grows through fastcgi_request_content_view, or
+ * call this to skip it. Responses, including fastcgi_respond, may be
+ * generated before the body has fully arrived. Once the request has ended
+ * the records still in flight for it are dropped the same way.
+ * Negative return value means error.
+ */
+int32_t fastcgi_discard_input(fastcgi_context_t *ctx
+	, const uint16_t request_id);
+
+/* Answer an authorizer request with status, 200 grants access, and the
+ * header lines in headers, like "Variable-USER: name\r\n". Generates the
+ * response into output and returns the request to the pool, see
+ * fastcgi_request_authorize. Returns number of bytes written.
+ * Negative return value means error.
+ */
+int32_t fastcgi_authorize(fastcgi_context_t *ctx, const uint16_t request_id
+	, const uint16_t status, const char *headers, const size_t headers_len
+	, char *output, const size_t output_len);
+
 /* Find and return the request with the supplied id. return zero if the 
  * request object wasn't found.
  */
 fastcgi_request_t* fastcgi_find_request(fastcgi_context_t *ctx, const uint16_t id);
 
 /* Find and return the request with the supplied id, removing it from the
- * internal list. return zero if the request object wasn't found.
+ * context. The caller owns the request and destroys it with
+ * fastcgi_request_destroy. return zero if the request object wasn't found.
  */
 fastcgi_request_t* fastcgi_take_request(fastcgi_context_t *ctx, const uint16_t id);
 
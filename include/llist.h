@@ -9,6 +9,8 @@
 #include <stdint.h>
 #include <string.h>
 
+#include "allocator.h"
+
 typedef void (*llist_item_dtor_func)(void*);
 typedef int32_t (*llist_iterator_func)(void* data, void *user_data);
 
@@ -19,22 +21,43 @@ typedef struct llist_item_ {
 
 typedef struct llist_ {
 	llist_item_t			*items;
+	/* Last item, appending does not walk the list */
+	llist_item_t			*tail;
 	size_t					item_size;
 	llist_item_dtor_func	item_dtor;
+	const fastcgi_allocator_t	*alloc;
 } llist_t;
 
 /* Create a linked list */
 llist_t*		llist_create(const size_t item_size);
 
+/* Create a linked list allocating the list and its items by alloc, zero means
+ * the default allocator.
+ */
+llist_t*		llist_create_with_allocator(const size_t item_size
+	, const fastcgi_allocator_t *alloc);
+
 /* Destroy the linked list */
 void 			llist_destroy(llist_t *list);
 
-/* Register user supplied destructor, set item_dtor to zero (0) to use free */
+/* Register user supplied destructor, set item_dtor to zero (0) to free the
+ * data through the allocator of the list.
+ */
 int32_t			llist_register_dtor(llist_t *list, llist_item_dtor_func item_dtor);
 
 /* Add a new item to the linked list */
 int32_t			llist_add(llist_t *list, void *data, const size_t item_size);
 
+/* Add an item owned by the caller to the end of the linked list, the list
+ * never frees the item or its data.
+ */
+int32_t			llist_add_item(llist_t *list, llist_item_t *item);
+
+/* Forget all items without destroying them, only for lists where every item
+ * was added by llist_add_item.
+ */
+void			llist_release(llist_t *list);
+
 /* Take a item from the linked list without destroying it */
 int32_t			llist_take(llist_t *list, const void *data);
 
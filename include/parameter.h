@@ -9,6 +9,8 @@
 #include <stdlib.h>
 #include <stdint.h>
 
+#include "allocator.h"
+
 typedef struct fastcgi_param_  {
 	size_t		name_allocated;
 	size_t		value_allocated;
@@ -16,12 +18,20 @@ typedef struct fastcgi_param_  {
 	size_t		value_len;
 	char		*name;
 	char		*value;
+	const fastcgi_allocator_t	*alloc;
 } fastcgi_parameter_t;
 
 /* Create a param "object" with the provided key/value pair */
 fastcgi_parameter_t* fastcgi_parameter_create(const char *name, const size_t name_len
 	, const char *value, const size_t value_len);
 
+/* Same as fastcgi_parameter_create with the memory allocated by alloc, zero
+ * means the default allocator.
+ */
+fastcgi_parameter_t* fastcgi_parameter_create_with_allocator(const char *name
+	, const size_t name_len, const char *value, const size_t value_len
+	, const fastcgi_allocator_t *alloc);
+
 /* Destroy a param "object" */
 void fastcgi_parameter_destroy(fastcgi_parameter_t *param);
 
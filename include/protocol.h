@@ -12,6 +12,11 @@ enum {
 	FCGI_VERSION_1		= 1
 };
 
+/* Request id of management records */
+enum {
+	FCGI_NULL_REQUEST_ID	= 0
+};
+
 enum {
 	FCGI_BEGIN_REQUEST		= 1,
 	FCGI_ABORT_REQUEST		= 2,
@@ -27,6 +32,11 @@ enum {
 	FCGI_MAXTYPE			= FCGI_UNKNOWN_TYPE
 };
 
+/* fcgi_record_begin_t.flags, keep the connection open after the request */
+enum {
+	FCGI_KEEP_CONN			= 1
+};
+
 enum {
 	FCGI_RESPONDER			= 1,
 	FCGI_AUTHORIZER			= 2,
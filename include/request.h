@@ -7,8 +7,12 @@
 #define FASTCGI_REQUEST_H
 
 #include <stdint.h>
+#include <sys/uio.h>
 #include "llist.h"
 #include "buffer.h"
+#include "bufferlist.h"
+#include "slab.h"
+#include "arena.h"
 
 /* Request state flags
  */
@@ -24,31 +28,123 @@ enum {
 	FASTCGI_RS_STDERR				= (1 << 7),
 	FASTCGI_RS_STDERR_DONE		= (1 << 8),
 	FASTCGI_RS_FINISH				= (1 << 9),
-	FASTCGI_RS_FINISHED			= (1 << 10)
+	FASTCGI_RS_FINISHED			= (1 << 10),
+	/* The web server aborted the request */
+	FASTCGI_RS_ABORT				= (1 << 11),
+	/* FCGI_DATA stream of filter requests */
+	FASTCGI_RS_DATA				= (1 << 12),
+	FASTCGI_RS_DATA_DONE			= (1 << 13),
+	/* The rest of STDIN and FCGI_DATA is dropped as it arrives */
+	FASTCGI_RS_DISCARD			= (1 << 14)
 };
 
+/* Bytes of an input stream moved from memory to a file */
+typedef struct fastcgi_spill_  {
+	/* File holding the bytes once spilled, -1 until then */
+	int32_t			fd;
+	size_t			spilled;
+	/* Read-only view of the spilled bytes, zero when not mapped */
+	char			*map;
+	size_t			map_len;
+} fastcgi_spill_t;
+
+/* The fields read for every PARAMS and STDIN record, up to and including
+ * spill_threshold, take the first 64 bytes on LP64. The spill state and
+ * FCGI_DATA follow the fields used when the response is generated or the
+ * request is reset.
+ */
 typedef struct fastcgi_request_  {
 	uint16_t        id;
-	uint16_t        role;
 	uint16_t		state;
+	uint16_t        role;
 	uint8_t         flags;
 	uint8_t         protocol_status;
-	uint32_t		app_status;
+	/* Pad generated records to 8 bytes */
+	uint8_t			padding;
+	/* Largest content length of a generated STDOUT/STDERR record */
+	uint16_t		record_size;
+	/* Number of parameters added since the request was reset */
+	uint32_t		param_count;
+	/* Created on first use, zero until then */
 	llist_t			*params;
 	buffer_t		*content;
-	buffer_t		*output;
-	buffer_t		*error;
+	/* Memory pool for content and output, may be zero */
+	slab_pool_t		*pool;
+	/* Bytes charged to the context quota since the request was reset */
+	size_t			buffered;
+	/* Content or data beyond this many bytes goes to a file, zero keeps it
+	 * in memory */
+	size_t			spill_threshold;
+	bufferlist_t	*output;
+	bufferlist_t	*error;
+	/* Count of the context the charge is also held in, may be zero */
+	size_t			*quota;
+	uint32_t		app_status;
+	/* Time when output was first buffered, see fastcgi_time_usec */
+	uint64_t		output_since;
+	/* Bytes described by fastcgi_request_output_iov and not yet consumed,
+	 * and how much of the error and output content they cover */
+	uint32_t		described_len;
+	uint32_t		described_error;
+	uint32_t		described_output;
+	/* Memory released when the request is reset, may be zero */
+	arena_t			*arena;
+	const fastcgi_allocator_t	*alloc;
+	fastcgi_spill_t	content_spill;
+	/* FCGI_DATA of filter requests, created on first use */
+	buffer_t		*data;
+	fastcgi_spill_t	data_spill;
+	/* Time the request began, set when admission control tracks it and
+	 * cleared once its queue delay is sampled */
+	uint64_t		begun_at;
+	/* Next recycled request of the context, see fastcgi_context_t */
+	struct fastcgi_request_	*next_free;
 } fastcgi_request_t;
 
+/* Scatter/gather destination for a complete response. Record headers and
+ * padding are put in scratch, content is referenced where it lies.
+ */
+typedef struct fastcgi_iovec_  {
+	struct iovec	*iov;
+	int32_t			iov_count;
+	int32_t			iov_used;
+	char			*scratch;
+	size_t			scratch_len;
+} fastcgi_iovec_t;
+
 /* Create a request "object" */
 fastcgi_request_t* fastcgi_request_create();
 
+/* Create the request "object" with its memory allocated by alloc, zero means
+ * the default allocator.
+ */
+fastcgi_request_t* fastcgi_request_create_with_allocator(
+	const fastcgi_allocator_t *alloc);
+
 /* Destroy the request "object" */
 void fastcgi_request_destroy(fastcgi_request_t *request);
 
 /* Reset the request "object" */
 void fastcgi_request_reset(fastcgi_request_t *request);
 
+/* Take the output and error segments and the content memory from pool, the
+ * request must not have any buffered output.
+ * Negative return value means error.
+ */
+int32_t fastcgi_request_set_pool(fastcgi_request_t *request, slab_pool_t *pool);
+
+/* Give the request an arena from which its parameters and the memory from
+ * fastcgi_request_alloc are taken, must be called on a reset request.
+ * Negative return value means error.
+ */
+int32_t fastcgi_request_create_arena(fastcgi_request_t *request
+	, slab_pool_t *pool, const size_t block_size);
+
+/* Allocate size bytes from the request arena, the memory is valid until the
+ * request is reset. Returns zero if the request has no arena or on failure.
+ */
+void* fastcgi_request_alloc(fastcgi_request_t *request, const size_t size);
+
 /* Get request state */
 int32_t fastcgi_request_get_state(fastcgi_request_t *request, const uint16_t mask);
 
@@ -74,16 +170,139 @@ int32_t fastcgi_request_write_output(fastcgi_request_t *request
 int32_t fastcgi_request_write_error(fastcgi_request_t *request
 	, const char *input, const size_t input_len);
 
+/* Append STDIN content to the request content.
+ * Negative return value means error.
+ */
+int32_t fastcgi_request_write_input(fastcgi_request_t *request
+	, const char *input, const size_t input_len);
+
+/* Check if appending input_len bytes of content moves the content of the
+ * request from memory to a file.
+ */
+int32_t fastcgi_request_spills(fastcgi_request_t *request
+	, const size_t input_len);
+
+/* Get the number of content bytes received, in memory or spilled */
+size_t fastcgi_request_content_length(fastcgi_request_t *request);
+
+/* Get a read-only view of the whole content. Content spilled to a file is
+ * mapped, the view stays valid until more content arrives or the request
+ * is reset. data is zero when there is no content.
+ * Negative return value means error.
+ */
+int32_t fastcgi_request_content_view(fastcgi_request_t *request
+	, const char **data, size_t *len);
+
+/* Get a file descriptor holding the content, content still in memory is
+ * spilled first and is no longer charged as buffered. The file offset is at the end of the content, read it with
+ * pread or mmap. The descriptor is closed when the request is reset, dup it
+ * to keep it longer.
+ * Negative return value means error.
+ */
+int32_t fastcgi_request_content_fd(fastcgi_request_t *request);
+
+/* Drop the content and data received so far and mark the request so that
+ * the rest is dropped as it arrives.
+ * Negative return value means error.
+ */
+int32_t fastcgi_request_discard_input(fastcgi_request_t *request);
+
+/* Append FCGI_DATA to the data of a filter request. The data is spilled to
+ * a file like the content.
+ * Negative return value means error.
+ */
+int32_t fastcgi_request_write_data(fastcgi_request_t *request
+	, const char *input, const size_t input_len);
+
+/* Check if appending input_len bytes of data moves the data of the request
+ * from memory to a file.
+ */
+int32_t fastcgi_request_data_spills(fastcgi_request_t *request
+	, const size_t input_len);
+
+/* Get the number of FCGI_DATA bytes received, in memory or spilled */
+size_t fastcgi_request_data_length(fastcgi_request_t *request);
+
+/* Get a read-only view of the whole data, see fastcgi_request_content_view.
+ * Negative return value means error.
+ */
+int32_t fastcgi_request_data_view(fastcgi_request_t *request
+	, const char **data, size_t *len);
+
+/* Get a file descriptor holding the data, see fastcgi_request_content_fd.
+ * Negative return value means error.
+ */
+int32_t fastcgi_request_data_fd(fastcgi_request_t *request);
+
 /* Mark the request as finished.
  * Negative return value means error.
  */
 int32_t fastcgi_request_finish(fastcgi_request_t *request
 	, const uint32_t app_status, const uint8_t protocol_status);
 
-/* Generate FCGI records from request.
+/* Generate FCGI records from request. The content length of each record
+ * is limited by output_len and request->record_size.
  * Negative return value means error.
  */
 int32_t fastcgi_request_output(fastcgi_request_t *request
 	, char *output, const size_t output_len);
 
+/* Describe the buffered error and output as records for writev, record
+ * headers and padding are put in vec->scratch and content is referenced in
+ * the output segments. The closing records follow when the request is
+ * finished and everything fits. Nothing is removed until
+ * fastcgi_request_output_consume, the request must not be written to or
+ * output from until then. Returns number of bytes described by the
+ * iovecs, zero if there is nothing to describe.
+ * Negative return value means error.
+ */
+int32_t fastcgi_request_output_iov(fastcgi_request_t *request
+	, fastcgi_iovec_t *vec);
+
+/* Remove the content described by fastcgi_request_output_iov once the
+ * iovecs have been written, len is the length it returned.
+ * Negative return value means error.
+ */
+int32_t fastcgi_request_output_consume(fastcgi_request_t *request
+	, const size_t len);
+
+/* Get the number of bytes needed to respond with content_len bytes of
+ * STDOUT content through fastcgi_request_respond.
+ * Negative return value means error.
+ */
+int32_t fastcgi_request_respond_size(fastcgi_request_t *request
+	, const size_t content_len);
+
+/* Generate the complete response, headers and body as STDOUT followed by
+ * the closing empty STDOUT and END_REQUEST, and mark the request finished.
+ * Nothing may be buffered for the request. Returns number of bytes written.
+ * Negative return value means error.
+ */
+int32_t fastcgi_request_respond(fastcgi_request_t *request
+	, const char *headers, const size_t headers_len
+	, const char *body, const size_t body_len
+	, const uint32_t app_status
+	, char *output, const size_t output_len);
+
+/* Same as fastcgi_request_respond but describe the response as iovecs,
+ * headers and body must stay untouched until the iovecs have been written.
+ * Returns number of bytes described by the iovecs.
+ * Negative return value means error.
+ */
+int32_t fastcgi_request_respond_iov(fastcgi_request_t *request
+	, const char *headers, const size_t headers_len
+	, const char *body, const size_t body_len
+	, const uint32_t app_status
+	, fastcgi_iovec_t *vec);
+
+/* Generate the complete response of an authorizer: "Status: <status>" and
+ * the header lines in headers, each ending with CRLF, in a single STDOUT
+ * record followed by the closing empty STDOUT and END_REQUEST. The response
+ * must fit one record of record_size bytes. Returns number of bytes written.
+ * Negative return value means error.
+ */
+int32_t fastcgi_request_authorize(fastcgi_request_t *request
+	, const uint16_t status, const char *headers, const size_t headers_len
+	, char *output, const size_t output_len);
+
 #endif /* FASTCGI_REQUEST_H */
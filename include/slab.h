@@ -0,0 +1,81 @@
+/* A pool of memory slabs in a few size classes
+ * (C) 2021 Erik Svensson <erik.public@gmail.com>
+ * Licensed under the MIT license.
+ */
+
+#ifndef ES_SLAB_H
+#define ES_SLAB_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include "allocator.h"
+
+/* Slab sizes are SLAB_MIN_SIZE times a power of four */
+enum {
+	SLAB_CLASSES				= 5,
+	SLAB_MIN_SIZE				= 256,
+	SLAB_MAX_SIZE				= (SLAB_MIN_SIZE << (2 * (SLAB_CLASSES - 1)))
+};
+
+typedef struct slab_free_ {
+	struct slab_free_	*next;
+} slab_free_t;
+
+typedef struct slab_class_ {
+	size_t			size;
+	size_t			in_use;
+	size_t			free_count;
+	slab_free_t		*free;
+} slab_class_t;
+
+typedef struct slab_stats_ {
+	/* Slabs handed out and not yet returned */
+	size_t			slabs_in_use;
+	size_t			bytes_in_use;
+	/* Returned slabs kept for reuse */
+	size_t			slabs_free;
+	size_t			bytes_free;
+	/* Number of slabs handed out, and how many of those were allocated */
+	size_t			allocs;
+	size_t			misses;
+} slab_stats_t;
+
+typedef struct slab_pool_ {
+	slab_class_t	classes[SLAB_CLASSES];
+	size_t			free_bytes_max;
+	slab_stats_t	stats;
+	const fastcgi_allocator_t	*alloc;
+} slab_pool_t;
+
+/* Create a pool, keeping at most free_bytes_max bytes of returned slabs
+ * for reuse.
+ */
+slab_pool_t*	slab_pool_create(const size_t free_bytes_max);
+
+/* Same as slab_pool_create with the pool and the slabs allocated by alloc,
+ * zero means the default allocator.
+ */
+slab_pool_t*	slab_pool_create_with_allocator(const size_t free_bytes_max
+	, const fastcgi_allocator_t *alloc);
+
+/* Destroy the pool and the free slabs, slabs in use must be returned first */
+void			slab_pool_destroy(slab_pool_t *pool);
+
+/* Get the size of the slab handed out for a request of size bytes, zero if
+ * size is larger than SLAB_MAX_SIZE.
+ */
+size_t			slab_size(slab_pool_t *pool, const size_t size);
+
+/* Take a slab of at least size bytes from the pool, allocating one if there
+ * are no free slabs of the size class.
+ */
+void*			slab_alloc(slab_pool_t *pool, const size_t size);
+
+/* Return a slab taken for size bytes to the pool */
+void			slab_free(slab_pool_t *pool, void *slab, const size_t size);
+
+/* Get the pool statistics */
+int32_t			slab_pool_stats(slab_pool_t *pool, slab_stats_t *stats);
+
+#endif /* ES_SLAB_H */
@@ -11,4 +11,7 @@
 
 uint16_t size8b(const uint16_t size);
 
+/* Monotonic time in microseconds */
+uint64_t fastcgi_time_usec();
+
 #endif /* FASTCGI_UTILITIES_H */
@@ -0,0 +1,195 @@
+/* Memory allocation hooks
+ * (C) 2021 Erik Svensson <erik.public@gmail.com>
+ * Licensed under the MIT licence.
+ */
+
+#include <stdlib.h>
+
+#include "allocator.h"
+#include "errorcodes.h"
+
+void* fastcgi_system_malloc(size_t size, void *user)
+{
+	(void)user;
+	return malloc(size);
+}
+
+void* fastcgi_system_realloc(void *ptr, size_t size, void *user)
+{
+	(void)user;
+	return realloc(ptr, size);
+}
+
+void fastcgi_system_free(void *ptr, void *user)
+{
+	(void)user;
+	free(ptr);
+}
+
+static const fastcgi_allocator_t system_allocator = {
+	.malloc = fastcgi_system_malloc,
+	.realloc = fastcgi_system_realloc,
+	.free = fastcgi_system_free,
+	.user = 0
+};
+
+#ifdef FASTCGI_STATIC
+
+/* Blocks of the static region start with this header, a block of class n is
+ * (STATIC_MIN_SIZE << n) bytes including the header.
+ */
+typedef struct static_block_ {
+	struct static_block_	*next;
+	size_t					cls;
+} static_block_t;
+
+enum {
+	STATIC_MIN_SIZE				= 32,
+	STATIC_CLASSES				= 32
+};
+
+static union {
+	char		data[FASTCGI_STATIC_MEMORY];
+	long double	align;
+} static_memory;
+static size_t static_used = 0;
+static static_block_t *static_free[STATIC_CLASSES];
+
+void* fastcgi_static_malloc(size_t size, void *user)
+{
+	size_t cls = 0;
+	size_t block_size = STATIC_MIN_SIZE;
+	static_block_t *block = 0;
+	(void)user;
+
+	while (block_size < size + sizeof(static_block_t)) {
+		block_size <<= 1;
+		cls++;
+	}
+	if (cls >= STATIC_CLASSES) {
+		return 0;
+	}
+	if (static_free[cls] != 0) {
+		block = static_free[cls];
+		static_free[cls] = block->next;
+	}
+	else if (block_size <= sizeof(static_memory.data) - static_used) {
+		block = (static_block_t*)(static_memory.data + static_used);
+		static_used += block_size;
+	}
+	else {
+		return 0;
+	}
+	block->next = 0;
+	block->cls = cls;
+	return (char*)block + sizeof(static_block_t);
+}
+
+void fastcgi_static_free(void *ptr, void *user)
+{
+	static_block_t *block = 0;
+	(void)user;
+	if (ptr == 0) {
+		return;
+	}
+	block = (static_block_t*)((char*)ptr - sizeof(static_block_t));
+	block->next = static_free[block->cls];
+	static_free[block->cls] = block;
+}
+
+void* fastcgi_static_realloc(void *ptr, size_t size, void *user)
+{
+	static_block_t *block = 0;
+	size_t block_len = 0;
+	void *data = 0;
+
+	if (ptr == 0) {
+		return fastcgi_static_malloc(size, user);
+	}
+	block = (static_block_t*)((char*)ptr - sizeof(static_block_t));
+	block_len = ((size_t)STATIC_MIN_SIZE << block->cls) - sizeof(static_block_t);
+	if (size <= block_len) {
+		return ptr;
+	}
+	data = fastcgi_static_malloc(size, user);
+	if (data != 0) {
+		memcpy(data, ptr, block_len);
+		fastcgi_static_free(ptr, user);
+	}
+	return data;
+}
+
+static const fastcgi_allocator_t static_allocator = {
+	.malloc = fastcgi_static_malloc,
+	.realloc = fastcgi_static_realloc,
+	.free = fastcgi_static_free,
+	.user = 0
+};
+
+const fastcgi_allocator_t* fastcgi_static_allocator()
+{
+	return &static_allocator;
+}
+
+size_t fastcgi_static_used()
+{
+	return static_used;
+}
+
+static const fastcgi_allocator_t *build_allocator = &static_allocator;
+static const fastcgi_allocator_t *default_allocator = &static_allocator;
+#else
+static const fastcgi_allocator_t *build_allocator = &system_allocator;
+static const fastcgi_allocator_t *default_allocator = &system_allocator;
+#endif
+
+int32_t fastcgi_set_allocator(const fastcgi_allocator_t *alloc)
+{
+	if (alloc == 0) {
+		default_allocator = build_allocator;
+		return E_SUCCESS;
+	}
+	if (alloc->malloc == 0 || alloc->realloc == 0 || alloc->free == 0) {
+		return E_INVALID_ARGUMENT;
+	}
+	default_allocator = alloc;
+	return E_SUCCESS;
+}
+
+const fastcgi_allocator_t* fastcgi_default_allocator()
+{
+	return default_allocator;
+}
+
+const fastcgi_allocator_t* fastcgi_system_allocator()
+{
+	return &system_allocator;
+}
+
+void* fastcgi_malloc(const fastcgi_allocator_t *alloc, const size_t size)
+{
+	if (alloc == 0) {
+		alloc = default_allocator;
+	}
+	return (*(alloc->malloc))(size, alloc->user);
+}
+
+void* fastcgi_realloc(const fastcgi_allocator_t *alloc, void *ptr
+	, const size_t size)
+{
+	if (alloc == 0) {
+		alloc = default_allocator;
+	}
+	return (*(alloc->realloc))(ptr, size, alloc->user);
+}
+
+void fastcgi_free(const fastcgi_allocator_t *alloc, void *ptr)
+{
+	if (ptr == 0) {
+		return;
+	}
+	if (alloc == 0) {
+		alloc = default_allocator;
+	}
+	(*(alloc->free))(ptr, alloc->user);
+}
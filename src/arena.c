@@ -0,0 +1,122 @@
+/* A bump pointer memory arena
+ * (C) 2021 Erik Svensson <erik.public@gmail.com>
+ * Licensed under the MIT licence.
+ */
+
+#include <stdlib.h>
+
+#include "arena.h"
+#include "errorcodes.h"
+
+/* Alignment of the allocations, the block header keeps data aligned to it */
+static const size_t ARENA_ALIGN = sizeof(void*);
+
+arena_block_t* arena_block_create(arena_t *arena, const size_t len)
+{
+	arena_block_t *block = 0;
+	size_t block_len = sizeof(arena_block_t) + len;
+
+	if (block_len < arena->block_size) {
+		block_len = arena->block_size;
+	}
+	if (slab_size(arena->pool, block_len) > 0) {
+		block_len = slab_size(arena->pool, block_len);
+		block = slab_alloc(arena->pool, block_len);
+	}
+	else {
+		block = fastcgi_malloc(arena->alloc, block_len);
+	}
+	if (block != 0) {
+		block->next = 0;
+		block->size = block_len - sizeof(arena_block_t);
+		block->used = 0;
+	}
+	return block;
+}
+
+void arena_block_destroy(arena_t *arena, arena_block_t *block)
+{
+	size_t block_len = sizeof(arena_block_t) + block->size;
+	if (slab_size(arena->pool, block_len) == block_len) {
+		slab_free(arena->pool, block, block_len);
+	}
+	else {
+		fastcgi_free(arena->alloc, block);
+	}
+}
+
+arena_t* arena_create(slab_pool_t *pool, const size_t block_size)
+{
+	const fastcgi_allocator_t *alloc = pool != 0 ? pool->alloc
+		: fastcgi_default_allocator();
+	arena_t *arena = fastcgi_malloc(alloc, sizeof(arena_t));
+	if (arena != 0) {
+		arena->alloc = alloc;
+		arena->head = 0;
+		arena->block_size = block_size;
+		arena->used = 0;
+		arena->pool = pool;
+	}
+	return arena;
+}
+
+void arena_destroy(arena_t *arena)
+{
+	arena_block_t *next = 0;
+	if (arena != 0) {
+		while (arena->head != 0) {
+			next = arena->head->next;
+			arena_block_destroy(arena, arena->head);
+			arena->head = next;
+		}
+		fastcgi_free(arena->alloc, arena);
+	}
+}
+
+void* arena_alloc(arena_t *arena, const size_t size)
+{
+	arena_block_t *block = 0;
+	size_t len = ((size + ARENA_ALIGN - 1) / ARENA_ALIGN) * ARENA_ALIGN;
+	char *ptr = 0;
+
+	if (arena == 0 || size == 0) {
+		return 0;
+	}
+	block = arena->head;
+	if (block == 0 || len > block->size - block->used) {
+		block = arena_block_create(arena, len);
+		if (block == 0) {
+			return 0;
+		}
+		block->next = arena->head;
+		arena->head = block;
+	}
+	ptr = block->data + block->used;
+	block->used += len;
+	arena->used += len;
+	return ptr;
+}
+
+void arena_reset(arena_t *arena)
+{
+	arena_block_t *next = 0;
+	if (arena == 0 || arena->head == 0) {
+		return;
+	}
+	/* Keep the oldest block, later blocks are only needed by large requests */
+	while (arena->head->next != 0) {
+		next = arena->head->next;
+		arena_block_destroy(arena, arena->head);
+		arena->head = next;
+	}
+	arena->head->used = 0;
+	arena->used = 0;
+}
+
+size_t arena_used(arena_t *arena)
+{
+	if (arena != 0) {
+		return arena->used;
+	}
+	return 0;
+}
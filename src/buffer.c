@@ -3,40 +3,184 @@
  * Licensed under the MIT licence.
  */
 
+#define _GNU_SOURCE
 #include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 #include "buffer.h"
 #include "errorcodes.h"
 
 static const size_t CHUNK_SIZE = 4096;
+/* Flags telling where the data lives */
+static const uint32_t BUFFER_STORAGE = BUFFER_MAPPED | BUFFER_POOLED
+	| BUFFER_INLINE;
+
+/* Growth in percent of the current size */
+static uint32_t growth_factor = 200;
+/* Buffers of this size or larger are backed by anonymous mappings */
+static size_t mmap_threshold = 1024 * 1024;
+
+int32_t buffer_set_growth_factor(const uint32_t percent)
+{
+	if (percent < 100) {
+		return E_INVALID_ARGUMENT;
+	}
+	growth_factor = percent;
+	return E_SUCCESS;
+}
+
+void buffer_set_mmap_threshold(const size_t size)
+{
+	mmap_threshold = size;
+}
+
+/* Release the memory of the buffer */
+void buffer_release(buffer_t *buf)
+{
+	if (buf->data != 0) {
+		if ((buf->flags & BUFFER_MAPPED)) {
+			munmap(buf->data, buf->size);
+		}
+		else if ((buf->flags & BUFFER_POOLED)) {
+			slab_free(buf->pool, buf->data, buf->size);
+		}
+		else if ((buf->flags & BUFFER_INLINE) == 0) {
+			fastcgi_free(buf->alloc, buf->data);
+		}
+	}
+	buf->flags &= ~BUFFER_STORAGE;
+}
+
+/* Move the used bytes to the start of the buffer */
+void buffer_compact(buffer_t *buf)
+{
+	if (buf->offset > 0) {
+		if (buf->used > 0) {
+			memmove(buf->data, buf->data + buf->offset, buf->used);
+		}
+		buf->offset = 0;
+	}
+}
+
+/* Change the allocation to exactly size bytes, rounded up to the slab size
+ * for pooled buffers and to whole pages for mapped buffers. Sizes that fit
+ * a slab are taken from the pool, large buffers are moved by the kernel
+ * using mremap.
+ */
+int32_t buffer_allocate(buffer_t *buf, size_t size)
+{
+	char *data = 0;
+	uint32_t flags = 0;
+	size_t page_size = 0;
+
+	buffer_compact(buf);
+	if (buf->pool != 0 && slab_size(buf->pool, size) > 0) {
+		flags = BUFFER_POOLED;
+		size = slab_size(buf->pool, size);
+	}
+	else if (mmap_threshold > 0 && size >= mmap_threshold
+		&& buf->alloc == fastcgi_system_allocator()) {
+		flags = BUFFER_MAPPED;
+		page_size = (size_t)sysconf(_SC_PAGESIZE);
+		size = ((size + page_size - 1) / page_size) * page_size;
+	}
+#ifdef MREMAP_MAYMOVE
+	if (flags == BUFFER_MAPPED && (buf->flags & BUFFER_MAPPED)) {
+		data = mremap(buf->data, buf->size, size, MREMAP_MAYMOVE);
+		if (data == MAP_FAILED) {
+			return E_MEMORY_ALLOCATION_FAILED;
+		}
+	}
+	else
+#endif
+	if (flags == 0 && (buf->flags & BUFFER_STORAGE) == 0) {
+		data = fastcgi_realloc(buf->alloc, buf->data, size);
+		if (data == 0) {
+			return E_MEMORY_ALLOCATION_FAILED;
+		}
+	}
+	else {
+		if (flags == BUFFER_POOLED) {
+			data = slab_alloc(buf->pool, size);
+		}
+		else if (flags == BUFFER_MAPPED) {
+			data = mmap(0, size, PROT_READ | PROT_WRITE
+				, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			data = data == MAP_FAILED ? 0 : data;
+		}
+		else {
+			data = fastcgi_malloc(buf->alloc, size);
+		}
+		if (data == 0) {
+			return E_MEMORY_ALLOCATION_FAILED;
+		}
+		if (buf->used > 0) {
+			memcpy(data, buf->data, buf->used);
+		}
+		buffer_release(buf);
+	}
+	buf->data = data;
+	buf->size = size;
+	buf->flags = (buf->flags & ~BUFFER_STORAGE) | flags;
+	return E_SUCCESS;
+}
 
 buffer_t* buffer_create()
 {
-	buffer_t *buf = malloc(sizeof(buffer_t));
+	const fastcgi_allocator_t *alloc = fastcgi_default_allocator();
+	buffer_t *buf = fastcgi_malloc(alloc, sizeof(buffer_t));
 	if (buf != 0) {
-		buf->data = malloc(CHUNK_SIZE);
+		buf->alloc = alloc;
+		buf->data = fastcgi_malloc(alloc, CHUNK_SIZE);
 		if (buf->data == 0) {
-			free(buf);
+			fastcgi_free(alloc, buf);
 			buf = 0;
 		}
 		else {
 			buf->size = CHUNK_SIZE;
 			buf->used = 0;
+			buf->offset = 0;
+			buf->flags = 0;
+			buf->pool = 0;
 		}
 	}
 	return buf;
 }
 
+buffer_t* buffer_create_pooled(slab_pool_t *pool)
+{
+	const fastcgi_allocator_t *alloc = pool != 0 ? pool->alloc
+		: fastcgi_default_allocator();
+	buffer_t *buf = fastcgi_malloc(alloc, sizeof(buffer_t));
+	if (buf != 0) {
+		buffer_init_pooled(buf, pool);
+	}
+	return buf;
+}
+
+void buffer_init_pooled(buffer_t *buf, slab_pool_t *pool)
+{
+	buf->alloc = pool != 0 ? pool->alloc : fastcgi_default_allocator();
+	buf->data = 0;
+	buf->size = 0;
+	buf->used = 0;
+	buf->offset = 0;
+	buf->flags = BUFFER_LAZY;
+	buf->pool = pool;
+}
+
 void buffer_destroy(buffer_t *buf)
 {
 	if (buf != 0) {
 		if (buf->data != 0) {
-			free(buf->data);
+			buffer_release(buf);
 			buf->data = 0;
 			buf->size = 0;
 			buf->used = 0;
+			buf->offset = 0;
 		}
-		free(buf);
+		fastcgi_free(buf->alloc, buf);
 	}
 }
 
@@ -66,6 +210,7 @@ size_t buffer_free(buffer_t *buf)
 
 int32_t buffer_resize(buffer_t *buf, const size_t minsize)
 {
+	int32_t result = E_SUCCESS;
 	if (buf == 0) {
 		return E_INVALID_ARGUMENT;
 	}
@@ -73,17 +218,16 @@ int32_t buffer_resize(buffer_t *buf, const size_t minsize)
 	if (new_buffer_size < buf->size) {
 		return buf->size;
 	}
-	char *new_buffer_data = malloc(new_buffer_size);
-	if (new_buffer_data == 0) {
-		return E_MEMORY_ALLOCATION_FAILED;
+	/* Grow geometrically to keep the number of moves logarithmic */
+	size_t grown_size = (buf->size / 100) * growth_factor;
+	if (grown_size > new_buffer_size) {
+		new_buffer_size = grown_size;
 	}
-	if (buf->used > 0) {
-		memcpy(new_buffer_data, buf->data, buf->used);
+	result = buffer_allocate(buf, new_buffer_size);
+	if (result < 0) {
+		return result;
 	}
-	free(buf->data);
-	buf->size = new_buffer_size;
-	buf->data = new_buffer_data;
-	return new_buffer_size;
+	return buf->size;
 }
 
 int32_t buffer_read(buffer_t *buf, char *data, const size_t len)
@@ -96,16 +240,18 @@ int32_t buffer_read(buffer_t *buf, char *data, const size_t len)
 	}
 	/* Use the smallest of len and buf->used. */
 	size_t read_len = len > buf->used ? buf->used : len;
-	char * src_ptr = buf->data;
+	char * src_ptr = buf->data + buf->offset;
 	char * dst_ptr = data;
 	if (dst_ptr != 0) {
 		memcpy(dst_ptr, src_ptr, read_len);
 	}
-	size_t left = buf->used - read_len;
-	if (left > 0) {
-		memmove(buf->data, buf->data+read_len, left);
-	}
 	buf->used -= read_len;
+	if (buf->used > 0) {
+		buf->offset += read_len;
+	}
+	else {
+		buf->offset = 0;
+	}
 	return read_len;
 
 }
@@ -115,13 +261,24 @@ int32_t buffer_write(buffer_t *buf, const char *data, const size_t len)
 	if (buf == 0) {
 		return E_INVALID_ARGUMENT;
 	}
+	if (buf->data == 0 && len <= BUFFER_INLINE_SIZE) {
+		buf->data = buf->inline_data;
+		buf->size = BUFFER_INLINE_SIZE;
+		buf->flags |= BUFFER_INLINE;
+	}
 	if (len > buffer_free(buf)) {
 		int32_t result = buffer_resize(buf, buf->used + len);
 		if (result < 0) {
 			return result;
 		}
 	}
-	char *dst_ptr = buf->data + buf->used;
+	else if (len > buf->size - (buf->offset + buf->used)) {
+		buffer_compact(buf);
+	}
+	if (len == 0) {
+		return 0;
+	}
+	char *dst_ptr = buf->data + buf->offset + buf->used;
 	memcpy(dst_ptr, data, len);
 	buf->used += len;
 	return len;
@@ -135,7 +292,7 @@ char* buffer_peek(buffer_t *buf)
 	if (buf->size == 0) {
 		return 0;
 	}
-	return buf->data;
+	return buf->data + buf->offset;
 }
 
 void buffer_clear(buffer_t *buf)
@@ -144,6 +301,7 @@ void buffer_clear(buffer_t *buf)
 		return;
 	}
 	buf->used = 0;
+	buf->offset = 0;
 }
 
 int32_t buffer_reset(buffer_t *buf)
@@ -152,12 +310,17 @@ int32_t buffer_reset(buffer_t *buf)
 		return E_INVALID_ARGUMENT;
 	}
 	if (buf->data != 0) {
-		free(buf->data);
+		buffer_release(buf);
 		buf->data = 0;
 		buf->size = 0;
 		buf->used = 0;
+		buf->offset = 0;
 	}
-	buf->data = malloc(CHUNK_SIZE);
+	if ((buf->flags & BUFFER_LAZY)) {
+		/* Lazy buffers take memory again on the next write */
+		return 0;
+	}
+	buf->data = fastcgi_malloc(buf->alloc, CHUNK_SIZE);
 	if (buf->data != 0) {
 		buf->size = CHUNK_SIZE;
 		buf->used = 0;
@@ -170,5 +333,16 @@ int32_t buffer_reset(buffer_t *buf)
 
 int32_t buffer_reserve(buffer_t *buf, const size_t len)
 {
-	return buffer_resize(buf, len);
+	int32_t result = E_SUCCESS;
+	if (buf == 0) {
+		return E_INVALID_ARGUMENT;
+	}
+	if (len <= buf->size) {
+		return buf->size;
+	}
+	result = buffer_allocate(buf, len);
+	if (result < 0) {
+		return result;
+	}
+	return buf->size;
 }
\ No newline at end of file
@@ -0,0 +1,267 @@
+/* A chained memory buffer
+ * (C) 2021 Erik Svensson <erik.public@gmail.com>
+ * Licensed under the MIT licence.
+ */
+
+#include <stdlib.h>
+
+#include "bufferlist.h"
+#include "errorcodes.h"
+
+/* Segments start small and double up to this size */
+static const size_t SEGMENT_SIZE_MAX = 16384;
+
+bufferlist_segment_t* bufferlist_segment_create(bufferlist_t *list
+	, const size_t len)
+{
+	bufferlist_segment_t *segment = 0;
+	size_t slab_len = sizeof(bufferlist_segment_t) + len;
+
+	if (list->tail != 0) {
+		/* Double the size of the previous segment */
+		if (slab_len < 2 * (sizeof(bufferlist_segment_t) + list->tail->size)) {
+			slab_len = 2 * (sizeof(bufferlist_segment_t) + list->tail->size);
+		}
+	}
+	if (slab_len > SEGMENT_SIZE_MAX) {
+		slab_len = SEGMENT_SIZE_MAX;
+	}
+	if (list->pool != 0) {
+		slab_len = slab_size(list->pool, slab_len);
+		segment = slab_alloc(list->pool, slab_len);
+	}
+	else {
+		segment = fastcgi_malloc(list->alloc, slab_len);
+	}
+	if (segment != 0) {
+		segment->next = 0;
+		segment->size = slab_len - sizeof(bufferlist_segment_t);
+		segment->start = 0;
+		segment->end = 0;
+	}
+	return segment;
+}
+
+void bufferlist_segment_destroy(bufferlist_t *list
+	, bufferlist_segment_t *segment)
+{
+	if (list->pool != 0) {
+		slab_free(list->pool, segment
+			, sizeof(bufferlist_segment_t) + segment->size);
+	}
+	else {
+		fastcgi_free(list->alloc, segment);
+	}
+}
+
+bufferlist_t* bufferlist_create(slab_pool_t *pool)
+{
+	bufferlist_t *list = 0;
+	const fastcgi_allocator_t *alloc = pool != 0 ? pool->alloc
+		: fastcgi_default_allocator();
+	list = fastcgi_malloc(alloc, sizeof(bufferlist_t));
+	if (list != 0) {
+		list->alloc = alloc;
+		list->head = 0;
+		list->tail = 0;
+		list->used = 0;
+		list->pool = pool;
+	}
+	return list;
+}
+
+void bufferlist_destroy(bufferlist_t *list)
+{
+	if (list != 0) {
+		bufferlist_clear(list);
+		fastcgi_free(list->alloc, list);
+	}
+}
+
+size_t bufferlist_used(bufferlist_t *list)
+{
+	if (list != 0) {
+		return list->used;
+	}
+	return 0;
+}
+
+int32_t bufferlist_write(bufferlist_t *list, const char *data, const size_t len)
+{
+	bufferlist_segment_t *segment = 0;
+	size_t left = len;
+	size_t use_len = 0;
+
+	if (list == 0) {
+		return E_INVALID_ARGUMENT;
+	}
+	if (len > 0x7fffffff) {
+		return E_INVALID_SIZE;
+	}
+	while (left > 0) {
+		segment = list->tail;
+		if (segment == 0 || segment->end == segment->size) {
+			segment = bufferlist_segment_create(list, left);
+			if (segment == 0) {
+				return E_MEMORY_ALLOCATION_FAILED;
+			}
+			if (list->tail == 0) {
+				list->head = segment;
+			}
+			else {
+				list->tail->next = segment;
+			}
+			list->tail = segment;
+		}
+		use_len = segment->size - segment->end;
+		use_len = use_len > left ? left : use_len;
+		memcpy(segment->data + segment->end, data, use_len);
+		segment->end += use_len;
+		data += use_len;
+		left -= use_len;
+		list->used += use_len;
+	}
+	return (int32_t)len;
+}
+
+char* bufferlist_reserve(bufferlist_t *list, const size_t len
+	, size_t *room_len)
+{
+	bufferlist_segment_t *segment = 0;
+	size_t want = len;
+
+	if (list == 0 || room_len == 0) {
+		return 0;
+	}
+	if (want > SEGMENT_SIZE_MAX - sizeof(bufferlist_segment_t)) {
+		want = SEGMENT_SIZE_MAX - sizeof(bufferlist_segment_t);
+	}
+	segment = list->tail;
+	if (segment != 0 && segment->start == segment->end) {
+		/* Nothing left in the last segment, use all of it */
+		segment->start = 0;
+		segment->end = 0;
+	}
+	if (segment == 0 || segment->size - segment->end < want
+		|| segment->end == segment->size) {
+		segment = bufferlist_segment_create(list, want);
+		if (segment == 0) {
+			return 0;
+		}
+		if (list->tail == 0) {
+			list->head = segment;
+		}
+		else {
+			list->tail->next = segment;
+		}
+		list->tail = segment;
+	}
+	*room_len = segment->size - segment->end;
+	return segment->data + segment->end;
+}
+
+int32_t bufferlist_commit(bufferlist_t *list, const size_t len)
+{
+	if (list == 0 || list->tail == 0) {
+		return E_INVALID_ARGUMENT;
+	}
+	if (len > list->tail->size - list->tail->end) {
+		return E_INVALID_SIZE;
+	}
+	list->tail->end += len;
+	list->used += len;
+	return (int32_t)len;
+}
+
+int32_t bufferlist_read(bufferlist_t *list, char *data, const size_t len)
+{
+	bufferlist_segment_t *segment = 0;
+	size_t read_len = 0;
+	size_t left = 0;
+	size_t use_len = 0;
+
+	if (list == 0) {
+		return E_INVALID_ARGUMENT;
+	}
+	/* Use the smallest of len and list->used. */
+	read_len = len > list->used ? list->used : len;
+	if (read_len > 0x7fffffff) {
+		read_len = 0x7fffffff;
+	}
+	left = read_len;
+	while (left > 0) {
+		segment = list->head;
+		use_len = segment->end - segment->start;
+		use_len = use_len > left ? left : use_len;
+		if (data != 0) {
+			memcpy(data, segment->data + segment->start, use_len);
+			data += use_len;
+		}
+		segment->start += use_len;
+		left -= use_len;
+		list->used -= use_len;
+		if (segment->start == segment->end) {
+			/* Segment is drained, release it */
+			list->head = segment->next;
+			if (list->head == 0) {
+				list->tail = 0;
+			}
+			bufferlist_segment_destroy(list, segment);
+		}
+	}
+	return (int32_t)read_len;
+}
+
+int32_t bufferlist_iov(bufferlist_t *list, struct iovec *iov
+	, const int32_t iov_count, const size_t len)
+{
+	return bufferlist_iov_at(list, 0, iov, iov_count, len);
+}
+
+int32_t bufferlist_iov_at(bufferlist_t *list, const size_t offset
+	, struct iovec *iov, const int32_t iov_count, const size_t len)
+{
+	bufferlist_segment_t *segment = 0;
+	size_t skip = offset;
+	size_t left = len;
+	size_t use_len = 0;
+	int32_t n = 0;
+
+	if (list == 0 || iov == 0) {
+		return E_INVALID_ARGUMENT;
+	}
+	segment = list->head;
+	while (segment != 0 && skip >= segment->end - segment->start) {
+		skip -= segment->end - segment->start;
+		segment = segment->next;
+	}
+	while (segment != 0 && left > 0 && n < iov_count) {
+		use_len = segment->end - segment->start - skip;
+		use_len = use_len > left ? left : use_len;
+		if (use_len > 0) {
+			/* Segments reserved but not yet written are skipped */
+			iov[n].iov_base = segment->data + segment->start + skip;
+			iov[n].iov_len = use_len;
+			left -= use_len;
+			n++;
+		}
+		skip = 0;
+		segment = segment->next;
+	}
+	return n;
+}
+
+void bufferlist_clear(bufferlist_t *list)
+{
+	bufferlist_segment_t *segment = 0;
+	if (list == 0) {
+		return;
+	}
+	while (list->head != 0) {
+		segment = list->head;
+		list->head = segment->next;
+		bufferlist_segment_destroy(list, segment);
+	}
+	list->tail = 0;
+	list->used = 0;
+}
@@ -0,0 +1,289 @@
+/* Connections, each with its own klunk context
+ * (C) 2021 Erik Svensson <erik.public@gmail.com>
+ * Licensed under the MIT licence.
+ */
+
+#include <stdlib.h>
+
+#include "connection.h"
+#include "errorcodes.h"
+
+/* Smallest room output records are generated into, a smaller room would cut
+ * the output into many short records */
+static const size_t CONNECTION_ROOM_MIN = 1024;
+
+fastcgi_manager_t* fastcgi_manager_create(const uint32_t max_connections
+	, const uint32_t free_contexts)
+{
+	return fastcgi_manager_create_with_allocator(max_connections
+		, free_contexts, 0);
+}
+
+fastcgi_manager_t* fastcgi_manager_create_with_allocator(
+	const uint32_t max_connections, const uint32_t free_contexts
+	, const fastcgi_allocator_t *alloc)
+{
+	fastcgi_manager_t *manager = 0;
+	uint32_t n = 0;
+
+	if (alloc == 0) {
+		alloc = fastcgi_default_allocator();
+	}
+	manager = fastcgi_malloc(alloc, sizeof(fastcgi_manager_t));
+	if (manager != 0) {
+		manager->alloc = alloc;
+		manager->connections = fastcgi_malloc(alloc
+			, max_connections * sizeof(fastcgi_connection_t));
+		if (manager->connections == 0 && max_connections > 0) {
+			fastcgi_free(alloc, manager);
+			manager = 0;
+		}
+	}
+	if (manager != 0) {
+		manager->slabs = slab_pool_create_with_allocator(
+			FASTCGI_POOL_FREE_BYTES, alloc);
+		if (manager->slabs == 0) {
+			fastcgi_free(alloc, manager->connections);
+			manager->connections = 0;
+			fastcgi_free(alloc, manager);
+			manager = 0;
+		}
+	}
+	if (manager != 0) {
+		manager->contexts = fastcgi_context_pool_create_with_allocator(
+			free_contexts, alloc);
+		if (manager->contexts == 0) {
+			slab_pool_destroy(manager->slabs);
+			manager->slabs = 0;
+			fastcgi_free(alloc, manager->connections);
+			manager->connections = 0;
+			fastcgi_free(alloc, manager);
+			manager = 0;
+		}
+		else {
+			manager->contexts->slabs = manager->slabs;
+		}
+	}
+	if (manager != 0) {
+		manager->max_connections = max_connections;
+		manager->open_count = 0;
+		manager->free_slot = 0;
+		for (n = 0; n < max_connections; n++) {
+			manager->connections[n].ctx = 0;
+			manager->connections[n].output = 0;
+			manager->connections[n].slot = n + 1;
+			manager->connections[n].user_data = 0;
+		}
+	}
+	return manager;
+}
+
+void fastcgi_manager_destroy(fastcgi_manager_t *manager)
+{
+	uint32_t n = 0;
+	if (manager != 0) {
+		for (n = 0; n < manager->max_connections; n++) {
+			if (manager->connections[n].ctx != 0) {
+				fastcgi_connection_close(manager, &manager->connections[n]);
+			}
+		}
+		fastcgi_context_pool_destroy(manager->contexts);
+		manager->contexts = 0;
+		/* Every context has returned its slabs */
+		slab_pool_destroy(manager->slabs);
+		manager->slabs = 0;
+		fastcgi_free(manager->alloc, manager->connections);
+		manager->connections = 0;
+		fastcgi_free(manager->alloc, manager);
+	}
+}
+
+fastcgi_connection_t* fastcgi_connection_open(fastcgi_manager_t *manager)
+{
+	fastcgi_connection_t *conn = 0;
+	fastcgi_context_t *ctx = 0;
+
+	if (manager == 0 || manager->free_slot >= manager->max_connections) {
+		return 0;
+	}
+	ctx = fastcgi_context_acquire(manager->contexts);
+	if (ctx == 0) {
+		return 0;
+	}
+	conn = &manager->connections[manager->free_slot];
+	manager->free_slot = conn->slot;
+	conn->slot = (uint32_t)(conn - manager->connections);
+	conn->ctx = ctx;
+	conn->output = 0;
+	conn->user_data = 0;
+	manager->open_count++;
+	return conn;
+}
+
+void fastcgi_connection_close(fastcgi_manager_t *manager
+	, fastcgi_connection_t *conn)
+{
+	if (manager == 0 || conn == 0 || conn->ctx == 0) {
+		return;
+	}
+	/* The output segments go back to the pool of the manager */
+	bufferlist_destroy(conn->output);
+	conn->output = 0;
+	fastcgi_context_release(manager->contexts, conn->ctx);
+	conn->ctx = 0;
+	conn->user_data = 0;
+	conn->slot = manager->free_slot;
+	manager->free_slot = (uint32_t)(conn - manager->connections);
+	manager->open_count--;
+}
+
+fastcgi_connection_t* fastcgi_connection_find(fastcgi_manager_t *manager
+	, const uint32_t slot)
+{
+	if (manager == 0 || slot >= manager->max_connections
+		|| manager->connections[slot].ctx == 0) {
+		return 0;
+	}
+	return &manager->connections[slot];
+}
+
+/* Get room for at least len bytes at the end of the output queue, records
+ * are generated there without an intermediate copy.
+ */
+char* fastcgi_connection_reserve(fastcgi_connection_t *conn
+	, const size_t len, size_t *room_len)
+{
+	if (conn->output == 0) {
+		conn->output = bufferlist_create(conn->ctx->pool);
+		if (conn->output == 0) {
+			return 0;
+		}
+	}
+	return bufferlist_reserve(conn->output, len, room_len);
+}
+
+/* Move the control records of the context to the output queue */
+int32_t fastcgi_connection_queue_control(fastcgi_connection_t *conn)
+{
+	int32_t result = E_SUCCESS;
+	int32_t queued = 0;
+	size_t room_len = 0;
+	char *room = 0;
+
+	while (fastcgi_control_pending(conn->ctx) > 0) {
+		/* Control records are small, the largest answers FCGI_GET_VALUES */
+		room = fastcgi_connection_reserve(conn, sizeof(fcgi_record_header_t)
+			+ FASTCGI_VALUES_SIZE + 8, &room_len);
+		if (room == 0) {
+			return E_MEMORY_ALLOCATION_FAILED;
+		}
+		result = fastcgi_write_control(conn->ctx, room, room_len);
+		if (result <= 0) {
+			break;
+		}
+		bufferlist_commit(conn->output, result);
+		queued += result;
+	}
+	return result < 0 ? result : queued;
+}
+
+int32_t fastcgi_connection_read(fastcgi_connection_t *conn
+	, const char *input, const size_t input_len)
+{
+	int32_t result = E_SUCCESS;
+	int32_t control = 0;
+
+	if (conn == 0 || conn->ctx == 0) {
+		return E_INVALID_OBJECT;
+	}
+	result = fastcgi_read(conn->ctx, input, input_len);
+	control = fastcgi_connection_queue_control(conn);
+	if (result >= 0 && control < 0) {
+		result = control;
+	}
+	return result;
+}
+
+int32_t fastcgi_connection_queue(fastcgi_connection_t *conn
+	, const uint16_t request_id)
+{
+	int32_t result = E_SUCCESS;
+	int32_t queued = 0;
+	int32_t control = 0;
+	size_t room_len = 0;
+	char *room = 0;
+
+	if (conn == 0 || conn->ctx == 0) {
+		return E_INVALID_OBJECT;
+	}
+	do {
+		room = fastcgi_connection_reserve(conn, CONNECTION_ROOM_MIN
+			, &room_len);
+		if (room == 0) {
+			return E_MEMORY_ALLOCATION_FAILED;
+		}
+		result = fastcgi_write(conn->ctx, room, room_len, request_id);
+		if (result > 0) {
+			bufferlist_commit(conn->output, result);
+			queued += result;
+		}
+	} while (result > 0);
+	/* A request ended by a limit leaves its END_REQUEST on the control
+	 * queue */
+	control = fastcgi_connection_queue_control(conn);
+	if (control < 0) {
+		return control;
+	}
+	queued += control;
+	if (result == E_REQUEST_NOT_FOUND && queued > 0) {
+		/* The request was recycled after its last record */
+		result = E_SUCCESS;
+	}
+	if (result < 0) {
+		return result;
+	}
+	return queued;
+}
+
+int32_t fastcgi_connection_pending(fastcgi_connection_t *conn)
+{
+	if (conn == 0 || conn->ctx == 0) {
+		return E_INVALID_OBJECT;
+	}
+	return (int32_t)bufferlist_used(conn->output);
+}
+
+int32_t fastcgi_connection_iov(fastcgi_connection_t *conn
+	, struct iovec *iov, const int32_t iov_count, const size_t len)
+{
+	if (conn == 0 || conn->ctx == 0) {
+		return E_INVALID_OBJECT;
+	}
+	if (conn->output == 0) {
+		return 0;
+	}
+	return bufferlist_iov(conn->output, iov, iov_count, len);
+}
+
+int32_t fastcgi_connection_consume(fastcgi_connection_t *conn
+	, const size_t len)
+{
+	if (conn == 0 || conn->ctx == 0) {
+		return E_INVALID_OBJECT;
+	}
+	if (conn->output == 0) {
+		return 0;
+	}
+	return bufferlist_read(conn->output, 0, len);
+}
+
+int32_t fastcgi_connection_should_close(fastcgi_connection_t *conn)
+{
+	if (conn == 0 || conn->ctx == 0) {
+		return E_INVALID_OBJECT;
+	}
+	if (bufferlist_used(conn->output) > 0) {
+		return 0;
+	}
+	return fastcgi_should_close(conn->ctx);
+}
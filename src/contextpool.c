@@ -0,0 +1,81 @@
+/* A pool of reusable klunk contexts
+ * (C) 2021 Erik Svensson <erik.public@gmail.com>
+ * Licensed under the MIT licence.
+ */
+
+#include <stdlib.h>
+
+#include "contextpool.h"
+#include "errorcodes.h"
+
+fastcgi_context_pool_t* fastcgi_context_pool_create(const uint32_t free_max)
+{
+	return fastcgi_context_pool_create_with_allocator(free_max, 0);
+}
+
+fastcgi_context_pool_t* fastcgi_context_pool_create_with_allocator(
+	const uint32_t free_max, const fastcgi_allocator_t *alloc)
+{
+	fastcgi_context_pool_t *pool = 0;
+
+	if (alloc == 0) {
+		alloc = fastcgi_default_allocator();
+	}
+	pool = fastcgi_malloc(alloc, sizeof(fastcgi_context_pool_t));
+	if (pool != 0) {
+		pool->alloc = alloc;
+		pool->slabs = 0;
+		pool->free = 0;
+		pool->free_count = 0;
+		pool->free_max = free_max;
+		if (free_max > 0) {
+			pool->free = fastcgi_malloc(alloc
+				, free_max * sizeof(fastcgi_context_t*));
+			if (pool->free == 0) {
+				fastcgi_free(alloc, pool);
+				pool = 0;
+			}
+		}
+	}
+	return pool;
+}
+
+void fastcgi_context_pool_destroy(fastcgi_context_pool_t *pool)
+{
+	if (pool != 0) {
+		while (pool->free_count > 0) {
+			pool->free_count--;
+			fastcgi_destroy(pool->free[pool->free_count]);
+		}
+		fastcgi_free(pool->alloc, pool->free);
+		pool->free = 0;
+		fastcgi_free(pool->alloc, pool);
+	}
+}
+
+fastcgi_context_t* fastcgi_context_acquire(fastcgi_context_pool_t *pool)
+{
+	if (pool == 0) {
+		return 0;
+	}
+	if (pool->free_count > 0) {
+		pool->free_count--;
+		return pool->free[pool->free_count];
+	}
+	return fastcgi_create_with_pool(pool->alloc, pool->slabs);
+}
+
+void fastcgi_context_release(fastcgi_context_pool_t *pool
+	, fastcgi_context_t *ctx)
+{
+	if (ctx == 0) {
+		return;
+	}
+	if (pool == 0 || pool->free_count >= pool->free_max) {
+		fastcgi_destroy(ctx);
+		return;
+	}
+	fastcgi_context_reset(ctx);
+	pool->free[pool->free_count] = ctx;
+	pool->free_count++;
+}
@@ -2,7 +2,9 @@
 #include "errorcodes.h"
 #include "request.h"
 #include "parameter.h"
+#include "utilities.h"
 #include <assert.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <arpa/inet.h>
 #include <unistd.h>
@@ -22,62 +24,399 @@ void fastcgi_version(int32_t *version_major, int32_t *version_minor
 	}
 }
 
-fastcgi_request_t* fastcgi_find_free_request(fastcgi_context_t *ctx)
+/* Get the table slot of the request with the supplied id, the directory
+ * and the page are allocated when create is set. Returns zero if the slot
+ * does not exist.
+ */
+fastcgi_request_t** fastcgi_request_slot(fastcgi_context_t *ctx
+	, const uint16_t id, const int32_t create)
 {
-	if (ctx == NULL || ctx->requests == NULL || ctx->requests->items == NULL) {
-		return NULL;
+	fastcgi_request_page_t **page = 0;
+
+	if (ctx->request_pages == 0) {
+		if (create == 0) {
+			return 0;
+		}
+		ctx->request_pages = fastcgi_malloc(ctx->alloc
+			, FASTCGI_REQUEST_PAGES * sizeof(fastcgi_request_page_t*));
+		if (ctx->request_pages == 0) {
+			return 0;
+		}
+		memset(ctx->request_pages, 0
+			, FASTCGI_REQUEST_PAGES * sizeof(fastcgi_request_page_t*));
 	}
-	fastcgi_request_t* request = NULL;
-	fastcgi_request_t* item = NULL;
-	llist_item_t *ptr = ctx->requests->items;
-	while (ptr != NULL) {
-		item = (fastcgi_request_t*)(ptr->data);
-		if (item->id == 0) {
-			request = (fastcgi_request_t*)(ptr->data);
-			break;
+	page = &ctx->request_pages[id >> FASTCGI_REQUEST_PAGE_BITS];
+	if (*page == 0) {
+		if (create == 0) {
+			return 0;
 		}
-		ptr = ptr->next;
+		*page = fastcgi_malloc(ctx->alloc, sizeof(fastcgi_request_page_t));
+		if (*page == 0) {
+			return 0;
+		}
+		memset(*page, 0, sizeof(fastcgi_request_page_t));
+	}
+	return &(*page)->requests[id & (FASTCGI_REQUEST_PAGE_SIZE - 1)];
+}
+
+fastcgi_request_t* fastcgi_find_free_request(fastcgi_context_t *ctx)
+{
+	fastcgi_request_t *request = 0;
+
+	if (ctx == NULL || ctx->free_requests == NULL) {
+		return NULL;
 	}
+	request = ctx->free_requests;
+	ctx->free_requests = request->next_free;
+	request->next_free = 0;
+	ctx->free_count--;
 	return request;
 }
 
 fastcgi_request_t* fastcgi_find_request(fastcgi_context_t *ctx, const uint16_t id)
 {
-	if (ctx == NULL || ctx->requests == NULL || ctx->requests->items == NULL) {
+	fastcgi_request_t **slot = 0;
+
+	if (ctx == NULL || id == FCGI_NULL_REQUEST_ID) {
 		return NULL;
 	}
-	fastcgi_request_t* request = NULL;
-	fastcgi_request_t* item = NULL;
-	llist_item_t *ptr = ctx->requests->items;
-	while (ptr != NULL) {
-		item = (fastcgi_request_t*)(ptr->data);
-		if (item->id == id) {
-			request = (fastcgi_request_t*)(ptr->data);
-			break;
-		}
-		ptr = ptr->next;
+	slot = fastcgi_request_slot(ctx, id, 0);
+	return slot != 0 ? *slot : NULL;
+}
+
+fastcgi_request_t* fastcgi_take_request(fastcgi_context_t *ctx, const uint16_t id)
+{
+	fastcgi_request_t *request = fastcgi_find_request(ctx, id);
+
+	if (request != NULL) {
+		*fastcgi_request_slot(ctx, id, 0) = 0;
+		ctx->buffered -= request->buffered;
+		request->buffered = 0;
+		ctx->request_count--;
 	}
 	return request;
 }
 
-fastcgi_request_t* fastcgi_take_request(fastcgi_context_t *ctx, const uint16_t id)
+/* Close the admission interval once it has passed. An interval without a
+ * sample says nothing about the queue and clears the state, new requests
+ * turned away would otherwise never give a sample again.
+ */
+void fastcgi_admission_interval(fastcgi_context_t *ctx, const uint64_t now)
 {
-	if (ctx == NULL || ctx->requests == NULL || ctx->requests->items == NULL) {
-		return NULL;
+	if (now - ctx->interval_start < ctx->admission.interval_usec) {
+		return;
 	}
-	fastcgi_request_t* request = NULL;
-	fastcgi_request_t* item = NULL;
-	llist_item_t *ptr = ctx->requests->items;
-	while (ptr != NULL) {
-		item = (fastcgi_request_t*)(ptr->data);
-		if (item->id == id) {
-			llist_take(ctx->requests, ptr->data);
-			request = (fastcgi_request_t*)(ptr->data);
-			break;
+	ctx->overloaded = ctx->interval_min_usec != UINT64_MAX
+		&& ctx->interval_min_usec > ctx->admission.target_usec;
+	ctx->interval_start = now;
+	ctx->interval_min_usec = UINT64_MAX;
+}
+
+/* Account the time a request waited from begin until the handler first
+ * acted on it. Each request gives one sample, begun_at is cleared after it.
+ */
+void fastcgi_admission_pickup(fastcgi_context_t *ctx
+	, fastcgi_request_t *request)
+{
+	uint64_t now = 0;
+	uint64_t sojourn = 0;
+
+	if (request->begun_at == 0) {
+		return;
+	}
+	if (ctx->admission.target_usec > 0) {
+		now = fastcgi_time_usec();
+		sojourn = now - request->begun_at;
+		if (sojourn < ctx->interval_min_usec) {
+			ctx->interval_min_usec = sojourn;
 		}
-		ptr = ptr->next;
+		fastcgi_admission_interval(ctx, now);
 	}
-	return request;
+	request->begun_at = 0;
+}
+
+/* Decide if a new request is admitted, returns FCGI_REQUEST_COMPLETE or the
+ * protocol status the request is ended with.
+ */
+uint8_t fastcgi_admit(fastcgi_context_t *ctx, const fcgi_record_begin_t *record)
+{
+	if (ctx->limits.max_requests > 0
+		&& ctx->request_count >= ctx->limits.max_requests) {
+		return FCGI_OVERLOADED;
+	}
+	if (ctx->values.mpxs_conns == 0 && ctx->request_count > 0) {
+		return FCGI_CANT_MPX_CONN;
+	}
+	if (ctx->admission.target_usec > 0) {
+		fastcgi_admission_interval(ctx, fastcgi_time_usec());
+		if (ctx->overloaded) {
+			return FCGI_OVERLOADED;
+		}
+	}
+	if (ctx->admission.admit_func != 0) {
+		return ctx->admission.admit_func(ctx, ctx->current_header.request_id
+			, record->role, ctx->admission.admit_user_data);
+	}
+	return FCGI_REQUEST_COMPLETE;
+}
+
+/* Reset a finished request and return it to the pool of free requests, the
+ * pool keeps at most FASTCGI_FREE_REQUESTS requests.
+ */
+void fastcgi_recycle_request(fastcgi_context_t *ctx, fastcgi_request_t *request)
+{
+	fastcgi_request_t **slot = fastcgi_request_slot(ctx, request->id, 0);
+
+	ctx->buffered -= request->buffered;
+	if ((request->flags & FCGI_KEEP_CONN) == 0) {
+		ctx->close_requested = 1;
+	}
+	if (slot != 0 && *slot == request) {
+		*slot = 0;
+	}
+	if (ctx->request_count > 0) {
+		ctx->request_count--;
+	}
+	if (ctx->free_count >= FASTCGI_FREE_REQUESTS) {
+		fastcgi_request_destroy(request);
+		return;
+	}
+	fastcgi_request_reset(request);
+	request->id = 0;
+	fastcgi_request_set_state(request, FASTCGI_RS_INIT);
+	request->next_free = ctx->free_requests;
+	ctx->free_requests = request;
+	ctx->free_count++;
+}
+
+/* Queue a record of type carrying content on the control queue, content_len
+ * is at most FASTCGI_VALUES_SIZE.
+ */
+int32_t fastcgi_queue_control(fastcgi_context_t *ctx, const uint8_t type
+	, const uint16_t request_id, const char *content, const size_t content_len)
+{
+	int32_t result = E_SUCCESS;
+	char record[sizeof(fcgi_record_header_t) + FASTCGI_VALUES_SIZE + 8];
+	uint16_t padded_len = ctx->record_padding ? size8b(content_len)
+		: content_len;
+	fcgi_record_header_t header = {
+		.version = FCGI_VERSION_1,
+		.type = type,
+		.request_id = htons(request_id),
+		.content_length = htons(content_len),
+		.padding_length = padded_len - content_len,
+		.reserved = 0
+	};
+
+	assert(content_len <= FASTCGI_VALUES_SIZE);
+	if (ctx->control == 0) {
+		ctx->control = bufferlist_create(ctx->pool);
+		if (ctx->control == 0) {
+			return E_MEMORY_ALLOCATION_FAILED;
+		}
+	}
+	memcpy(record, &header, sizeof(fcgi_record_header_t));
+	memcpy(record + sizeof(fcgi_record_header_t), content, content_len);
+	memset(record + sizeof(fcgi_record_header_t) + content_len, 0
+		, padded_len - content_len);
+	result = bufferlist_write(ctx->control, record
+		, sizeof(fcgi_record_header_t) + padded_len);
+	if (result < 0) {
+		return result;
+	}
+	return E_SUCCESS;
+}
+
+/* Queue an END_REQUEST record for request_id on the control queue */
+int32_t fastcgi_end_request(fastcgi_context_t *ctx, const uint16_t request_id
+	, const uint32_t app_status, const uint8_t protocol_status)
+{
+	fcgi_record_end_t end = {
+		.app_status = htonl(app_status),
+		.protocol_status = protocol_status,
+		.reserved = {0}
+	};
+	return fastcgi_queue_control(ctx, FCGI_END_REQUEST, request_id
+		, (const char*)&end, sizeof(fcgi_record_end_t));
+}
+
+/* Names of the values in the order of values_pairs */
+static const char *fastcgi_value_names[3] = {
+	FCGI_MAX_CONNS,
+	FCGI_MAX_REQS,
+	FCGI_MPXS_CONNS
+};
+
+/* Encode the values as name-value pairs, all names and values are shorter
+ * than 128 bytes so one byte lengths are used.
+ */
+void fastcgi_encode_values(fastcgi_context_t *ctx)
+{
+	uint32_t value[3] = {
+		ctx->values.max_conns,
+		ctx->values.max_reqs,
+		ctx->values.mpxs_conns ? 1 : 0
+	};
+	char *ptr = ctx->values_pairs;
+	size_t name_len = 0;
+	int n = 0;
+	int32_t i = 0;
+
+	for (i = 0; i < 3; i++) {
+		name_len = strlen(fastcgi_value_names[i]);
+		n = snprintf(ptr + 2 + name_len, 11, "%u", value[i]);
+		ptr[0] = (char)name_len;
+		ptr[1] = (char)n;
+		memcpy(ptr + 2, fastcgi_value_names[i], name_len);
+		ctx->values_pair_len[i] = (uint8_t)(2 + name_len + n);
+		ptr += ctx->values_pair_len[i];
+	}
+}
+
+/* Decode a name-value pair length, returns the number of bytes used or zero
+ * when left is too short.
+ */
+int32_t fastcgi_decode_length(const char *ptr, const int32_t left
+	, int32_t *length)
+{
+	uint32_t value = 0;
+	if ((*ptr & 0x80) == 0x80) {
+		if (left < 4) {
+			return 0;
+		}
+		memcpy(&value, ptr, sizeof(uint32_t));
+		*length = (int32_t)(ntohl(value) & 0x7fffffff);
+		return 4;
+	}
+	if (left < 1) {
+		return 0;
+	}
+	*length = (*ptr) & 0x7f;
+	return 1;
+}
+
+/* Answer FCGI_GET_VALUES with the pre-encoded pairs of the queried names */
+int32_t fastcgi_get_values(fastcgi_context_t *ctx
+	, const char *data, const size_t len)
+{
+	char content[FASTCGI_VALUES_SIZE];
+	size_t content_len = 0;
+	const char *ptr = data;
+	const char *pair = 0;
+	int32_t left = (int32_t)len;
+	int32_t str_len[2] = {0, 0};
+	int32_t bytes_delta = 0;
+	uint8_t answered = 0;
+	int32_t n = 0;
+	int32_t i = 0;
+
+	while (left > 0) {
+		for (n = 0; n < 2; n++) {
+			bytes_delta = fastcgi_decode_length(ptr, left, &str_len[n]);
+			if (bytes_delta == 0) {
+				break;
+			}
+			left -= bytes_delta;
+			ptr += bytes_delta;
+		}
+		if (bytes_delta == 0 || left < str_len[0]
+			|| left - str_len[0] < str_len[1]) {
+			return E_FCGI_INVALID_DATA;
+		}
+		pair = ctx->values_pairs;
+		for (i = 0; i < 3; i++) {
+			if ((answered & (1 << i)) == 0
+				&& (size_t)str_len[0] == strlen(fastcgi_value_names[i])
+				&& memcmp(ptr, fastcgi_value_names[i], str_len[0]) == 0) {
+				memcpy(content + content_len, pair, ctx->values_pair_len[i]);
+				content_len += ctx->values_pair_len[i];
+				answered |= (1 << i);
+			}
+			pair += ctx->values_pair_len[i];
+		}
+		ptr += str_len[0] + str_len[1];
+		left -= str_len[0] + str_len[1];
+	}
+	return fastcgi_queue_control(ctx, FCGI_GET_VALUES_RESULT
+		, FCGI_NULL_REQUEST_ID, content, content_len);
+}
+
+/* Handle a record with the null request id */
+int32_t fastcgi_management(fastcgi_context_t *ctx
+	, const char *data, const size_t len)
+{
+	fcgi_record_unknown_t unknown = {
+		.type = ctx->current_header.type,
+		.reserved = {0}
+	};
+	if (ctx->current_header.type == FCGI_GET_VALUES) {
+		return fastcgi_get_values(ctx, data, len);
+	}
+	return fastcgi_queue_control(ctx, FCGI_UNKNOWN_TYPE, FCGI_NULL_REQUEST_ID
+		, (const char*)&unknown, sizeof(fcgi_record_unknown_t));
+}
+
+/* End the request with protocol_status through the control queue and
+ * recycle it, anything buffered for the request is dropped.
+ */
+int32_t fastcgi_reject_request(fastcgi_context_t *ctx
+	, fastcgi_request_t *request, const uint8_t protocol_status)
+{
+	int32_t result = fastcgi_end_request(ctx, request->id, 0, protocol_status);
+	fastcgi_recycle_request(ctx, request);
+	return result;
+}
+
+/* Charge len buffered bytes of the request to the context quota */
+int32_t fastcgi_charge(fastcgi_context_t *ctx, fastcgi_request_t *request
+	, const size_t len)
+{
+	if (ctx->limits.max_buffered > 0
+		&& ctx->buffered + len > ctx->limits.max_buffered) {
+		return E_REQUEST_LIMIT;
+	}
+	ctx->buffered += len;
+	request->buffered += len;
+	return E_SUCCESS;
+}
+
+/* Give back len bytes of the request taken out of its buffers */
+void fastcgi_credit(fastcgi_context_t *ctx, fastcgi_request_t *request
+	, size_t len)
+{
+	if (len > request->buffered) {
+		len = request->buffered;
+	}
+	ctx->buffered -= len;
+	request->buffered -= len;
+}
+
+/* Cancel a request aborted by the web server. Input and output are dropped
+ * and the END_REQUEST goes out on the control queue.
+ */
+int32_t fastcgi_abort_request(fastcgi_context_t *ctx
+	, fastcgi_request_t *request)
+{
+	int32_t result = E_SUCCESS;
+	if ((request->state & FASTCGI_RS_ABORT)) {
+		/* Already ended, waiting for its described output to be consumed */
+		return E_SUCCESS;
+	}
+	fastcgi_request_set_state(request, FASTCGI_RS_ABORT);
+	if (ctx->abort_func != 0) {
+		ctx->abort_func(ctx, request, ctx->abort_user_data);
+	}
+	if ((request->state & FASTCGI_RS_FINISHED) == 0) {
+		result = fastcgi_end_request(ctx, request->id, 0
+			, FCGI_REQUEST_COMPLETE);
+	}
+	if (request->described_len > 0) {
+		/* The iovecs handed out point into the output, the request is
+		 * recycled once fastcgi_write_consume removes them */
+		return result;
+	}
+	fastcgi_recycle_request(ctx, request);
+	return result;
 }
 
 int32_t fastcgi_read_header(fcgi_record_header_t *header
@@ -101,13 +440,15 @@ int32_t fastcgi_begin_request(fastcgi_context_t *ctx
 	int32_t result = E_SUCCESS;
 	fcgi_record_begin_t record = {0};
 	fastcgi_request_t *request = 0;
+	fastcgi_request_t **slot = 0;
+	uint8_t protocol_status = FCGI_REQUEST_COMPLETE;
 
 	if (len >= sizeof(fcgi_record_begin_t))
 	{
 		memcpy(&record, data, sizeof(fcgi_record_begin_t));
 		record.role = ntohs(record.role);
-		/* Only responder role is supported */
-		if (record.role != FCGI_RESPONDER) {
+		if (record.role != FCGI_RESPONDER && record.role != FCGI_AUTHORIZER
+			&& record.role != FCGI_FILTER) {
 			result = E_FCGI_INVALID_ROLE;
 		}
 	}
@@ -115,23 +456,64 @@ int32_t fastcgi_begin_request(fastcgi_context_t *ctx
 		result = E_INVALID_SIZE;
 	}
 	if (result == E_SUCCESS) {
-		request = fastcgi_find_free_request(ctx);
-		if (request == 0) {
-			request = fastcgi_request_create();
-			result = llist_add(ctx->requests, request
-				, sizeof(fastcgi_request_t));
+		protocol_status = fastcgi_admit(ctx, &record);
+	}
+	if (result == E_SUCCESS && protocol_status == FCGI_REQUEST_COMPLETE) {
+		slot = fastcgi_request_slot(ctx, ctx->current_header.request_id, 1);
+		if (slot == 0) {
+			result = E_MEMORY_ALLOCATION_FAILED;
+		}
+		else {
+			request = fastcgi_find_free_request(ctx);
+		}
+		if (result == E_SUCCESS && request == 0) {
+			request = fastcgi_request_create_with_allocator(ctx->alloc);
+			if (request == 0) {
+				result = E_MEMORY_ALLOCATION_FAILED;
+			}
+			else {
+				fastcgi_request_set_pool(request, ctx->pool);
+				request->quota = &ctx->buffered;
+			}
+		}
+		if (result == E_SUCCESS && ctx->arena_block_size > 0) {
+			result = fastcgi_request_create_arena(request, ctx->pool
+				, ctx->arena_block_size);
+			if (result != E_SUCCESS) {
+				fastcgi_request_destroy(request);
+			}
 		}
 		if (result == E_SUCCESS) {
-			request->id = ctx->current_header->request_id;
+			request->id = ctx->current_header.request_id;
 			request->role = record.role;
 			request->flags = record.flags;
+			request->record_size = ctx->record_size;
+			request->spill_threshold = ctx->spill_threshold;
+			request->padding = ctx->record_padding;
 			fastcgi_request_set_state(request, FASTCGI_RS_NEW);
+			if (ctx->admission.target_usec > 0) {
+				request->begun_at = fastcgi_time_usec();
+			}
+			*slot = request;
+			ctx->request_count++;
 		}
+		else if (result == E_MEMORY_ALLOCATION_FAILED) {
+			/* Out of memory is an overload, not a broken connection */
+			protocol_status = FCGI_OVERLOADED;
+		}
+	}
+	if (protocol_status != FCGI_REQUEST_COMPLETE) {
+		/* Turn the request away, nothing is kept for it */
+		if ((record.flags & FCGI_KEEP_CONN) == 0) {
+			ctx->close_requested = 1;
+		}
+		return fastcgi_end_request(ctx, ctx->current_header.request_id
+			, 0, protocol_status);
 	}
 	return result;
 }
 
-int32_t fastcgi_params(fastcgi_request_t *request
+int32_t fastcgi_params(fastcgi_context_t *ctx, fastcgi_request_t *request
 	, const char *data, const size_t len)
 {
 	int32_t n = 0;
@@ -143,12 +525,17 @@ int32_t fastcgi_params(fastcgi_request_t *request
 	int32_t bytes_used = 0;
 	int32_t bytes_delta = 0;
 	int32_t bytes_delta_acc = 0;
+	int32_t result = E_SUCCESS;
 
 	assert(len <= 0x7fffffff);
 	left = (int32_t)len;
 
 	if (len == 0) {
 		fastcgi_request_set_state(request, FASTCGI_RS_PARAMS_DONE);
+		if (request->role == FCGI_AUTHORIZER) {
+			/* Authorizers have no body, the request is ready now */
+			fastcgi_request_set_state(request, FASTCGI_RS_STDIN_DONE);
+		}
 	}
 	else {
 		fastcgi_request_set_state(request, FASTCGI_RS_PARAMS);
@@ -159,21 +546,7 @@ int32_t fastcgi_params(fastcgi_request_t *request
 		bytes_delta_acc = 0;
 		/* Decode string size for name and value */
 		for (n = 0; n < 2; n++) {
-			bytes_delta = 0;
-			/* Decode string size */
-			if ((*ptr & 0x80) == 0x80) {
-				if (left >= 4) {
-					memcpy(&(str_len[n]), ptr, sizeof(uint32_t));
-					str_len[n] = ntohl(str_len[n]) & 0x7fffffff;
-					bytes_delta = 4;
-				}
-			}
-			else {
-				if (left >= 1) {
-					str_len[n] = (*ptr) & 0x7F;
-					bytes_delta = 1;
-				}
-			}
+			bytes_delta = fastcgi_decode_length(ptr, left, &str_len[n]);
 			if (bytes_delta == 0) {
 				/* No bytes where decoded */
 				break;
@@ -182,7 +555,21 @@ int32_t fastcgi_params(fastcgi_request_t *request
 			left -= bytes_delta;
 			ptr += bytes_delta;
 		}
-		if (bytes_delta > 0 && left >= (str_len[0] + str_len[1])) {
+		if (bytes_delta > 0 && ctx->limits.max_param_length > 0
+			&& (uint32_t)str_len[0] + (uint32_t)str_len[1]
+				> ctx->limits.max_param_length) {
+			/* No need to wait for the rest of the parameter */
+			return E_REQUEST_LIMIT;
+		}
+		if (bytes_delta > 0 && left >= str_len[0]
+			&& left - str_len[0] >= str_len[1]) {
+			if (ctx->limits.max_params > 0
+				&& request->param_count >= ctx->limits.max_params) {
+				return E_REQUEST_LIMIT;
+			}
+			if (fastcgi_charge(ctx, request, str_len[0] + str_len[1]) < 0) {
+				return E_REQUEST_LIMIT;
+			}
 			name = ptr;
 			ptr += str_len[0];
 			left -= str_len[0];
@@ -191,8 +578,11 @@ int32_t fastcgi_params(fastcgi_request_t *request
 			ptr += str_len[1];
 			left -= str_len[1];
 
-			fastcgi_request_parameter_add(request, name, str_len[0]
+			result = fastcgi_request_parameter_add(request, name, str_len[0]
 				, value, str_len[1]);
+			if (result < 0) {
+				return result;
+			}
 
 			bytes_used += (bytes_delta_acc + str_len[0] + str_len[1]);
 		}
@@ -203,10 +593,34 @@ int32_t fastcgi_params(fastcgi_request_t *request
 	return bytes_used;
 }
 
-int32_t fastcgi_stdin(fastcgi_request_t *request
+int32_t fastcgi_stdin(fastcgi_context_t *ctx, fastcgi_request_t *request
 	, const char *input, const size_t input_len)
 {
 	int32_t result = E_SUCCESS;
+	int32_t spills = 0;
+	int32_t charged = 0;
+	size_t held = 0;
+
+	if (request->role == FCGI_AUTHORIZER) {
+		/* Nothing is buffered for authorizers */
+		return (int32_t)input_len;
+	}
+	if ((request->state & FASTCGI_RS_DISCARD)) {
+		fastcgi_request_set_state(request, input_len == 0
+			? FASTCGI_RS_STDIN_DONE : FASTCGI_RS_STDIN);
+		return (int32_t)input_len;
+	}
+	if (ctx->limits.max_content > 0
+		&& fastcgi_request_content_length(request) + input_len
+			> ctx->limits.max_content) {
+		return E_REQUEST_LIMIT;
+	}
+	spills = fastcgi_request_spills(request, input_len);
+	charged = spills == 0 && request->content_spill.fd < 0;
+	if (charged && fastcgi_charge(ctx, request, input_len) < 0) {
+		return E_REQUEST_LIMIT;
+	}
+	held = buffer_used(request->content);
 
 	if (input_len == 0) {
 		fastcgi_request_set_state(request, FASTCGI_RS_STDIN_DONE);
@@ -215,7 +629,62 @@ int32_t fastcgi_stdin(fastcgi_request_t *request
 		fastcgi_request_set_state(request, FASTCGI_RS_STDIN);
 	}
 
-	result = buffer_write(request->content, input, input_len);
+	result = fastcgi_request_write_input(request, input, input_len);
+	if (result < 0 && charged) {
+		fastcgi_credit(ctx, request, input_len);
+	}
+	else if (result >= 0 && spills) {
+		/* The buffered content has moved out of memory */
+		fastcgi_credit(ctx, request, held);
+	}
+
+	return result;
+}
+
+/* The FCGI_DATA stream of a filter request, ignored for other roles */
+int32_t fastcgi_data(fastcgi_context_t *ctx, fastcgi_request_t *request
+	, const char *input, const size_t input_len)
+{
+	int32_t result = E_SUCCESS;
+	int32_t spills = 0;
+	int32_t charged = 0;
+	size_t held = 0;
+
+	if (request->role != FCGI_FILTER) {
+		return (int32_t)input_len;
+	}
+	if ((request->state & FASTCGI_RS_DISCARD)) {
+		fastcgi_request_set_state(request, input_len == 0
+			? FASTCGI_RS_DATA_DONE : FASTCGI_RS_DATA);
+		return (int32_t)input_len;
+	}
+	if (ctx->limits.max_content > 0
+		&& fastcgi_request_data_length(request) + input_len
+			> ctx->limits.max_content) {
+		return E_REQUEST_LIMIT;
+	}
+	spills = fastcgi_request_data_spills(request, input_len);
+	charged = spills == 0 && request->data_spill.fd < 0;
+	if (charged && fastcgi_charge(ctx, request, input_len) < 0) {
+		return E_REQUEST_LIMIT;
+	}
+	held = buffer_used(request->data);
+
+	if (input_len == 0) {
+		fastcgi_request_set_state(request, FASTCGI_RS_DATA_DONE);
+	}
+	else {
+		fastcgi_request_set_state(request, FASTCGI_RS_DATA);
+	}
+
+	result = fastcgi_request_write_data(request, input, input_len);
+	if (result < 0 && charged) {
+		fastcgi_credit(ctx, request, input_len);
+	}
+	else if (result >= 0 && spills) {
+		/* The buffered data has moved out of memory */
+		fastcgi_credit(ctx, request, held);
+	}
 
 	return result;
 }
@@ -228,29 +697,36 @@ int32_t fastcgi_process_input_buffer(fastcgi_context_t *ctx)
 	int32_t bytes_used = 0;
 	fastcgi_request_t *request = 0;
 
-	request = fastcgi_find_request(ctx, ctx->current_header->request_id);
+	if (ctx->current_header.request_id == FCGI_NULL_REQUEST_ID) {
+		/* Management records, no request has the null id */
+		result = fastcgi_management(ctx, buffer_peek(&ctx->input)
+			, buffer_used(&ctx->input));
+		buffer_clear(&ctx->input);
+		return result;
+	}
+	request = fastcgi_find_request(ctx, ctx->current_header.request_id);
 	if (request == 0) {
-		if (ctx->current_header->type != FCGI_BEGIN_REQUEST) {
+		if (ctx->current_header.type != FCGI_BEGIN_REQUEST) {
 			result = E_REQUEST_NOT_FOUND;
 		}
 	}
 	else {
-		if (ctx->current_header->type == FCGI_BEGIN_REQUEST) {
+		if (ctx->current_header.type == FCGI_BEGIN_REQUEST) {
 			result = E_REQUEST_DUPLICATE;
 		}
 	}
 
 	if (result == E_SUCCESS) {
 
-		buffer_length = buffer_used(ctx->input);
-		buffer_data = buffer_peek(ctx->input);
-		switch (ctx->current_header->type) {
+		buffer_length = buffer_used(&ctx->input);
+		buffer_data = buffer_peek(&ctx->input);
+		switch (ctx->current_header.type) {
 			case FCGI_BEGIN_REQUEST:
 				result = fastcgi_begin_request(ctx, buffer_data, buffer_length);
 				bytes_used = buffer_length;
 				break;
 			case FCGI_PARAMS:
-				result = fastcgi_params(request, buffer_data, buffer_length);
+				result = fastcgi_params(ctx, request, buffer_data, buffer_length);
 				if (result >= 0) {
 					bytes_used = result;
 				}
@@ -260,7 +736,7 @@ int32_t fastcgi_process_input_buffer(fastcgi_context_t *ctx)
 				}
 				break;
 			case FCGI_STDIN:
-				result = fastcgi_stdin(request, buffer_data, buffer_length);
+				result = fastcgi_stdin(ctx, request, buffer_data, buffer_length);
 				if (result >= 0) {
 					bytes_used = result;
 				}
@@ -269,20 +745,91 @@ int32_t fastcgi_process_input_buffer(fastcgi_context_t *ctx)
 					bytes_used = buffer_length;
 				}
 				break;
+			case FCGI_ABORT_REQUEST:
+				result = fastcgi_abort_request(ctx, request);
+				bytes_used = buffer_length;
+				break;
 			case FCGI_DATA:
-				/* Not supported, clear buffer */
+				result = fastcgi_data(ctx, request, buffer_data, buffer_length);
+				if (result >= 0) {
+					bytes_used = result;
+				}
+				else {
+					/* An error occured, clear buffer */
+					bytes_used = buffer_length;
+				}
+				break;
 			default:
 				bytes_used = buffer_length;
 				break;
 		}
 	}
 	else {
-		bytes_used = buffer_used(ctx->input);
+		bytes_used = buffer_used(&ctx->input);
+	}
+	buffer_read(&ctx->input, 0, bytes_used);
+	if (result == E_REQUEST_NOT_FOUND) {
+		/* Records still in flight for an ended request are ignored */
+		result = E_SUCCESS;
+	}
+	else if (request != 0 && (result == E_REQUEST_LIMIT
+		|| result == E_MEMORY_ALLOCATION_FAILED
+		|| result == E_INVALID_FILE_HANDLE || result == E_WRITE_FAILED)) {
+		/* Only the offending request is ended, running out of memory or
+		 * spill space is treated like going over a limit */
+		result = fastcgi_reject_request(ctx, request, FCGI_OVERLOADED);
 	}
-	buffer_read(ctx->input, 0, bytes_used);
 	return result;
 }
 
+/* Check if the content of the current record is dropped without being
+ * buffered, STDIN and FCGI_DATA of ended or discarding requests. The empty
+ * record closing a stream is still processed.
+ */
+int32_t fastcgi_skip_content(fastcgi_context_t *ctx
+	, const fcgi_record_header_t *header)
+{
+	fastcgi_request_t *request = 0;
+
+	if (header->content_length == 0
+		|| (header->type != FCGI_STDIN && header->type != FCGI_DATA)) {
+		return 0;
+	}
+	request = fastcgi_find_request(ctx, header->request_id);
+	return request == 0 || (request->state & FASTCGI_RS_DISCARD) != 0;
+}
+
+/* Check if the record has to wait until work drains, see
+ * fastcgi_flow_policy_t. Records ending or aborting work always pass.
+ */
+int32_t fastcgi_holds_record(fastcgi_context_t *ctx
+	, const fcgi_record_header_t *header)
+{
+	fastcgi_request_t *request = 0;
+	int32_t full = ctx->flow_policy.max_buffered > 0
+		&& ctx->buffered >= ctx->flow_policy.max_buffered;
+
+	switch (header->type) {
+		case FCGI_BEGIN_REQUEST:
+			return full || (ctx->flow_policy.max_requests > 0
+				&& ctx->request_count >= ctx->flow_policy.max_requests);
+		case FCGI_PARAMS:
+		case FCGI_STDIN:
+		case FCGI_DATA:
+			if (full == 0 || header->content_length == 0
+				|| fastcgi_skip_content(ctx, header)) {
+				return 0;
+			}
+			/* Nothing drains while the request waits for its own input, so
+			 * a request holding every buffered byte is never held back */
+			/* Records of unknown requests are rejected or skipped when read */
+			request = fastcgi_find_request(ctx, header->request_id);
+			return request != 0 && request->buffered < ctx->buffered;
+		default:
+			return 0;
+	}
+}
+
 int32_t fastcgi_process_input(fastcgi_context_t *ctx
 	, const char *data, const size_t len)
 {
@@ -302,12 +849,23 @@ int32_t fastcgi_process_input(fastcgi_context_t *ctx
 	while (length > 0) {
 		/* Try to read header if neccesary */
 		if (ctx->read_state == 0) {
-			result = fastcgi_read_header(ctx->current_header, ptr, length);
+			result = fastcgi_read_header(&ctx->held_header, ptr, length);
+			if (result == E_SUCCESS
+				&& fastcgi_holds_record(ctx, &ctx->held_header)) {
+				/* Leave the record to the caller until work drains */
+				ctx->read_held = 1;
+				result = bytes_used;
+				break;
+			}
 			if (result == E_SUCCESS) {
+				ctx->current_header = ctx->held_header;
+				ctx->read_held = 0;
 				length -= sizeof(fcgi_record_header_t);
 				ptr += sizeof(fcgi_record_header_t);
 				ctx->read_bytes = 0;
-				ctx->read_state = 1;
+				/* State 2 reads past the content without keeping it */
+				ctx->read_state = fastcgi_skip_content(ctx
+					, &ctx->current_header) ? 2 : 1;
 				bytes_used += sizeof(fcgi_record_header_t);
 			}
 			else if (result == E_INVALID_SIZE && bytes_used > 0) {
@@ -318,15 +876,17 @@ int32_t fastcgi_process_input(fastcgi_context_t *ctx
 				break;
 			}
 		}
-		content_length = ctx->current_header->content_length;
-		padding_length = ctx->current_header->padding_length;
+		content_length = ctx->current_header.content_length;
+		padding_length = ctx->current_header.padding_length;
 		bytes_write = 0;
 		if (result == E_SUCCESS) {
 			/* Try to write content data to buffer */
 			bytes_left = content_length - ctx->read_bytes;
 			if (bytes_left > 0) {
 				bytes_write = bytes_left > length ? length : bytes_left;
-				result = buffer_write(ctx->input, ptr, bytes_write);
+			}
+			if (bytes_write > 0 && ctx->read_state == 1) {
+				result = buffer_write(&ctx->input, ptr, bytes_write);
 				result = (result == bytes_write) ? E_SUCCESS : E_WRITE_FAILED;
 			}
 		}
@@ -353,7 +913,9 @@ int32_t fastcgi_process_input(fastcgi_context_t *ctx
 				}
 				/* Check if all incoming data has been read */
 				if (bytes_left == 0) {
-					result = fastcgi_process_input_buffer(ctx);
+					if (ctx->read_state == 1) {
+						result = fastcgi_process_input_buffer(ctx);
+					}
 					ctx->read_state = 0;
 				}
 			}	
@@ -380,83 +942,199 @@ int32_t fastcgi_process_data(fastcgi_context_t *ctx
 	return fastcgi_process_input(ctx, data, len);
 }
 
+/* Check if buffering input_len more bytes of output puts the request over
+ * the output limit or the context over its quota. Nothing is charged, the
+ * bytes are charged once they have been buffered.
+ */
+int32_t fastcgi_output_over_limit(fastcgi_context_t *ctx
+	, fastcgi_request_t *request, const size_t input_len)
+{
+	size_t buffered = 0;
+	if (ctx->limits.max_output > 0) {
+		buffered = bufferlist_used(request->output)
+			+ bufferlist_used(request->error);
+		if (buffered + input_len > ctx->limits.max_output) {
+			return 1;
+		}
+	}
+	return ctx->limits.max_buffered > 0
+		&& ctx->buffered + input_len > ctx->limits.max_buffered;
+}
+
 /**** Public functions ******/
 
 fastcgi_context_t * fastcgi_create()
+{
+	return fastcgi_create_with_allocator(0);
+}
+
+fastcgi_context_t * fastcgi_create_with_allocator(
+	const fastcgi_allocator_t *alloc)
+{
+	return fastcgi_create_with_pool(alloc, 0);
+}
+
+fastcgi_context_t * fastcgi_create_with_pool(const fastcgi_allocator_t *alloc
+	, slab_pool_t *pool)
 {
 	fastcgi_context_t *ctx = 0;
 
-	ctx = malloc(sizeof(fastcgi_context_t));
-	if (ctx != 0) {
-		ctx->requests = llist_create(sizeof(fastcgi_request_t));
-		if (ctx->requests == 0) {
-			free(ctx);
-			ctx = 0;
-		}
-		else {
-			llist_register_dtor(ctx->requests
-				, (llist_item_dtor_func)&fastcgi_request_destroy);
-		}
-	}
-	if (ctx != 0) {
-		ctx->input = buffer_create();
-		if (ctx->input == 0) {
-			llist_destroy(ctx->requests);
-			ctx->requests = 0;
-			free(ctx);
-			ctx = 0;
-		}
+	if (alloc == 0) {
+		alloc = fastcgi_default_allocator();
 	}
+	ctx = fastcgi_malloc(alloc, sizeof(fastcgi_context_t));
 	if (ctx != 0) {
-		ctx->current_header = malloc(sizeof(fcgi_record_header_t));
-		if (ctx->current_header == 0) {
-			buffer_destroy(ctx->input);
-			ctx->input = 0;
-			llist_destroy(ctx->requests);
-			ctx->requests = 0;
-			free(ctx);
-			ctx = 0;
+		ctx->alloc = alloc;
+		ctx->request_pages = 0;
+		ctx->free_requests = 0;
+		ctx->free_count = 0;
+		ctx->pool = pool;
+		ctx->owns_pool = pool == 0;
+		if (ctx->pool == 0) {
+			ctx->pool = slab_pool_create_with_allocator(
+				FASTCGI_POOL_FREE_BYTES, alloc);
 		}
-	}
-	if (ctx != 0) {
-		ctx->read_buffer_len = 1024;
-		ctx->read_buffer = malloc(ctx->read_buffer_len);
-		if (ctx->read_buffer == 0) {
-			free(ctx->current_header);
-			ctx->current_header = 0;
-			buffer_destroy(ctx->input);
-			ctx->input = 0;
-			llist_destroy(ctx->requests);
-			ctx->requests = 0;
-			free(ctx);
+		if (ctx->pool == 0) {
+			fastcgi_free(alloc, ctx);
 			ctx = 0;
 		}
 	}
 	if (ctx != 0) {
+		buffer_init_pooled(&ctx->input, ctx->pool);
 		ctx->read_state = 0;
-		ctx->current_header->version = 0;
-		ctx->current_header->type = 0;
-		ctx->current_header->request_id = 0;
-		ctx->current_header->content_length = 0;
-		ctx->current_header->padding_length = 0;
+		ctx->read_bytes = 0;
+		memset(&ctx->current_header, 0, sizeof(fcgi_record_header_t));
+		ctx->output_policy.flush_bytes = 0;
+		ctx->output_policy.flush_usec = 0;
+		ctx->output_policy.pack_records = 0;
+		ctx->flow_policy.max_requests = 0;
+		ctx->flow_policy.max_buffered = 0;
+		ctx->read_held = 0;
+		memset(&ctx->admission, 0, sizeof(fastcgi_admission_policy_t));
+		ctx->interval_start = 0;
+		ctx->interval_min_usec = UINT64_MAX;
+		ctx->overloaded = 0;
+		ctx->record_size = 0xffff;
+		ctx->record_padding = 1;
+		ctx->arena_block_size = 0;
+		ctx->spill_threshold = 0;
+		ctx->close_requested = 0;
+		ctx->idle_timeout_usec = 0;
+		ctx->last_active = 0;
+		ctx->abort_func = 0;
+		ctx->abort_user_data = 0;
+#ifdef FASTCGI_STATIC
+		ctx->limits.max_requests = FASTCGI_MAX_REQUESTS;
+		ctx->limits.max_params = FASTCGI_MAX_PARAMS;
+		ctx->limits.max_param_length = FASTCGI_MAX_PARAM_LENGTH;
+		ctx->limits.max_content = FASTCGI_MAX_CONTENT;
+		ctx->limits.max_output = FASTCGI_MAX_OUTPUT;
+		ctx->limits.max_buffered = FASTCGI_MAX_BUFFERED;
+#else
+		ctx->limits.max_requests = 0;
+		ctx->limits.max_params = 0;
+		ctx->limits.max_param_length = 0;
+		ctx->limits.max_content = 0;
+		ctx->limits.max_output = 0;
+		ctx->limits.max_buffered = 0;
+#endif
+		ctx->values.max_conns = 1;
+		ctx->values.max_reqs = ctx->limits.max_requests > 0
+			? ctx->limits.max_requests : 0xffff;
+		ctx->values.mpxs_conns = 1;
+		fastcgi_encode_values(ctx);
+		ctx->request_count = 0;
+		ctx->buffered = 0;
+		ctx->control = 0;
 	}
 	return ctx;
 }
 
+/* Destroy the live and the free requests and the request table */
+void fastcgi_destroy_requests(fastcgi_context_t *ctx)
+{
+	fastcgi_request_t *request = 0;
+	uint32_t page = 0;
+	uint32_t n = 0;
+
+	if (ctx->request_pages != 0) {
+		for (page = 0; page < FASTCGI_REQUEST_PAGES; page++) {
+			if (ctx->request_pages[page] == 0) {
+				continue;
+			}
+			for (n = 0; n < FASTCGI_REQUEST_PAGE_SIZE; n++) {
+				fastcgi_request_destroy(ctx->request_pages[page]->requests[n]);
+			}
+			fastcgi_free(ctx->alloc, ctx->request_pages[page]);
+		}
+		fastcgi_free(ctx->alloc, ctx->request_pages);
+		ctx->request_pages = 0;
+	}
+	while (ctx->free_requests != 0) {
+		request = ctx->free_requests;
+		ctx->free_requests = request->next_free;
+		fastcgi_request_destroy(request);
+	}
+	ctx->free_count = 0;
+}
+
 void fastcgi_destroy(fastcgi_context_t *ctx)
 {
 	if (ctx != 0) {
-		llist_destroy(ctx->requests);
-		ctx->requests = 0;
-		buffer_destroy(ctx->input);
-		ctx->input = 0;
-		free(ctx->current_header);
-		ctx->current_header = 0;
-		free(ctx->read_buffer);
-		ctx->read_buffer = 0;
-		ctx->read_buffer_len = 0;
-		free(ctx);
+		fastcgi_destroy_requests(ctx);
+		buffer_reset(&ctx->input);
+		bufferlist_destroy(ctx->control);
+		ctx->control = 0;
+		/* The requests and the input have returned their slabs */
+		if (ctx->owns_pool) {
+			slab_pool_destroy(ctx->pool);
+		}
+		ctx->pool = 0;
+		fastcgi_free(ctx->alloc, ctx);
+	}
+}
+
+int32_t fastcgi_context_reset(fastcgi_context_t *ctx)
+{
+	fastcgi_request_t *request = 0;
+	uint32_t page = 0;
+	uint32_t n = 0;
+
+	if (ctx == 0) {
+		return E_INVALID_OBJECT;
+	}
+	/* The pages stay allocated for the next connection */
+	for (page = 0; ctx->request_pages != 0 && page < FASTCGI_REQUEST_PAGES
+		; page++) {
+		if (ctx->request_pages[page] == 0) {
+			continue;
+		}
+		for (n = 0; n < FASTCGI_REQUEST_PAGE_SIZE; n++) {
+			request = ctx->request_pages[page]->requests[n];
+			if (request != 0) {
+				fastcgi_recycle_request(ctx, request);
+			}
+		}
+	}
+	buffer_clear(&ctx->input);
+	bufferlist_clear(ctx->control);
+	ctx->read_state = 0;
+	ctx->read_bytes = 0;
+	memset(&ctx->current_header, 0, sizeof(fcgi_record_header_t));
+	ctx->request_count = 0;
+	ctx->buffered = 0;
+	ctx->close_requested = 0;
+	ctx->read_held = 0;
+	/* The handler and its data belong to the previous connection */
+	ctx->abort_func = 0;
+	ctx->abort_user_data = 0;
+	ctx->interval_start = fastcgi_time_usec();
+	ctx->interval_min_usec = UINT64_MAX;
+	ctx->overloaded = 0;
+	if (ctx->idle_timeout_usec > 0) {
+		ctx->last_active = fastcgi_time_usec();
 	}
+	return E_SUCCESS;
 }
 
 int32_t fastcgi_current_request_id(fastcgi_context_t *ctx)
@@ -464,7 +1142,7 @@ int32_t fastcgi_current_request_id(fastcgi_context_t *ctx)
 	if (ctx == 0) {
 		return E_INVALID_OBJECT;
 	}
-	return ctx->current_header->request_id;
+	return ctx->current_header.request_id;
 }
 
 int32_t fastcgi_request_state(fastcgi_context_t *ctx, const uint16_t request_id)
@@ -492,6 +1170,9 @@ int32_t fastcgi_read(fastcgi_context_t *ctx
 	if (ctx == 0) {
 		return E_INVALID_OBJECT;
 	}
+	if (ctx->idle_timeout_usec > 0) {
+		ctx->last_active = fastcgi_time_usec();
+	}
 	return fastcgi_process_data(ctx, input, input_len);
 }
 
@@ -508,10 +1189,18 @@ int32_t fastcgi_write_output(fastcgi_context_t *ctx
 
 	request = fastcgi_find_request(ctx, request_id);
 	if (request == 0) {
-		result = E_REQUEST_NOT_FOUND;
+		return E_REQUEST_NOT_FOUND;
+	}
+	fastcgi_admission_pickup(ctx, request);
+	if (fastcgi_output_over_limit(ctx, request, input_len)) {
+		fastcgi_reject_request(ctx, request, FCGI_OVERLOADED);
+		result = E_REQUEST_LIMIT;
 	}
 	else {
 		result = fastcgi_request_write_output(request, input, input_len);
+		if (result > 0) {
+			fastcgi_charge(ctx, request, (size_t)result);
+		}
 	}
 	
 	return result;
@@ -530,10 +1219,18 @@ int32_t fastcgi_write_error(fastcgi_context_t *ctx
 
 	request = fastcgi_find_request(ctx, request_id);
 	if (request == 0) {
-		result = E_REQUEST_NOT_FOUND;
+		return E_REQUEST_NOT_FOUND;
+	}
+	fastcgi_admission_pickup(ctx, request);
+	if (fastcgi_output_over_limit(ctx, request, input_len)) {
+		fastcgi_reject_request(ctx, request, FCGI_OVERLOADED);
+		result = E_REQUEST_LIMIT;
 	}
 	else {
 		result = fastcgi_request_write_error(request, input, input_len);
+		if (result > 0) {
+			fastcgi_charge(ctx, request, (size_t)result);
+		}
 	}
 	
 	return result;
@@ -549,36 +1246,518 @@ int32_t fastcgi_finish(fastcgi_context_t *ctx, const uint16_t request_id)
 	if (request == 0) {
 		return E_REQUEST_NOT_FOUND;
 	}
+	fastcgi_admission_pickup(ctx, request);
 	return fastcgi_request_finish(request, FCGI_REQUEST_COMPLETE, 0);
 }
 
-int32_t fastcgi_write(fastcgi_context_t *ctx
+/* Get the number of microseconds until the buffered output of the request
+ * is due according to the output policy.
+ */
+int32_t fastcgi_output_due(fastcgi_context_t *ctx, fastcgi_request_t *request
+	, const uint64_t now)
+{
+	size_t pending = 0;
+	uint64_t deadline = 0;
+
+	if ((request->state & FASTCGI_RS_FINISH)) {
+		return 0;
+	}
+	pending = bufferlist_used(request->output) + bufferlist_used(request->error);
+	if (pending == 0 || pending >= ctx->output_policy.flush_bytes) {
+		return 0;
+	}
+	if (ctx->output_policy.flush_usec == 0) {
+		return 0x7fffffff;
+	}
+	deadline = request->output_since + ctx->output_policy.flush_usec;
+	if (now >= deadline) {
+		return 0;
+	}
+	return (int32_t)(deadline - now);
+}
+
+int32_t fastcgi_write(fastcgi_context_t *ctx
 	, char *output, const size_t output_len, const uint16_t request_id)
 {
 	int32_t result = E_SUCCESS;
 	int32_t state = 0;
+	size_t offset = 0;
+	size_t pending = 0;
 	fastcgi_request_t *request = 0;
 
 	if (ctx == 0) {
 		return E_INVALID_OBJECT;
 	}
+	if (ctx->idle_timeout_usec > 0) {
+		ctx->last_active = fastcgi_time_usec();
+	}
 
 	request = fastcgi_find_request(ctx, request_id);
 
 	if (request == 0) {
 		result = E_REQUEST_NOT_FOUND;
 	}
+	else if ((request->state & FASTCGI_RS_ABORT)) {
+		/* Aborted, nothing more is sent for the request */
+		return 0;
+	}
+	else if (ctx->output_policy.flush_bytes > 0
+		&& fastcgi_output_due(ctx, request, fastcgi_time_usec()) > 0) {
+		/* Hold back the output until the policy says otherwise */
+		return 0;
+	}
 	else {
-		result = fastcgi_request_output(request, output, output_len);
+		pending = bufferlist_used(request->output)
+			+ bufferlist_used(request->error);
+		do {
+			result = fastcgi_request_output(request, output + offset
+				, output_len - offset);
+			if (result > 0) {
+				offset += result;
+			}
+			state = fastcgi_request_get_state(request, 0);
+		} while (ctx->output_policy.pack_records && result > 0
+			&& (state & FASTCGI_RS_FINISHED) == 0);
+		/* Running out of space after some records is not an error */
+		if (offset > 0) {
+			result = (int32_t)offset;
+		}
+		fastcgi_credit(ctx, request, pending - bufferlist_used(request->output)
+			- bufferlist_used(request->error));
 	}
 	if (result >= 0) {
 		state = fastcgi_request_get_state(request, 0);
 		if ((state & FASTCGI_RS_FINISHED)) {
-			/* Reset request */
-			fastcgi_request_reset(request);
-			request->id = 0;
-			fastcgi_request_set_state(request, FASTCGI_RS_INIT);
+			fastcgi_recycle_request(ctx, request);
+		}
+	}
+	return result;
+}
+
+int32_t fastcgi_write_iov(fastcgi_context_t *ctx, fastcgi_iovec_t *vec
+	, const uint16_t request_id)
+{
+	fastcgi_request_t *request = 0;
+
+	if (ctx == 0) {
+		return E_INVALID_OBJECT;
+	}
+	if (ctx->idle_timeout_usec > 0) {
+		ctx->last_active = fastcgi_time_usec();
+	}
+	request = fastcgi_find_request(ctx, request_id);
+	if (request == 0) {
+		return E_REQUEST_NOT_FOUND;
+	}
+	if ((request->state & FASTCGI_RS_ABORT)
+		|| (ctx->output_policy.flush_bytes > 0
+			&& fastcgi_output_due(ctx, request, fastcgi_time_usec()) > 0)) {
+		/* Nothing is sent for an aborted request, other output is held
+		 * back until the policy says otherwise */
+		if (vec != 0) {
+			vec->iov_used = 0;
+		}
+		return 0;
+	}
+	return fastcgi_request_output_iov(request, vec);
+}
+
+int32_t fastcgi_write_consume(fastcgi_context_t *ctx
+	, const uint16_t request_id, const size_t len)
+{
+	int32_t result = E_SUCCESS;
+	size_t pending = 0;
+	fastcgi_request_t *request = 0;
+
+	if (ctx == 0) {
+		return E_INVALID_OBJECT;
+	}
+	request = fastcgi_find_request(ctx, request_id);
+	if (request == 0) {
+		return E_REQUEST_NOT_FOUND;
+	}
+	pending = bufferlist_used(request->output)
+		+ bufferlist_used(request->error);
+	result = fastcgi_request_output_consume(request, len);
+	if (result == E_SUCCESS) {
+		fastcgi_credit(ctx, request, pending - bufferlist_used(request->output)
+			- bufferlist_used(request->error));
+		if ((fastcgi_request_get_state(request, 0)
+			& (FASTCGI_RS_FINISHED | FASTCGI_RS_ABORT))) {
+			fastcgi_recycle_request(ctx, request);
 		}
 	}
 	return result;
 }
+
+int32_t fastcgi_set_output_policy(fastcgi_context_t *ctx
+	, const fastcgi_output_policy_t *policy)
+{
+	if (ctx == 0) {
+		return E_INVALID_OBJECT;
+	}
+	if (policy == 0) {
+		return E_INVALID_ARGUMENT;
+	}
+	ctx->output_policy = *policy;
+	return E_SUCCESS;
+}
+
+int32_t fastcgi_set_admission_policy(fastcgi_context_t *ctx
+	, const fastcgi_admission_policy_t *policy)
+{
+	if (ctx == 0) {
+		return E_INVALID_OBJECT;
+	}
+	if (policy == 0
+		|| (policy->target_usec > 0 && policy->interval_usec == 0)) {
+		return E_INVALID_ARGUMENT;
+	}
+	ctx->admission = *policy;
+	ctx->interval_start = fastcgi_time_usec();
+	ctx->interval_min_usec = UINT64_MAX;
+	ctx->overloaded = 0;
+	return E_SUCCESS;
+}
+
+int32_t fastcgi_set_flow_policy(fastcgi_context_t *ctx
+	, const fastcgi_flow_policy_t *policy)
+{
+	if (ctx == 0) {
+		return E_INVALID_OBJECT;
+	}
+	if (policy == 0) {
+		return E_INVALID_ARGUMENT;
+	}
+	ctx->flow_policy = *policy;
+	return E_SUCCESS;
+}
+
+int32_t fastcgi_paused(fastcgi_context_t *ctx)
+{
+	if (ctx == 0) {
+		return E_INVALID_OBJECT;
+	}
+	if (ctx->read_held && fastcgi_holds_record(ctx, &ctx->held_header) == 0) {
+		ctx->read_held = 0;
+	}
+	return ctx->read_held;
+}
+
+int32_t fastcgi_set_record_policy(fastcgi_context_t *ctx
+	, const fastcgi_record_policy_t *policy)
+{
+	uint32_t target = 0xffff + sizeof(fcgi_record_header_t);
+	uint32_t size = 0;
+
+	if (ctx == 0) {
+		return E_INVALID_OBJECT;
+	}
+	if (policy == 0) {
+		return E_INVALID_ARGUMENT;
+	}
+	/* Size the whole record, header included, to the targets */
+	if (policy->sndbuf > 0 && policy->sndbuf < target) {
+		target = policy->sndbuf;
+	}
+	if (policy->mss > 0 && target >= policy->mss) {
+		target -= target % policy->mss;
+	}
+	else if (policy->page_size > 0 && target >= policy->page_size) {
+		target -= target % policy->page_size;
+	}
+	if (target <= 2 * sizeof(fcgi_record_header_t)) {
+		return E_INVALID_SIZE;
+	}
+	size = target - sizeof(fcgi_record_header_t);
+	if (size > 0xffff) {
+		size = 0xffff;
+	}
+	if (policy->no_padding == 0) {
+		size &= ~((uint32_t)7);
+	}
+	ctx->record_size = (uint16_t)size;
+	ctx->record_padding = policy->no_padding == 0;
+	return E_SUCCESS;
+}
+
+int32_t fastcgi_set_request_arena(fastcgi_context_t *ctx
+	, const size_t block_size)
+{
+	if (ctx == 0) {
+		return E_INVALID_OBJECT;
+	}
+	ctx->arena_block_size = block_size;
+	return E_SUCCESS;
+}
+
+int32_t fastcgi_should_close(fastcgi_context_t *ctx)
+{
+	if (ctx == 0) {
+		return E_INVALID_OBJECT;
+	}
+	if (ctx->request_count > 0 || bufferlist_used(ctx->control) > 0) {
+		/* Queued control records, like END_REQUEST, must go out first */
+		return 0;
+	}
+	if (ctx->close_requested) {
+		return 1;
+	}
+	return fastcgi_idle_timeout(ctx) == 0;
+}
+
+int32_t fastcgi_set_idle_timeout(fastcgi_context_t *ctx, const uint32_t usec)
+{
+	if (ctx == 0) {
+		return E_INVALID_OBJECT;
+	}
+	ctx->idle_timeout_usec = usec;
+	ctx->last_active = fastcgi_time_usec();
+	return E_SUCCESS;
+}
+
+int32_t fastcgi_idle_timeout(fastcgi_context_t *ctx)
+{
+	uint64_t now = 0;
+	uint64_t deadline = 0;
+
+	if (ctx == 0) {
+		return E_INVALID_OBJECT;
+	}
+	if (ctx->idle_timeout_usec == 0 || ctx->request_count > 0) {
+		return 0x7fffffff;
+	}
+	now = fastcgi_time_usec();
+	deadline = ctx->last_active + ctx->idle_timeout_usec;
+	if (now >= deadline) {
+		return 0;
+	}
+	if (deadline - now > 0x7ffffffe) {
+		return 0x7ffffffe;
+	}
+	return (int32_t)(deadline - now);
+}
+
+int32_t fastcgi_set_abort_handler(fastcgi_context_t *ctx
+	, fastcgi_abort_func func, void *user_data)
+{
+	if (ctx == 0) {
+		return E_INVALID_OBJECT;
+	}
+	ctx->abort_func = func;
+	ctx->abort_user_data = user_data;
+	return E_SUCCESS;
+}
+
+int32_t fastcgi_set_values(fastcgi_context_t *ctx
+	, const fastcgi_values_t *values)
+{
+	if (ctx == 0) {
+		return E_INVALID_OBJECT;
+	}
+	if (values == 0) {
+		return E_INVALID_ARGUMENT;
+	}
+	ctx->values = *values;
+	fastcgi_encode_values(ctx);
+	return E_SUCCESS;
+}
+
+int32_t fastcgi_set_spill_threshold(fastcgi_context_t *ctx
+	, const size_t threshold)
+{
+	if (ctx == 0) {
+		return E_INVALID_OBJECT;
+	}
+	ctx->spill_threshold = threshold;
+	return E_SUCCESS;
+}
+
+int32_t fastcgi_set_limits(fastcgi_context_t *ctx
+	, const fastcgi_limits_t *limits)
+{
+	if (ctx == 0) {
+		return E_INVALID_OBJECT;
+	}
+	if (limits == 0) {
+		return E_INVALID_ARGUMENT;
+	}
+	ctx->limits = *limits;
+	return E_SUCCESS;
+}
+
+int32_t fastcgi_control_pending(fastcgi_context_t *ctx)
+{
+	if (ctx == 0) {
+		return E_INVALID_OBJECT;
+	}
+	return (int32_t)bufferlist_used(ctx->control);
+}
+
+int32_t fastcgi_write_control(fastcgi_context_t *ctx
+	, char *output, const size_t output_len)
+{
+	int32_t iov_count = 0;
+	int32_t n = 0;
+	size_t used = 0;
+	size_t offset = 0;
+	size_t record_len = 0;
+	struct iovec iov[sizeof(fcgi_record_header_t)];
+	fcgi_record_header_t header;
+
+	if (ctx == 0) {
+		return E_INVALID_OBJECT;
+	}
+	if (output == 0) {
+		return E_INVALID_ARGUMENT;
+	}
+	while (bufferlist_used(ctx->control) >= sizeof(fcgi_record_header_t)) {
+		/* Look at the header to find the length of the record */
+		iov_count = bufferlist_iov(ctx->control, iov
+			, sizeof(fcgi_record_header_t), sizeof(fcgi_record_header_t));
+		offset = 0;
+		for (n = 0; n < iov_count; n++) {
+			memcpy((char*)&header + offset, iov[n].iov_base, iov[n].iov_len);
+			offset += iov[n].iov_len;
+		}
+		record_len = sizeof(fcgi_record_header_t)
+			+ ntohs(header.content_length) + header.padding_length;
+		if (record_len > output_len - used) {
+			break;
+		}
+		bufferlist_read(ctx->control, output + used, record_len);
+		used += record_len;
+	}
+	return (int32_t)used;
+}
+
+int32_t fastcgi_pool_stats(fastcgi_context_t *ctx, slab_stats_t *stats)
+{
+	if (ctx == 0) {
+		return E_INVALID_OBJECT;
+	}
+	return slab_pool_stats(ctx->pool, stats);
+}
+
+int32_t fastcgi_flush_timeout(fastcgi_context_t *ctx, const uint16_t request_id)
+{
+	fastcgi_request_t *request = 0;
+
+	if (ctx == 0) {
+		return E_INVALID_OBJECT;
+	}
+	request = fastcgi_find_request(ctx, request_id);
+	if (request == 0) {
+		return E_REQUEST_NOT_FOUND;
+	}
+	if (ctx->output_policy.flush_bytes == 0) {
+		return 0;
+	}
+	return fastcgi_output_due(ctx, request, fastcgi_time_usec());
+}
+
+int32_t fastcgi_respond_size(fastcgi_context_t *ctx, const uint16_t request_id
+	, const size_t content_len)
+{
+	fastcgi_request_t *request = 0;
+
+	if (ctx == 0) {
+		return E_INVALID_OBJECT;
+	}
+	request = fastcgi_find_request(ctx, request_id);
+	if (request == 0) {
+		return E_REQUEST_NOT_FOUND;
+	}
+	return fastcgi_request_respond_size(request, content_len);
+}
+
+int32_t fastcgi_respond(fastcgi_context_t *ctx, const uint16_t request_id
+	, const char *headers, const size_t headers_len
+	, const char *body, const size_t body_len
+	, const uint32_t app_status
+	, char *output, const size_t output_len)
+{
+	int32_t result = E_SUCCESS;
+	fastcgi_request_t *request = 0;
+
+	if (ctx == 0) {
+		return E_INVALID_OBJECT;
+	}
+	request = fastcgi_find_request(ctx, request_id);
+	if (request == 0) {
+		return E_REQUEST_NOT_FOUND;
+	}
+	fastcgi_admission_pickup(ctx, request);
+	result = fastcgi_request_respond(request, headers, headers_len
+		, body, body_len, app_status, output, output_len);
+	if (result >= 0) {
+		fastcgi_recycle_request(ctx, request);
+	}
+	return result;
+}
+
+int32_t fastcgi_discard_input(fastcgi_context_t *ctx
+	, const uint16_t request_id)
+{
+	fastcgi_request_t *request = 0;
+
+	if (ctx == 0) {
+		return E_INVALID_OBJECT;
+	}
+	request = fastcgi_find_request(ctx, request_id);
+	if (request == 0) {
+		return E_REQUEST_NOT_FOUND;
+	}
+	fastcgi_admission_pickup(ctx, request);
+	fastcgi_credit(ctx, request, buffer_used(request->content)
+		+ buffer_used(request->data));
+	return fastcgi_request_discard_input(request);
+}
+
+int32_t fastcgi_authorize(fastcgi_context_t *ctx, const uint16_t request_id
+	, const uint16_t status, const char *headers, const size_t headers_len
+	, char *output, const size_t output_len)
+{
+	int32_t result = E_SUCCESS;
+	fastcgi_request_t *request = 0;
+
+	if (ctx == 0) {
+		return E_INVALID_OBJECT;
+	}
+	request = fastcgi_find_request(ctx, request_id);
+	if (request == 0) {
+		return E_REQUEST_NOT_FOUND;
+	}
+	fastcgi_admission_pickup(ctx, request);
+	result = fastcgi_request_authorize(request, status, headers, headers_len
+		, output, output_len);
+	if (result >= 0) {
+		fastcgi_recycle_request(ctx, request);
+	}
+	return result;
+}
+
+int32_t fastcgi_respond_iov(fastcgi_context_t *ctx, const uint16_t request_id
+	, const char *headers, const size_t headers_len
+	, const char *body, const size_t body_len
+	, const uint32_t app_status
+	, fastcgi_iovec_t *vec)
+{
+	int32_t result = E_SUCCESS;
+	fastcgi_request_t *request = 0;
+
+	if (ctx == 0) {
+		return E_INVALID_OBJECT;
+	}
+	request = fastcgi_find_request(ctx, request_id);
+	if (request == 0) {
+		return E_REQUEST_NOT_FOUND;
+	}
+	fastcgi_admission_pickup(ctx, request);
+	result = fastcgi_request_respond_iov(request, headers, headers_len
+		, body, body_len, app_status, vec);
+	if (result >= 0) {
+		fastcgi_recycle_request(ctx, request);
+	}
+	return result;
+}
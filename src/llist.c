@@ -5,7 +5,6 @@
 
 #include "llist.h"
 #include "errorcodes.h"
-#include <stdlib.h>
 
 /* Helper function for destroying list item data */
 void llist_destroy_item_data(llist_t *list, llist_item_t *item)
@@ -14,7 +13,7 @@ void llist_destroy_item_data(llist_t *list, llist_item_t *item)
 	if (item->data != 0) {
 		/* Do we have a user supplied destructor? */
 		if (list->item_dtor == 0) {
-			free(item->data);
+			fastcgi_free(list->alloc, item->data);
 		}
 		else {
 			(*(list->item_dtor))(item->data);
@@ -25,11 +24,22 @@ void llist_destroy_item_data(llist_t *list, llist_item_t *item)
 
 llist_t* llist_create(const size_t item_size_)
 {
-	llist_t *list = malloc(sizeof(llist_t));
+	return llist_create_with_allocator(item_size_, 0);
+}
+
+llist_t* llist_create_with_allocator(const size_t item_size_
+	, const fastcgi_allocator_t *alloc)
+{
+	if (alloc == 0) {
+		alloc = fastcgi_default_allocator();
+	}
+	llist_t *list = fastcgi_malloc(alloc, sizeof(llist_t));
 	if (list != 0) {
+		list->alloc = alloc;
 		list->item_size = item_size_;
 		list->item_dtor = 0;
 		list->items = 0;
+		list->tail = 0;
 		return list;
 	}
 	return 0;
@@ -46,10 +56,10 @@ void llist_destroy(llist_t *list)
 		next = ptr->next;
 		llist_destroy_item_data(list, ptr);
 		ptr->next = 0;
-		free(ptr);
+		fastcgi_free(list->alloc, ptr);
 		ptr = next;
 	}
-	free(list);
+	fastcgi_free(list->alloc, list);
 }
 
 int32_t llist_register_dtor(llist_t *list, llist_item_dtor_func item_dtor)
@@ -73,7 +83,7 @@ int32_t llist_add(llist_t *list, void *data, const size_t item_size)
 		return E_INVALID_SIZE;
 	}
 
-	llist_item_t *item = malloc(sizeof(llist_item_t));
+	llist_item_t *item = fastcgi_malloc(list->alloc, sizeof(llist_item_t));
 	if (item == 0) {
 		return E_MEMORY_ALLOCATION_FAILED;
 	}
@@ -100,13 +110,39 @@ int32_t llist_add(llist_t *list, void *data, const size_t item_size)
 		else {
 			prev->next = item;
 		}
+		list->tail = item;
 	}
 	else {
-		free(item);
+		fastcgi_free(list->alloc, item);
 	}
 	return result;
 }
 
+int32_t llist_add_item(llist_t *list, llist_item_t *item)
+{
+	if (list == 0 || item == 0) {
+		return E_INVALID_ARGUMENT;
+	}
+	item->next = 0;
+	if (list->tail == 0) {
+		list->items = item;
+	}
+	else {
+		list->tail->next = item;
+	}
+	list->tail = item;
+	return E_SUCCESS;
+}
+
+void llist_release(llist_t *list)
+{
+	if (list == 0) {
+		return;
+	}
+	list->items = 0;
+	list->tail = 0;
+}
+
 int32_t llist_take(llist_t *list, const void *data)
 {
 	if (list == 0) {
@@ -124,7 +160,10 @@ int32_t llist_take(llist_t *list, const void *data)
 			else {
 				prev->next = ptr->next;
 			}
-			free(ptr);
+			if (list->tail == ptr) {
+				list->tail = prev;
+			}
+			fastcgi_free(list->alloc, ptr);
 			result = E_SUCCESS;
 			break;
 		}
@@ -151,8 +190,11 @@ int32_t llist_remove(llist_t *list, const void *data)
 			else {
 				prev->next = ptr->next;
 			}
+			if (list->tail == ptr) {
+				list->tail = prev;
+			}
 			llist_destroy_item_data(list, ptr);
-			free(ptr);
+			fastcgi_free(list->alloc, ptr);
 			result = E_SUCCESS;
 			break;
 		}
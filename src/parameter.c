@@ -5,11 +5,23 @@
 
 fastcgi_parameter_t* fastcgi_parameter_create(const char *name, const size_t name_len
 	, const char *value, const size_t value_len)
+{
+	return fastcgi_parameter_create_with_allocator(name, name_len
+		, value, value_len, 0);
+}
+
+fastcgi_parameter_t* fastcgi_parameter_create_with_allocator(const char *name
+	, const size_t name_len, const char *value, const size_t value_len
+	, const fastcgi_allocator_t *alloc)
 {
 	int32_t result = E_SUCCESS;
 	fastcgi_parameter_t *param = 0;
-	param = malloc(sizeof(fastcgi_parameter_t));
+	if (alloc == 0) {
+		alloc = fastcgi_default_allocator();
+	}
+	param = fastcgi_malloc(alloc, sizeof(fastcgi_parameter_t));
 	if (param != 0) {
+		param->alloc = alloc;
 		param->name = 0;
 		param->name_len = 0;
 		param->name_allocated = 0;
@@ -30,18 +42,18 @@ void fastcgi_parameter_destroy(fastcgi_parameter_t *param)
 {
 	if (param != 0) {
 		if (param->name_allocated > 0) {
-			free(param->name);
+			fastcgi_free(param->alloc, param->name);
 			param->name = 0;
 			param->name_len = 0;
 			param->name_allocated = 0;
 		}
 		if (param->value_allocated > 0) {
-			free(param->value);
+			fastcgi_free(param->alloc, param->value);
 			param->value = 0;
 			param->value_len = 0;
 			param->value_allocated = 0;
 		}
-		free(param);
+		fastcgi_free(param->alloc, param);
 	}
 }
 
@@ -58,11 +70,11 @@ int32_t fastcgi_parameter_set(fastcgi_parameter_t* param
 	}
 	if (result == E_SUCCESS) {
 		if (name_len >= param->name_allocated) {
-			free(param->name);
+			fastcgi_free(param->alloc, param->name);
 			param->name = 0;
 			param->name_allocated = 0;
 			alloc_len = ((name_len / 32) + 1) * 32;
-			param->name = malloc(alloc_len);
+			param->name = fastcgi_malloc(param->alloc, alloc_len);
 			if (param->name != 0) {
 				param->name_allocated = alloc_len;
 			}
@@ -78,11 +90,11 @@ int32_t fastcgi_parameter_set(fastcgi_parameter_t* param
 	}
 	if (result == E_SUCCESS) {
 		if (value_len >= param->value_allocated) {
-			free(param->value);
+			fastcgi_free(param->alloc, param->value);
 			param->value = 0;
 			param->value_allocated = 0;
 			alloc_len = ((value_len / 128) + 1) * 128;
-			param->value = malloc(alloc_len);
+			param->value = fastcgi_malloc(param->alloc, alloc_len);
 			if (param->value != 0) {
 				param->value_allocated = alloc_len;
 			}
@@ -1,4 +1,10 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include <arpa/inet.h>
 
 #include "errorcodes.h"
@@ -29,49 +35,220 @@ void fastcgi_request_param_destroy(void *data)
 	fastcgi_parameter_destroy((fastcgi_parameter_t*)data);
 }
 
+/* Unmap and close the file holding the spilled bytes of a stream */
+void fastcgi_request_spill_close(fastcgi_spill_t *spill)
+{
+	if (spill->map != 0) {
+		munmap(spill->map, spill->map_len);
+		spill->map = 0;
+		spill->map_len = 0;
+	}
+	if (spill->fd >= 0) {
+		close(spill->fd);
+		spill->fd = -1;
+	}
+	spill->spilled = 0;
+}
+
+/* Append data to the file holding the spilled bytes of a stream */
+int32_t fastcgi_request_spill_write(fastcgi_spill_t *spill
+	, const char *data, const size_t len)
+{
+	size_t done = 0;
+	ssize_t n = 0;
+	while (done < len) {
+		n = write(spill->fd, data + done, len - done);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return E_WRITE_FAILED;
+		}
+		done += (size_t)n;
+	}
+	spill->spilled += len;
+	return (int32_t)len;
+}
+
+/* Move the bytes of a stream from memory to an anonymous memory file, or to
+ * an unlinked temporary file when memfd_create is unavailable.
+ */
+int32_t fastcgi_request_spill(buffer_t *buf, fastcgi_spill_t *spill)
+{
+	int32_t result = E_SUCCESS;
+	int fd = -1;
+#ifdef MFD_CLOEXEC
+	fd = memfd_create("fastcgi-content", MFD_CLOEXEC);
+#endif
+#ifdef O_TMPFILE
+	if (fd < 0) {
+		fd = open(P_tmpdir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+	}
+#endif
+	if (fd < 0) {
+		return E_INVALID_FILE_HANDLE;
+	}
+	spill->fd = fd;
+	spill->spilled = 0;
+	if (buffer_used(buf) > 0) {
+		result = fastcgi_request_spill_write(spill, buffer_peek(buf)
+			, buffer_used(buf));
+		if (result < 0) {
+			fastcgi_request_spill_close(spill);
+			return result;
+		}
+	}
+	buffer_reset(buf);
+	return E_SUCCESS;
+}
+
+void fastcgi_request_spill_init(fastcgi_spill_t *spill)
+{
+	spill->fd = -1;
+	spill->spilled = 0;
+	spill->map = 0;
+	spill->map_len = 0;
+}
+
+int32_t fastcgi_request_stream_spills(fastcgi_request_t *request
+	, buffer_t *buf, fastcgi_spill_t *spill, const size_t input_len)
+{
+	return spill->fd < 0 && request->spill_threshold > 0
+		&& buffer_used(buf) + input_len > request->spill_threshold;
+}
+
+int32_t fastcgi_request_stream_view(buffer_t *buf, fastcgi_spill_t *spill
+	, const char **data, size_t *len)
+{
+	void *map = 0;
+	if (data == 0 || len == 0) {
+		return E_INVALID_ARGUMENT;
+	}
+	if (spill->fd < 0) {
+		*len = buffer_used(buf);
+		*data = *len > 0 ? buffer_peek(buf) : 0;
+		return E_SUCCESS;
+	}
+	if (spill->map_len != spill->spilled) {
+		if (spill->map != 0) {
+			munmap(spill->map, spill->map_len);
+			spill->map = 0;
+			spill->map_len = 0;
+		}
+		if (spill->spilled > 0) {
+			map = mmap(0, spill->spilled, PROT_READ, MAP_SHARED, spill->fd, 0);
+			if (map == MAP_FAILED) {
+				return E_READ_FAILED;
+			}
+			spill->map = map;
+			spill->map_len = spill->spilled;
+		}
+	}
+	*data = spill->map;
+	*len = spill->map_len;
+	return E_SUCCESS;
+}
+
+/* Give back len bytes of the charge, they are no longer buffered */
+void fastcgi_request_credit(fastcgi_request_t *request, size_t len)
+{
+	if (len > request->buffered) {
+		len = request->buffered;
+	}
+	if (request->quota != 0) {
+		*request->quota -= len;
+	}
+	request->buffered -= len;
+}
+
+int32_t fastcgi_request_stream_fd(fastcgi_request_t *request, buffer_t *buf
+	, fastcgi_spill_t *spill)
+{
+	int32_t result = E_SUCCESS;
+	size_t moved = 0;
+	if (spill->fd < 0) {
+		moved = buffer_used(buf);
+		result = fastcgi_request_spill(buf, spill);
+		if (result < 0) {
+			return result;
+		}
+		/* The content now lives in the file, as when spilled on write */
+		fastcgi_request_credit(request, moved);
+	}
+	return spill->fd;
+}
+
+/* Append input to the stream kept in *buf and spill, the buffer is created
+ * on first use.
+ */
+int32_t fastcgi_request_stream_write(fastcgi_request_t *request
+	, buffer_t **buf, fastcgi_spill_t *spill
+	, const char *input, const size_t input_len)
+{
+	int32_t result = E_SUCCESS;
+	if (fastcgi_request_stream_spills(request, *buf, spill, input_len)) {
+		result = fastcgi_request_spill(*buf, spill);
+		if (result < 0) {
+			return result;
+		}
+	}
+	if (spill->fd >= 0) {
+		return fastcgi_request_spill_write(spill, input, input_len);
+	}
+	if (*buf == 0) {
+		if (input_len == 0) {
+			return 0;
+		}
+		*buf = buffer_create_pooled(request->pool);
+		if (*buf == 0) {
+			return E_MEMORY_ALLOCATION_FAILED;
+		}
+	}
+	return buffer_write(*buf, input, input_len);
+}
+
 fastcgi_request_t* fastcgi_request_create()
+{
+	return fastcgi_request_create_with_allocator(0);
+}
+
+fastcgi_request_t* fastcgi_request_create_with_allocator(
+	const fastcgi_allocator_t *alloc)
 {
 	fastcgi_request_t *request = 0;
-	request = malloc(sizeof(fastcgi_request_t));
+	if (alloc == 0) {
+		alloc = fastcgi_default_allocator();
+	}
+	request = fastcgi_malloc(alloc, sizeof(fastcgi_request_t));
 	if (request != 0) {
+		request->alloc = alloc;
 		request->id = 0;
 		request->role = 0;
 		request->flags = 0;
 		request->state = 0;
+		request->protocol_status = 0;
+		request->padding = 1;
+		request->record_size = 0xffff;
+		request->app_status = 0;
+		request->output_since = 0;
+		request->described_len = 0;
+		request->described_error = 0;
+		request->described_output = 0;
+		request->begun_at = 0;
 		request->params = 0;
 		request->content = 0;
 		request->output = 0;
-
-		request->params = llist_create(sizeof(fastcgi_parameter_t));
-		if (request->params == 0) {
-			fastcgi_request_destroy(request);
-			request = 0;
-		}
-		else {
-			llist_register_dtor(request->params
-				, fastcgi_request_param_destroy);
-		}
-	}
-	if (request != 0) {
-		request->content = buffer_create();
-		if (request->content == 0) {
-			fastcgi_request_destroy(request);
-			request = 0;
-		}
-	}
-	if (request != 0) {
-		request->output = buffer_create();
-		if (request->output == 0) {
-			fastcgi_request_destroy(request);
-			request = 0;
-		}
-	}
-	if (request != 0) {
-		request->error = buffer_create();
-		if (request->error == 0) {
-			fastcgi_request_destroy(request);
-			request = 0;
-		}
+		request->error = 0;
+		request->pool = 0;
+		request->arena = 0;
+		request->param_count = 0;
+		request->buffered = 0;
+		request->quota = 0;
+		request->spill_threshold = 0;
+		request->data = 0;
+		fastcgi_request_spill_init(&request->content_spill);
+		fastcgi_request_spill_init(&request->data_spill);
+		request->next_free = 0;
 	}
 	return request;
 }
@@ -79,26 +256,104 @@ fastcgi_request_t* fastcgi_request_create()
 void fastcgi_request_destroy(fastcgi_request_t *request)
 {
 	if (request != 0) {
-		buffer_destroy(request->error);
+		bufferlist_destroy(request->error);
 		request->error = 0;
-		buffer_destroy(request->output);
+		bufferlist_destroy(request->output);
 		request->output = 0;
 		buffer_destroy(request->content);
 		request->content = 0;
+		buffer_destroy(request->data);
+		request->data = 0;
+		fastcgi_request_spill_close(&request->content_spill);
+		fastcgi_request_spill_close(&request->data_spill);
+		if (request->arena != 0) {
+			llist_release(request->params);
+		}
 		llist_destroy(request->params);
 		request->params = 0;
-		free(request);
+		arena_destroy(request->arena);
+		request->arena = 0;
+		fastcgi_free(request->alloc, request);
 	}
 }
 
 void fastcgi_request_reset(fastcgi_request_t *request)
 {
 	if (request != 0) {
-		buffer_clear(request->error);
-		buffer_clear(request->output);
-		buffer_clear(request->content);
-		llist_foreach(request->params, fastcgi_request_param_reset, NULL);
+		bufferlist_clear(request->error);
+		bufferlist_clear(request->output);
+		buffer_reset(request->content);
+		buffer_reset(request->data);
+		fastcgi_request_spill_close(&request->content_spill);
+		fastcgi_request_spill_close(&request->data_spill);
+		request->output_since = 0;
+		request->described_len = 0;
+		request->described_error = 0;
+		request->described_output = 0;
+		request->begun_at = 0;
+		request->param_count = 0;
+		request->buffered = 0;
+		if (request->arena != 0) {
+			/* The parameters live in the arena */
+			llist_release(request->params);
+			arena_reset(request->arena);
+		}
+		else {
+			llist_foreach(request->params, fastcgi_request_param_reset, NULL);
+		}
+	}
+}
+
+int32_t fastcgi_request_create_arena(fastcgi_request_t *request
+	, slab_pool_t *pool, const size_t block_size)
+{
+	if (request == 0) {
+		return E_INVALID_OBJECT;
+	}
+	if (request->arena != 0) {
+		return E_SUCCESS;
 	}
+	/* Free parameters from the heap are replaced by arena parameters */
+	llist_destroy(request->params);
+	request->params = 0;
+	request->arena = arena_create(pool, block_size);
+	if (request->arena == 0) {
+		return E_MEMORY_ALLOCATION_FAILED;
+	}
+	return E_SUCCESS;
+}
+
+void* fastcgi_request_alloc(fastcgi_request_t *request, const size_t size)
+{
+	if (request == 0) {
+		return 0;
+	}
+	return arena_alloc(request->arena, size);
+}
+
+int32_t fastcgi_request_set_pool(fastcgi_request_t *request, slab_pool_t *pool)
+{
+	if (request == 0) {
+		return E_INVALID_OBJECT;
+	}
+	if (bufferlist_used(request->output) > 0
+		|| bufferlist_used(request->error) > 0) {
+		return E_INVALID_ARGUMENT;
+	}
+	request->pool = pool;
+	if (request->output != 0) {
+		request->output->pool = pool;
+	}
+	if (request->error != 0) {
+		request->error->pool = pool;
+	}
+	if (request->content != 0 && buffer_size(request->content) == 0) {
+		request->content->pool = pool;
+	}
+	if (request->data != 0 && buffer_size(request->data) == 0) {
+		request->data->pool = pool;
+	}
+	return E_SUCCESS;
 }
 
 int32_t fastcgi_request_get_state(fastcgi_request_t *request, const uint16_t mask)
@@ -160,6 +415,18 @@ int32_t fastcgi_request_set_state(fastcgi_request_t *request, const uint16_t sta
 		case FASTCGI_RS_FINISHED:
 			request->state |= FASTCGI_RS_FINISHED;
 			break;
+		case FASTCGI_RS_ABORT:
+			request->state |= FASTCGI_RS_ABORT;
+			break;
+		case FASTCGI_RS_DATA:
+			request->state |= FASTCGI_RS_DATA;
+			break;
+		case FASTCGI_RS_DATA_DONE:
+			request->state |= FASTCGI_RS_DATA_DONE;
+			break;
+		case FASTCGI_RS_DISCARD:
+			request->state |= FASTCGI_RS_DISCARD;
+			break;
 		default:
 			result = E_INVALID_ARGUMENT;
 	}
@@ -169,6 +436,40 @@ int32_t fastcgi_request_set_state(fastcgi_request_t *request, const uint16_t sta
 	return result;
 }
 
+/* Add a parameter with the parameter, its strings and the list item taken
+ * from the request arena.
+ */
+int32_t fastcgi_request_parameter_add_arena(fastcgi_request_t *request
+	, const char *name, const size_t name_len
+	, const char *value, const size_t value_len)
+{
+	llist_item_t *item = 0;
+	fastcgi_parameter_t *param = 0;
+
+	item = arena_alloc(request->arena, sizeof(llist_item_t));
+	param = arena_alloc(request->arena, sizeof(fastcgi_parameter_t));
+	if (item == 0 || param == 0) {
+		return E_MEMORY_ALLOCATION_FAILED;
+	}
+	param->name = arena_alloc(request->arena, name_len + 1);
+	param->value = arena_alloc(request->arena, value_len + 1);
+	if (param->name == 0 || param->value == 0) {
+		return E_MEMORY_ALLOCATION_FAILED;
+	}
+	/* Nothing is allocated by the parameter itself */
+	param->alloc = request->alloc;
+	param->name_allocated = 0;
+	param->value_allocated = 0;
+	param->name_len = name_len;
+	memcpy(param->name, name, name_len);
+	param->name[name_len] = 0;
+	param->value_len = value_len;
+	memcpy(param->value, value, value_len);
+	param->value[value_len] = 0;
+	item->data = param;
+	return llist_add_item(request->params, item);
+}
+
 int32_t fastcgi_request_parameter_add(fastcgi_request_t *request
 	, const char *name, const size_t name_len
 	, const char *value, const size_t value_len)
@@ -180,18 +481,44 @@ int32_t fastcgi_request_parameter_add(fastcgi_request_t *request
 	if (request == 0) {
 		return E_INVALID_OBJECT;
 	}
-	item = llist_find_item_match(request->params
-		, fastcgi_request_param_is_free, NULL);
-	if (item != 0) {
-		param = (fastcgi_parameter_t*)(item->data);
-		result = fastcgi_parameter_set(param, name, name_len, value, value_len);
+	if (request->params == 0) {
+		request->params = llist_create_with_allocator(sizeof(fastcgi_parameter_t)
+			, request->alloc);
+		if (request->params == 0) {
+			return E_MEMORY_ALLOCATION_FAILED;
+		}
+		llist_register_dtor(request->params, fastcgi_request_param_destroy);
+	}
+	if (request->arena != 0) {
+		result = fastcgi_request_parameter_add_arena(request
+			, name, name_len, value, value_len);
 	}
 	else {
-		param = fastcgi_parameter_create(name, name_len, value, value_len);
-		if (param != 0) {
-			result = llist_add(request->params, param, sizeof(fastcgi_parameter_t));
+		item = llist_find_item_match(request->params
+			, fastcgi_request_param_is_free, NULL);
+		if (item != 0) {
+			param = (fastcgi_parameter_t*)(item->data);
+			result = fastcgi_parameter_set(param, name, name_len
+				, value, value_len);
+		}
+		else {
+			param = fastcgi_parameter_create_with_allocator(name, name_len
+				, value, value_len, request->alloc);
+			if (param != 0) {
+				result = llist_add(request->params, param
+					, sizeof(fastcgi_parameter_t));
+				if (result != E_SUCCESS) {
+					fastcgi_parameter_destroy(param);
+				}
+			}
+			else {
+				result = E_MEMORY_ALLOCATION_FAILED;
+			}
 		}
 	}
+	if (result == E_SUCCESS) {
+		request->param_count++;
+	}
 	return result;
 }
 
@@ -213,9 +540,37 @@ int32_t fastcgi_prepare_header(fastcgi_request_t *request
 	return result;
 }
 
-int32_t fastcgi_request_calculate_size(const int32_t input_len)
+uint16_t fastcgi_request_padding(fastcgi_request_t *request
+	, const uint16_t input_len)
+{
+	if (request->padding == 0) {
+		return 0;
+	}
+	return size8b(input_len) - input_len;
+}
+
+int32_t fastcgi_request_calculate_size(fastcgi_request_t *request
+	, const int32_t input_len)
 {
-	return size8b(input_len) + sizeof(fcgi_record_header_t);
+	return input_len + fastcgi_request_padding(request, input_len)
+		+ sizeof(fcgi_record_header_t);
+}
+
+/* Get the content length to use for a record carrying stored_len bytes when
+ * output_len bytes are available for the whole record.
+ */
+size_t fastcgi_request_content_len(fastcgi_request_t *request
+	, const size_t stored_len, const size_t output_len)
+{
+	size_t limit = output_len - sizeof(fcgi_record_header_t);
+	if (limit > request->record_size) {
+		limit = request->record_size;
+	}
+	if (request->padding) {
+		/* Leave room for the padding */
+		limit &= ~((size_t)7);
+	}
+	return stored_len > limit ? limit : stored_len;
 }
 
 int32_t fastcgi_request_generate_record(fastcgi_request_t *request
@@ -241,7 +596,7 @@ int32_t fastcgi_request_generate_record(fastcgi_request_t *request
 		return E_INVALID_ARGUMENT;
 	}
 
-	total_len = fastcgi_request_calculate_size(input_len);
+	total_len = fastcgi_request_calculate_size(request, input_len);
 
 	if (output_len < total_len) {
 		result = E_INVALID_SIZE;
@@ -253,12 +608,14 @@ int32_t fastcgi_request_generate_record(fastcgi_request_t *request
 		/* Prepare header for user content */
 		header.type = type;
 		header.content_length = htons(input_len);
-		padding_len = size8b(input_len) - input_len;
+		padding_len = fastcgi_request_padding(request, input_len);
 		header.padding_length = (uint8_t)(padding_len);
 		/* Write header */
 		memcpy(ptr, &header, sizeof(fcgi_record_header_t));
 		offset += sizeof(fcgi_record_header_t);
-		memcpy(ptr+offset, input, input_len);
+		if (input != 0) {
+			memcpy(ptr+offset, input, input_len);
+		}
 		offset += input_len;
 		memcpy(ptr+offset, padding, padding_len);
 		offset += padding_len;
@@ -292,19 +649,133 @@ int32_t fastcgi_request_store(fastcgi_request_t *request
 	, const uint8_t type
 	, const char *input, const size_t input_len)
 {
-	buffer_t *buf = 0;
+	bufferlist_t **buf = 0;
 
 	if (type == FCGI_STDOUT) {
-		buf = request->output;
+		buf = &(request->output);
 	}
 	else if (type == FCGI_STDERR) {
-		buf = request->error;
+		buf = &(request->error);
 	}
 	else {
 		return E_INVALID_ARGUMENT;
 	}
+	if (*buf == 0) {
+		if (input_len == 0) {
+			return 0;
+		}
+		*buf = bufferlist_create(request->pool);
+		if (*buf == 0) {
+			return E_MEMORY_ALLOCATION_FAILED;
+		}
+	}
+
+	if (input_len > 0 && bufferlist_used(request->output) == 0
+		&& bufferlist_used(request->error) == 0) {
+		request->output_since = fastcgi_time_usec();
+	}
+	return bufferlist_write(*buf, input, input_len);
+}
+
+int32_t fastcgi_request_spills(fastcgi_request_t *request
+	, const size_t input_len)
+{
+	return fastcgi_request_stream_spills(request, request->content
+		, &request->content_spill, input_len);
+}
+
+size_t fastcgi_request_content_length(fastcgi_request_t *request)
+{
+	if (request == 0) {
+		return 0;
+	}
+	return request->content_spill.spilled + buffer_used(request->content);
+}
+
+int32_t fastcgi_request_content_view(fastcgi_request_t *request
+	, const char **data, size_t *len)
+{
+	if (request == 0) {
+		return E_INVALID_OBJECT;
+	}
+	return fastcgi_request_stream_view(request->content
+		, &request->content_spill, data, len);
+}
+
+int32_t fastcgi_request_content_fd(fastcgi_request_t *request)
+{
+	if (request == 0) {
+		return E_INVALID_OBJECT;
+	}
+	return fastcgi_request_stream_fd(request, request->content
+		, &request->content_spill);
+}
+
+int32_t fastcgi_request_write_input(fastcgi_request_t *request
+	, const char *input, const size_t input_len)
+{
+	if (request == 0) {
+		return E_INVALID_OBJECT;
+	}
+	return fastcgi_request_stream_write(request, &request->content
+		, &request->content_spill, input, input_len);
+}
+
+int32_t fastcgi_request_discard_input(fastcgi_request_t *request)
+{
+	if (request == 0) {
+		return E_INVALID_OBJECT;
+	}
+	buffer_reset(request->content);
+	buffer_reset(request->data);
+	fastcgi_request_spill_close(&request->content_spill);
+	fastcgi_request_spill_close(&request->data_spill);
+	fastcgi_request_set_state(request, FASTCGI_RS_DISCARD);
+	return E_SUCCESS;
+}
+
+int32_t fastcgi_request_data_spills(fastcgi_request_t *request
+	, const size_t input_len)
+{
+	return fastcgi_request_stream_spills(request, request->data
+		, &request->data_spill, input_len);
+}
+
+size_t fastcgi_request_data_length(fastcgi_request_t *request)
+{
+	if (request == 0) {
+		return 0;
+	}
+	return request->data_spill.spilled + buffer_used(request->data);
+}
 
-	return buffer_write(buf, input, input_len);
+int32_t fastcgi_request_data_view(fastcgi_request_t *request
+	, const char **data, size_t *len)
+{
+	if (request == 0) {
+		return E_INVALID_OBJECT;
+	}
+	return fastcgi_request_stream_view(request->data, &request->data_spill
+		, data, len);
+}
+
+int32_t fastcgi_request_data_fd(fastcgi_request_t *request)
+{
+	if (request == 0) {
+		return E_INVALID_OBJECT;
+	}
+	return fastcgi_request_stream_fd(request, request->data
+		, &request->data_spill);
+}
+
+int32_t fastcgi_request_write_data(fastcgi_request_t *request
+	, const char *input, const size_t input_len)
+{
+	if (request == 0) {
+		return E_INVALID_OBJECT;
+	}
+	return fastcgi_request_stream_write(request, &request->data
+		, &request->data_spill, input, input_len);
 }
 
 int32_t fastcgi_request_write_output(fastcgi_request_t *request
@@ -342,9 +813,9 @@ int32_t fastcgi_request_output(fastcgi_request_t *request
 {
 	int32_t result = E_SUCCESS;
 	size_t stored_len = 0;
-	size_t content_len = 0;
 	size_t use_len = 0;
 	int32_t finish = 0;
+	int32_t record_len = 0;
 
 	if (request == 0) {
 		return E_INVALID_OBJECT;
@@ -360,16 +831,17 @@ int32_t fastcgi_request_output(fastcgi_request_t *request
 	}
 
 	finish = (request->state & FASTCGI_RS_FINISH) > 0;
-	content_len = output_len - sizeof(fcgi_record_header_t);
+	record_len = output_len > 0x7fffffff ? 0x7fffffff : (int32_t)output_len;
 
-	stored_len = buffer_used(request->error);
+	stored_len = bufferlist_used(request->error);
 	if (stored_len > 0) {
-		if (content_len > 0) {
-			use_len = stored_len > content_len ? content_len : stored_len;
-			result = fastcgi_request_generate_record(request, output, output_len
-				, FCGI_STDERR, buffer_peek(request->error), use_len);
+		use_len = fastcgi_request_content_len(request, stored_len, output_len);
+		if (use_len > 0) {
+			result = fastcgi_request_generate_record(request, output, record_len
+				, FCGI_STDERR, 0, use_len);
 			if (result > 0) {
-				buffer_read(request->error, 0, use_len);
+				bufferlist_read(request->error
+					, output + sizeof(fcgi_record_header_t), use_len);
 			}
 		}
 		else {
@@ -379,18 +851,19 @@ int32_t fastcgi_request_output(fastcgi_request_t *request
 	}
 	else if (finish && (request->state & FASTCGI_RS_STDERR)
 		&& ((request->state & FASTCGI_RS_STDERR_DONE) == 0)) {
-		return fastcgi_request_generate_record(request, output, output_len
+		return fastcgi_request_generate_record(request, output, record_len
 			, FCGI_STDERR, 0, 0);
 	}
 
-	stored_len = buffer_used(request->output);
+	stored_len = bufferlist_used(request->output);
 	if (stored_len > 0) {
-		if (content_len > 0) {
-			use_len = stored_len > content_len ? content_len : stored_len;
-			result = fastcgi_request_generate_record(request, output, output_len
-				, FCGI_STDOUT, buffer_peek(request->output), use_len);
+		use_len = fastcgi_request_content_len(request, stored_len, output_len);
+		if (use_len > 0) {
+			result = fastcgi_request_generate_record(request, output, record_len
+				, FCGI_STDOUT, 0, use_len);
 			if (result > 0) {
-				buffer_read(request->output, 0, use_len);
+				bufferlist_read(request->output
+					, output + sizeof(fcgi_record_header_t), use_len);
 			}
 		}
 		else {
@@ -400,18 +873,18 @@ int32_t fastcgi_request_output(fastcgi_request_t *request
 	}
 	else if (finish && (request->state & FASTCGI_RS_STDOUT)
 		&& ((request->state & FASTCGI_RS_STDOUT_DONE) == 0)) {
-		return fastcgi_request_generate_record(request, output, output_len
+		return fastcgi_request_generate_record(request, output, record_len
 			, FCGI_STDOUT, 0, 0);
 	}
 
 	if (finish) {
-		if (content_len >= 8) {
+		if (output_len >= sizeof(fcgi_record_header_t) + sizeof(fcgi_record_end_t)) {
 			fcgi_record_end_t record = {
-				.app_status = request->app_status,
+				.app_status = htonl(request->app_status),
 				.protocol_status = request->protocol_status,
 				.reserved = {0}
 			};
-			result = fastcgi_request_generate_record(request, output, output_len
+			result = fastcgi_request_generate_record(request, output, record_len
 				, FCGI_END_REQUEST
 				, (const char*)&record, (uint16_t)sizeof(fcgi_record_end_t));
 			if (result >= 0) {
@@ -425,3 +898,489 @@ int32_t fastcgi_request_output(fastcgi_request_t *request
 
 	return result;
 }
+
+/* Destination of fastcgi_request_respond, either a flat output buffer or a
+ * iovec array where the flat buffer holds record headers and padding.
+ */
+typedef struct fastcgi_respond_writer_  {
+	char			*output;
+	size_t			output_len;
+	size_t			used;
+	fastcgi_iovec_t	*vec;
+} fastcgi_respond_writer_t;
+
+int32_t fastcgi_respond_writer_add(fastcgi_respond_writer_t *writer
+	, const char *data, const size_t len, const int32_t by_reference)
+{
+	struct iovec *last = 0;
+
+	if (len == 0) {
+		return E_SUCCESS;
+	}
+	if (writer->vec != 0 && by_reference) {
+		if (writer->vec->iov_used >= writer->vec->iov_count) {
+			return E_INVALID_SIZE;
+		}
+		writer->vec->iov[writer->vec->iov_used].iov_base = (void*)data;
+		writer->vec->iov[writer->vec->iov_used].iov_len = len;
+		writer->vec->iov_used++;
+		return E_SUCCESS;
+	}
+	if (len > writer->output_len - writer->used) {
+		return E_INVALID_SIZE;
+	}
+	memcpy(writer->output + writer->used, data, len);
+	if (writer->vec != 0) {
+		/* Grow the last entry if it ends where the copy was put */
+		if (writer->vec->iov_used > 0) {
+			last = &(writer->vec->iov[writer->vec->iov_used - 1]);
+			if ((char*)last->iov_base + last->iov_len
+				!= writer->output + writer->used) {
+				last = 0;
+			}
+		}
+		if (last == 0) {
+			if (writer->vec->iov_used >= writer->vec->iov_count) {
+				return E_INVALID_SIZE;
+			}
+			last = &(writer->vec->iov[writer->vec->iov_used]);
+			last->iov_base = writer->output + writer->used;
+			last->iov_len = 0;
+			writer->vec->iov_used++;
+		}
+		last->iov_len += len;
+	}
+	writer->used += len;
+	return E_SUCCESS;
+}
+
+int32_t fastcgi_respond_writer_header(fastcgi_respond_writer_t *writer
+	, fastcgi_request_t *request, const uint8_t type, const uint16_t len
+	, const uint8_t padding_len)
+{
+	fcgi_record_header_t header = {
+		.version = FCGI_VERSION_1,
+		.type = type,
+		.request_id = htons(request->id),
+		.content_length = htons(len),
+		.padding_length = padding_len,
+		.reserved = 0
+	};
+	return fastcgi_respond_writer_add(writer, (const char*)&header
+		, sizeof(fcgi_record_header_t), 0);
+}
+
+int32_t fastcgi_request_respond_size(fastcgi_request_t *request
+	, const size_t content_len)
+{
+	size_t total = 0;
+	size_t left = content_len;
+	size_t use_len = 0;
+
+	if (request == 0) {
+		return E_INVALID_OBJECT;
+	}
+	while (left > 0) {
+		use_len = fastcgi_request_content_len(request, left, (size_t)-1);
+		total += sizeof(fcgi_record_header_t) + use_len
+			+ fastcgi_request_padding(request, use_len);
+		left -= use_len;
+	}
+	/* Empty STDOUT, maybe empty STDERR and END_REQUEST */
+	total += sizeof(fcgi_record_header_t);
+	if ((request->state & FASTCGI_RS_STDERR)
+		&& (request->state & FASTCGI_RS_STDERR_DONE) == 0) {
+		total += sizeof(fcgi_record_header_t);
+	}
+	total += sizeof(fcgi_record_header_t) + sizeof(fcgi_record_end_t);
+	if (total > 0x7fffffff) {
+		return E_INVALID_SIZE;
+	}
+	return (int32_t)total;
+}
+
+int32_t fastcgi_request_respond_writer(fastcgi_request_t *request
+	, fastcgi_respond_writer_t *writer
+	, const char *headers, const size_t headers_len
+	, const char *body, const size_t body_len
+	, const uint32_t app_status)
+{
+	int32_t result = E_SUCCESS;
+	const char *padding = "\0\0\0\0\0\0\0\0";
+	const char *span[2] = { headers, body };
+	size_t left[2] = { headers_len, body_len };
+	int32_t n = 0;
+	size_t content_left = headers_len + body_len;
+	size_t use_len = 0;
+	size_t span_len = 0;
+	uint16_t padding_len = 0;
+	fcgi_record_end_t record = {
+		.app_status = htonl(app_status),
+		.protocol_status = FCGI_REQUEST_COMPLETE,
+		.reserved = {0}
+	};
+
+	if ((request->state & FASTCGI_RS_FINISHED)) {
+		return E_INVALID_ARGUMENT;
+	}
+	if (bufferlist_used(request->output) > 0
+		|| bufferlist_used(request->error) > 0) {
+		/* Buffered output would end up after the response */
+		return E_REQUEST_INVALID;
+	}
+	if (headers_len > 0x7fffffff || body_len > 0x7fffffff - headers_len) {
+		return E_INVALID_SIZE;
+	}
+	/* STDOUT records, each may span the end of headers and start of body */
+	while (result == E_SUCCESS && content_left > 0) {
+		use_len = fastcgi_request_content_len(request, content_left, (size_t)-1);
+		padding_len = fastcgi_request_padding(request, use_len);
+		result = fastcgi_respond_writer_header(writer, request, FCGI_STDOUT
+			, (uint16_t)use_len, (uint8_t)padding_len);
+		content_left -= use_len;
+		while (result == E_SUCCESS && use_len > 0) {
+			if (left[n] == 0) {
+				n++;
+				continue;
+			}
+			span_len = use_len > left[n] ? left[n] : use_len;
+			result = fastcgi_respond_writer_add(writer, span[n], span_len, 1);
+			span[n] += span_len;
+			left[n] -= span_len;
+			use_len -= span_len;
+		}
+		if (result == E_SUCCESS) {
+			result = fastcgi_respond_writer_add(writer, padding, padding_len, 0);
+		}
+	}
+	if (result == E_SUCCESS) {
+		result = fastcgi_respond_writer_header(writer, request, FCGI_STDOUT, 0, 0);
+	}
+	if (result == E_SUCCESS && (request->state & FASTCGI_RS_STDERR)
+		&& (request->state & FASTCGI_RS_STDERR_DONE) == 0) {
+		result = fastcgi_respond_writer_header(writer, request, FCGI_STDERR, 0, 0);
+		if (result == E_SUCCESS) {
+			fastcgi_request_set_state(request, FASTCGI_RS_STDERR_DONE);
+		}
+	}
+	if (result == E_SUCCESS) {
+		result = fastcgi_respond_writer_header(writer, request, FCGI_END_REQUEST
+			, sizeof(fcgi_record_end_t), 0);
+	}
+	if (result == E_SUCCESS) {
+		result = fastcgi_respond_writer_add(writer, (const char*)&record
+			, sizeof(fcgi_record_end_t), 0);
+	}
+	if (result == E_SUCCESS) {
+		request->app_status = app_status;
+		request->protocol_status = FCGI_REQUEST_COMPLETE;
+		fastcgi_request_set_state(request, FASTCGI_RS_STDOUT);
+		fastcgi_request_set_state(request, FASTCGI_RS_STDOUT_DONE);
+		fastcgi_request_set_state(request, FASTCGI_RS_FINISH);
+		fastcgi_request_set_state(request, FASTCGI_RS_FINISHED);
+	}
+	return result;
+}
+
+int32_t fastcgi_request_respond(fastcgi_request_t *request
+	, const char *headers, const size_t headers_len
+	, const char *body, const size_t body_len
+	, const uint32_t app_status
+	, char *output, const size_t output_len)
+{
+	int32_t result = E_SUCCESS;
+	fastcgi_respond_writer_t writer = {
+		.output = output,
+		.output_len = output_len,
+		.used = 0,
+		.vec = 0
+	};
+
+	if (request == 0) {
+		return E_INVALID_OBJECT;
+	}
+	if (output == 0) {
+		return E_INVALID_ARGUMENT;
+	}
+	result = fastcgi_request_respond_size(request, headers_len + body_len);
+	if (result >= 0 && (size_t)result > output_len) {
+		result = E_INVALID_SIZE;
+	}
+	if (result >= 0) {
+		result = fastcgi_request_respond_writer(request, &writer
+			, headers, headers_len, body, body_len, app_status);
+	}
+	if (result == E_SUCCESS) {
+		result = (int32_t)writer.used;
+	}
+	return result;
+}
+
+int32_t fastcgi_request_respond_iov(fastcgi_request_t *request
+	, const char *headers, const size_t headers_len
+	, const char *body, const size_t body_len
+	, const uint32_t app_status
+	, fastcgi_iovec_t *vec)
+{
+	int32_t result = E_SUCCESS;
+	int32_t i = 0;
+	size_t total = 0;
+	fastcgi_respond_writer_t writer = {
+		.output = 0,
+		.output_len = 0,
+		.used = 0,
+		.vec = vec
+	};
+
+	if (request == 0) {
+		return E_INVALID_OBJECT;
+	}
+	if (vec == 0 || vec->iov == 0 || vec->scratch == 0) {
+		return E_INVALID_ARGUMENT;
+	}
+	writer.output = vec->scratch;
+	writer.output_len = vec->scratch_len;
+	vec->iov_used = 0;
+	result = fastcgi_request_respond_writer(request, &writer
+		, headers, headers_len, body, body_len, app_status);
+	if (result == E_SUCCESS) {
+		for (i = 0; i < vec->iov_used; i++) {
+			total += vec->iov[i].iov_len;
+		}
+		result = (int32_t)total;
+	}
+	else {
+		vec->iov_used = 0;
+	}
+	return result;
+}
+
+/* Describe the records of one stream, a record is only described if its
+ * header, content and padding all fit.
+ */
+int32_t fastcgi_request_output_iov_stream(fastcgi_request_t *request
+	, fastcgi_respond_writer_t *writer, bufferlist_t *list
+	, const uint8_t type, uint32_t *described)
+{
+	int32_t result = E_SUCCESS;
+	const char *padding = "\0\0\0\0\0\0\0\0";
+	size_t stored_len = bufferlist_used(list);
+	size_t use_len = 0;
+	size_t iov_len = 0;
+	uint16_t padding_len = 0;
+	int32_t iov_used = 0;
+	size_t used = 0;
+	int32_t n = 0;
+	int32_t i = 0;
+
+	while (*described < stored_len && result == E_SUCCESS) {
+		iov_used = writer->vec->iov_used;
+		used = writer->used;
+		use_len = fastcgi_request_content_len(request
+			, stored_len - *described, (size_t)-1);
+		padding_len = fastcgi_request_padding(request, (uint16_t)use_len);
+		result = fastcgi_respond_writer_header(writer, request, type
+			, (uint16_t)use_len, (uint8_t)padding_len);
+		if (result == E_SUCCESS) {
+			n = bufferlist_iov_at(list, *described
+				, writer->vec->iov + writer->vec->iov_used
+				, writer->vec->iov_count - writer->vec->iov_used, use_len);
+			iov_len = 0;
+			for (i = 0; i < n; i++) {
+				iov_len += writer->vec->iov[writer->vec->iov_used + i].iov_len;
+			}
+			writer->vec->iov_used += n;
+			if (iov_len < use_len) {
+				result = E_INVALID_SIZE;
+			}
+		}
+		if (result == E_SUCCESS) {
+			result = fastcgi_respond_writer_add(writer, padding, padding_len, 0);
+		}
+		if (result == E_SUCCESS) {
+			fastcgi_request_set_state(request, type == FCGI_STDOUT
+				? FASTCGI_RS_STDOUT : FASTCGI_RS_STDERR);
+			*described += (uint32_t)use_len;
+		}
+		else {
+			/* Drop the partly described record */
+			writer->vec->iov_used = iov_used;
+			writer->used = used;
+		}
+	}
+	return result;
+}
+
+int32_t fastcgi_request_output_iov(fastcgi_request_t *request
+	, fastcgi_iovec_t *vec)
+{
+	int32_t result = E_SUCCESS;
+	int32_t i = 0;
+	size_t total = 0;
+	fcgi_record_end_t record = {
+		.app_status = 0,
+		.protocol_status = FCGI_REQUEST_COMPLETE,
+		.reserved = {0}
+	};
+	fastcgi_respond_writer_t writer = {
+		.output = 0,
+		.output_len = 0,
+		.used = 0,
+		.vec = vec
+	};
+
+	if (request == 0) {
+		return E_INVALID_OBJECT;
+	}
+	if (vec == 0 || vec->iov == 0 || vec->scratch == 0) {
+		return E_INVALID_ARGUMENT;
+	}
+	if (request->described_len > 0) {
+		/* The previous description has not been consumed */
+		return E_INVALID_ARGUMENT;
+	}
+	vec->iov_used = 0;
+	if ((request->state & FASTCGI_RS_FINISHED)) {
+		return E_SUCCESS;
+	}
+	writer.output = vec->scratch;
+	writer.output_len = vec->scratch_len;
+
+	result = fastcgi_request_output_iov_stream(request, &writer
+		, request->error, FCGI_STDERR, &request->described_error);
+	if (result == E_SUCCESS) {
+		result = fastcgi_request_output_iov_stream(request, &writer
+			, request->output, FCGI_STDOUT, &request->described_output);
+	}
+	if (result == E_SUCCESS && (request->state & FASTCGI_RS_FINISH)) {
+		/* Either all closing records are described or none of them */
+		total = sizeof(fcgi_record_header_t) * 3 + sizeof(fcgi_record_end_t);
+		if (total <= writer.output_len - writer.used
+			&& vec->iov_used < vec->iov_count) {
+			if ((request->state & FASTCGI_RS_STDERR)
+				&& (request->state & FASTCGI_RS_STDERR_DONE) == 0) {
+				fastcgi_respond_writer_header(&writer, request, FCGI_STDERR
+					, 0, 0);
+				fastcgi_request_set_state(request, FASTCGI_RS_STDERR_DONE);
+			}
+			if ((request->state & FASTCGI_RS_STDOUT)
+				&& (request->state & FASTCGI_RS_STDOUT_DONE) == 0) {
+				fastcgi_respond_writer_header(&writer, request, FCGI_STDOUT
+					, 0, 0);
+				fastcgi_request_set_state(request, FASTCGI_RS_STDOUT_DONE);
+			}
+			record.app_status = htonl(request->app_status);
+			record.protocol_status = request->protocol_status;
+			fastcgi_respond_writer_header(&writer, request, FCGI_END_REQUEST
+				, (uint16_t)sizeof(fcgi_record_end_t), 0);
+			fastcgi_respond_writer_add(&writer, (const char*)&record
+				, sizeof(fcgi_record_end_t), 0);
+			fastcgi_request_set_state(request, FASTCGI_RS_FINISHED);
+		}
+		else {
+			result = E_INVALID_SIZE;
+		}
+	}
+	total = 0;
+	for (i = 0; i < vec->iov_used; i++) {
+		total += vec->iov[i].iov_len;
+	}
+	if (total == 0 && result != E_SUCCESS) {
+		return result;
+	}
+	/* Running out of iovecs or scratch after some records is not an error */
+	request->described_len = (uint32_t)total;
+	return (int32_t)total;
+}
+
+int32_t fastcgi_request_output_consume(fastcgi_request_t *request
+	, const size_t len)
+{
+	if (request == 0) {
+		return E_INVALID_OBJECT;
+	}
+	if (len != request->described_len) {
+		return E_INVALID_SIZE;
+	}
+	if (request->described_error > 0) {
+		bufferlist_read(request->error, 0, request->described_error);
+	}
+	if (request->described_output > 0) {
+		bufferlist_read(request->output, 0, request->described_output);
+	}
+	request->described_len = 0;
+	request->described_error = 0;
+	request->described_output = 0;
+	return E_SUCCESS;
+}
+
+int32_t fastcgi_request_authorize(fastcgi_request_t *request
+	, const uint16_t status, const char *headers, const size_t headers_len
+	, char *output, const size_t output_len)
+{
+	int32_t result = E_SUCCESS;
+	char line[] = "Status: 000\r\n";
+	size_t content_len = sizeof(line) - 1 + headers_len + 2;
+	uint16_t padding_len = 0;
+	fcgi_record_end_t record = {
+		.app_status = 0,
+		.protocol_status = FCGI_REQUEST_COMPLETE,
+		.reserved = {0}
+	};
+	fastcgi_respond_writer_t writer = {
+		.output = output,
+		.output_len = output_len,
+		.used = 0,
+		.vec = 0
+	};
+
+	if (request == 0) {
+		return E_INVALID_OBJECT;
+	}
+	if (output == 0 || status < 100 || status > 999) {
+		return E_INVALID_ARGUMENT;
+	}
+	if ((request->state & FASTCGI_RS_FINISHED)) {
+		return E_INVALID_ARGUMENT;
+	}
+	if (bufferlist_used(request->output) > 0
+		|| bufferlist_used(request->error) > 0) {
+		return E_REQUEST_INVALID;
+	}
+	if (headers_len > request->record_size
+		|| content_len > fastcgi_request_content_len(request, content_len
+			, (size_t)-1)) {
+		return E_INVALID_SIZE;
+	}
+	padding_len = fastcgi_request_padding(request, (uint16_t)content_len);
+	if (output_len < 3 * sizeof(fcgi_record_header_t) + content_len
+		+ padding_len + sizeof(fcgi_record_end_t)) {
+		return E_INVALID_SIZE;
+	}
+	line[8] = '0' + status / 100;
+	line[9] = '0' + (status / 10) % 10;
+	line[10] = '0' + status % 10;
+
+	/* One STDOUT record with the status and headers, then the end */
+	fastcgi_respond_writer_header(&writer, request, FCGI_STDOUT
+		, (uint16_t)content_len, (uint8_t)padding_len);
+	fastcgi_respond_writer_add(&writer, line, sizeof(line) - 1, 0);
+	fastcgi_respond_writer_add(&writer, headers, headers_len, 0);
+	fastcgi_respond_writer_add(&writer, "\r\n\0\0\0\0\0\0\0", 2 + padding_len
+		, 0);
+	fastcgi_respond_writer_header(&writer, request, FCGI_STDOUT, 0, 0);
+	fastcgi_respond_writer_header(&writer, request, FCGI_END_REQUEST
+		, sizeof(fcgi_record_end_t), 0);
+	result = fastcgi_respond_writer_add(&writer, (const char*)&record
+		, sizeof(fcgi_record_end_t), 0);
+	if (result == E_SUCCESS) {
+		request->app_status = 0;
+		request->protocol_status = FCGI_REQUEST_COMPLETE;
+		fastcgi_request_set_state(request, FASTCGI_RS_STDOUT);
+		fastcgi_request_set_state(request, FASTCGI_RS_STDOUT_DONE);
+		fastcgi_request_set_state(request, FASTCGI_RS_FINISH);
+		fastcgi_request_set_state(request, FASTCGI_RS_FINISHED);
+		result = (int32_t)writer.used;
+	}
+	return result;
+}
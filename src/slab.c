@@ -0,0 +1,141 @@
+/* A pool of memory slabs in a few size classes
+ * (C) 2021 Erik Svensson <erik.public@gmail.com>
+ * Licensed under the MIT licence.
+ */
+
+#include <stdlib.h>
+
+#include "slab.h"
+#include "errorcodes.h"
+
+/* Get the size class for size bytes, SLAB_CLASSES if too large */
+int32_t slab_class(const size_t size)
+{
+	int32_t n = 0;
+	size_t class_size = SLAB_MIN_SIZE;
+	while (n < SLAB_CLASSES && class_size < size) {
+		class_size <<= 2;
+		n++;
+	}
+	return n;
+}
+
+slab_pool_t* slab_pool_create(const size_t free_bytes_max)
+{
+	return slab_pool_create_with_allocator(free_bytes_max, 0);
+}
+
+slab_pool_t* slab_pool_create_with_allocator(const size_t free_bytes_max
+	, const fastcgi_allocator_t *alloc)
+{
+	int32_t n = 0;
+	slab_pool_t *pool = 0;
+	if (alloc == 0) {
+		alloc = fastcgi_default_allocator();
+	}
+	pool = fastcgi_malloc(alloc, sizeof(slab_pool_t));
+	if (pool != 0) {
+		pool->alloc = alloc;
+		for (n = 0; n < SLAB_CLASSES; n++) {
+			pool->classes[n].size = (size_t)SLAB_MIN_SIZE << (2 * n);
+			pool->classes[n].in_use = 0;
+			pool->classes[n].free_count = 0;
+			pool->classes[n].free = 0;
+		}
+		pool->free_bytes_max = free_bytes_max;
+		memset(&(pool->stats), 0, sizeof(slab_stats_t));
+	}
+	return pool;
+}
+
+void slab_pool_destroy(slab_pool_t *pool)
+{
+	int32_t n = 0;
+	slab_free_t *next = 0;
+	if (pool == 0) {
+		return;
+	}
+	for (n = 0; n < SLAB_CLASSES; n++) {
+		while (pool->classes[n].free != 0) {
+			next = pool->classes[n].free->next;
+			fastcgi_free(pool->alloc, pool->classes[n].free);
+			pool->classes[n].free = next;
+		}
+		pool->classes[n].free_count = 0;
+	}
+	fastcgi_free(pool->alloc, pool);
+}
+
+size_t slab_size(slab_pool_t *pool, const size_t size)
+{
+	int32_t n = slab_class(size);
+	if (pool == 0 || n >= SLAB_CLASSES) {
+		return 0;
+	}
+	return pool->classes[n].size;
+}
+
+void* slab_alloc(slab_pool_t *pool, const size_t size)
+{
+	slab_free_t *slab = 0;
+	slab_class_t *cls = 0;
+	int32_t n = slab_class(size);
+	if (pool == 0 || n >= SLAB_CLASSES) {
+		return 0;
+	}
+	cls = &(pool->classes[n]);
+	if (cls->free != 0) {
+		slab = cls->free;
+		cls->free = slab->next;
+		cls->free_count--;
+		pool->stats.slabs_free--;
+		pool->stats.bytes_free -= cls->size;
+	}
+	else {
+		slab = fastcgi_malloc(pool->alloc, cls->size);
+		if (slab == 0) {
+			return 0;
+		}
+		pool->stats.misses++;
+	}
+	cls->in_use++;
+	pool->stats.allocs++;
+	pool->stats.slabs_in_use++;
+	pool->stats.bytes_in_use += cls->size;
+	return slab;
+}
+
+void slab_free(slab_pool_t *pool, void *slab, const size_t size)
+{
+	slab_free_t *item = (slab_free_t*)slab;
+	slab_class_t *cls = 0;
+	int32_t n = slab_class(size);
+	if (pool == 0 || slab == 0 || n >= SLAB_CLASSES) {
+		return;
+	}
+	cls = &(pool->classes[n]);
+	cls->in_use--;
+	pool->stats.slabs_in_use--;
+	pool->stats.bytes_in_use -= cls->size;
+	if (pool->stats.bytes_free + cls->size > pool->free_bytes_max) {
+		fastcgi_free(pool->alloc, slab);
+		return;
+	}
+	item->next = cls->free;
+	cls->free = item;
+	cls->free_count++;
+	pool->stats.slabs_free++;
+	pool->stats.bytes_free += cls->size;
+}
+
+int32_t slab_pool_stats(slab_pool_t *pool, slab_stats_t *stats)
+{
+	if (pool == 0) {
+		return E_INVALID_OBJECT;
+	}
+	if (stats == 0) {
+		return E_INVALID_ARGUMENT;
+	}
+	*stats = pool->stats;
+	return E_SUCCESS;
+}
@@ -1,3 +1,5 @@
+#include <time.h>
+
 #include "utilities.h"
 #include "errorcodes.h"
 
@@ -13,3 +15,13 @@ uint16_t size8b(const uint16_t size)
 	}
 	return s;
 }
+
+/* Monotonic time in microseconds */
+uint64_t fastcgi_time_usec()
+{
+	struct timespec ts;
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0) {
+		return 0;
+	}
+	return ((uint64_t)ts.tv_sec * 1000000) + ((uint64_t)ts.tv_nsec / 1000);
+}
@@ -1,2 +1,5 @@
 
 void buffer_test();
+void buffer_growth_test();
+void buffer_inline_test();
+void buffer_benchmark();
@@ -0,0 +1,2 @@
+
+void bufferlist_test();
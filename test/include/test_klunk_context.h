@@ -1,2 +1,25 @@
 
 void klunk_context_test();
+void klunk_context_output_policy_test();
+void klunk_context_record_policy_test();
+void klunk_context_respond_test();
+void klunk_context_write_iov_test();
+void klunk_context_arena_test();
+void klunk_context_allocator_test();
+void klunk_context_limits_test();
+void klunk_context_exhaustion_test();
+void klunk_context_quota_test();
+void klunk_context_reset_test();
+void klunk_context_spill_test();
+void klunk_context_values_test();
+void klunk_context_abort_test();
+void klunk_context_keep_conn_test();
+void klunk_context_connection_test();
+void klunk_context_filter_test();
+void klunk_context_authorizer_test();
+void klunk_context_early_response_test();
+void klunk_context_flow_test();
+void klunk_context_admission_test();
+void klunk_context_layout_benchmark();
+void klunk_context_multiplex_benchmark();
+void klunk_context_authorizer_benchmark();
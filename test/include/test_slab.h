@@ -0,0 +1,2 @@
+
+void slab_test();
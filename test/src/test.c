@@ -2,6 +2,9 @@
 
 #include "test_llist.h"
 #include "test_buffer.h"
+#include "test_bufferlist.h"
+#include "test_slab.h"
+#include "test_arena.h"
 #include "test_klunk_param.h"
 #include "test_klunk_request.h"
 #include "test_klunk_context.h"
@@ -10,8 +13,37 @@ int main(void)
 {
 	llist_test();
 	buffer_test();
+	buffer_growth_test();
+	buffer_inline_test();
+	buffer_benchmark();
+	slab_test();
+	arena_test();
+	bufferlist_test();
 	klunk_param_test();
 	klunk_param_llist_test();
 	klunk_request_test();
 	klunk_context_test();
+	klunk_context_output_policy_test();
+	klunk_context_record_policy_test();
+	klunk_context_respond_test();
+	klunk_context_write_iov_test();
+	klunk_context_arena_test();
+	klunk_context_allocator_test();
+	klunk_context_limits_test();
+	klunk_context_exhaustion_test();
+	klunk_context_quota_test();
+	klunk_context_reset_test();
+	klunk_context_spill_test();
+	klunk_context_values_test();
+	klunk_context_abort_test();
+	klunk_context_keep_conn_test();
+	klunk_context_connection_test();
+	klunk_context_filter_test();
+	klunk_context_authorizer_test();
+	klunk_context_early_response_test();
+	klunk_context_flow_test();
+	klunk_context_admission_test();
+	klunk_context_layout_benchmark();
+	klunk_context_multiplex_benchmark();
+	klunk_context_authorizer_benchmark();
 }
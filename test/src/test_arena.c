@@ -0,0 +1,65 @@
+#include "testcase.h"
+#include "arena.h"
+#include "slab.h"
+#include "errorcodes.h"
+#include "test_arena.h"
+
+void arena_test()
+{
+	size_t i = 0;
+	char *ptr1 = 0;
+	char *ptr2 = 0;
+	char *large = 0;
+	slab_stats_t stats;
+	slab_pool_t *pool = 0;
+	arena_t *arena = 0;
+
+	pool = slab_pool_create(1024 * 1024);
+	TEST_ASSERT_NOT_EQUAL(pool, 0);
+	arena = arena_create(pool, 1024);
+	TEST_ASSERT_NOT_EQUAL(arena, 0);
+	if (arena != 0) {
+		TEST_ASSERT_EQUAL(arena_alloc(arena, 0), 0);
+
+		/* Allocations are aligned and follow each other */
+		ptr1 = arena_alloc(arena, 3);
+		ptr2 = arena_alloc(arena, 5);
+		TEST_ASSERT_NOT_EQUAL(ptr1, 0);
+		TEST_ASSERT_EQUAL(((uintptr_t)ptr1 % sizeof(void*)), 0);
+		TEST_ASSERT_EQUAL(((uintptr_t)ptr2 % sizeof(void*)), 0);
+		TEST_ASSERT_EQUAL(ptr2 - ptr1, (int32_t)sizeof(void*));
+		TEST_ASSERT_EQUAL(arena_used(arena), 2 * sizeof(void*));
+
+		/* Filling a block chains another, large allocations get their own */
+		for (i = 0; i < 64; i++) {
+			TEST_ASSERT_NOT_EQUAL(arena_alloc(arena, 100), 0);
+		}
+		large = arena_alloc(arena, 100000);
+		TEST_ASSERT_NOT_EQUAL(large, 0);
+		memset(large, 0x11, 100000);
+
+		/* Reset keeps a single block */
+		arena_reset(arena);
+		TEST_ASSERT_EQUAL(arena_used(arena), 0);
+		TEST_ASSERT_EQUAL(arena->head->next, 0);
+		slab_pool_stats(pool, &stats);
+		TEST_ASSERT_EQUAL(stats.slabs_in_use, 1);
+
+		ptr2 = arena_alloc(arena, 3);
+		TEST_ASSERT_NOT_EQUAL(ptr2, 0);
+		arena_destroy(arena);
+	}
+	slab_pool_stats(pool, &stats);
+	TEST_ASSERT_EQUAL(stats.slabs_in_use, 0);
+	slab_pool_destroy(pool);
+
+	/* Without a pool */
+	arena = arena_create(0, 256);
+	TEST_ASSERT_NOT_EQUAL(arena, 0);
+	if (arena != 0) {
+		ptr1 = arena_alloc(arena, 1000);
+		TEST_ASSERT_NOT_EQUAL(ptr1, 0);
+		memset(ptr1, 0x22, 1000);
+		arena_destroy(arena);
+	}
+}
@@ -1,3 +1,6 @@
+#include <stdio.h>
+#include <time.h>
+
 #include "testcase.h"
 #include "buffer.h"
 #include "errorcodes.h"
@@ -200,3 +203,153 @@ void buffer_test()
 	free(data1);
 	free(data2);
 }
+
+void buffer_growth_test()
+{
+	int32_t result = 0;
+	int32_t resizes = 0;
+	size_t i = 0;
+	size_t size = 0;
+	char chunk[4096];
+	buffer_t* buffer = 0;
+
+	/* Mappings are only used with the system allocator */
+	fastcgi_set_allocator(fastcgi_system_allocator());
+	memset(chunk, 0xa5, sizeof(chunk));
+
+	/* Reserve allocates exactly what is asked for */
+	buffer = buffer_create();
+	TEST_ASSERT_NOT_EQUAL(buffer, 0);
+	if (buffer != 0) {
+		result = buffer_reserve(buffer, 10000);
+		TEST_ASSERT_EQUAL(result, 10000);
+		TEST_ASSERT_EQUAL(buffer_size(buffer), 10000);
+		result = buffer_reserve(buffer, 5000);
+		TEST_ASSERT_EQUAL(result, 10000);
+		buffer_destroy(buffer);
+	}
+
+	/* Appending grows geometrically and large buffers are mapped */
+	buffer_set_mmap_threshold(256 * 1024);
+	buffer = buffer_create();
+	TEST_ASSERT_NOT_EQUAL(buffer, 0);
+	if (buffer != 0) {
+		for (i = 0; i < 4096; i++) {
+			size = buffer_size(buffer);
+			result = buffer_write(buffer, chunk, sizeof(chunk));
+			TEST_ASSERT_EQUAL(result, (int32_t)sizeof(chunk));
+			if (buffer_size(buffer) != size) {
+				resizes++;
+			}
+		}
+		TEST_ASSERT_EQUAL(buffer_used(buffer), 4096 * sizeof(chunk));
+		TEST_ASSERT_LTE(resizes, 16);
+		TEST_ASSERT_TRUE((buffer->flags & BUFFER_MAPPED) != 0);
+		result = buffer_read(buffer, chunk, sizeof(chunk));
+		TEST_ASSERT_EQUAL(result, (int32_t)sizeof(chunk));
+		TEST_ASSERT_EQUAL((unsigned char)chunk[0], 0xa5);
+		TEST_ASSERT_EQUAL((unsigned char)chunk[4095], 0xa5);
+
+		result = buffer_reset(buffer);
+		TEST_ASSERT_EQUAL(result, 0);
+		TEST_ASSERT_EQUAL((buffer->flags & BUFFER_MAPPED), 0);
+		buffer_destroy(buffer);
+	}
+	buffer_set_mmap_threshold(1024 * 1024);
+	fastcgi_set_allocator(0);
+}
+
+void buffer_inline_test()
+{
+	int32_t result = 0;
+	char data[BUFFER_INLINE_SIZE * 2];
+	buffer_t* buffer = 0;
+
+	memset(data, 0x3c, sizeof(data));
+
+	/* Small payloads stay in the buffer object */
+	buffer = buffer_create_pooled(0);
+	TEST_ASSERT_NOT_EQUAL(buffer, 0);
+	if (buffer != 0) {
+		result = buffer_write(buffer, data, BUFFER_INLINE_SIZE / 2);
+		TEST_ASSERT_EQUAL(result, BUFFER_INLINE_SIZE / 2);
+		TEST_ASSERT_TRUE((buffer->flags & BUFFER_INLINE) != 0);
+		TEST_ASSERT_EQUAL(buffer_peek(buffer), buffer->inline_data);
+		result = buffer_write(buffer, data, BUFFER_INLINE_SIZE / 2);
+		TEST_ASSERT_EQUAL(result, BUFFER_INLINE_SIZE / 2);
+		TEST_ASSERT_EQUAL(buffer_size(buffer), BUFFER_INLINE_SIZE);
+
+		/* Outgrowing the inline storage moves the data to the heap */
+		result = buffer_write(buffer, data, sizeof(data));
+		TEST_ASSERT_EQUAL(result, (int32_t)sizeof(data));
+		TEST_ASSERT_EQUAL((buffer->flags & BUFFER_INLINE), 0);
+		TEST_ASSERT_EQUAL(buffer_used(buffer), BUFFER_INLINE_SIZE * 3);
+		TEST_ASSERT_EQUAL(memcmp(buffer_peek(buffer), data, sizeof(data)), 0);
+
+		/* Reset releases the heap memory */
+		result = buffer_reset(buffer);
+		TEST_ASSERT_EQUAL(result, 0);
+		TEST_ASSERT_EQUAL(buffer_size(buffer), 0);
+		TEST_ASSERT_EQUAL(buffer_peek(buffer), 0);
+		buffer_destroy(buffer);
+	}
+}
+
+/* Drain data_len bytes in chunk_len sized reads, returns nanoseconds used */
+double buffer_drain_time(const char *data, const size_t data_len
+	, const size_t chunk_len)
+{
+	struct timespec start;
+	struct timespec stop;
+	size_t left = data_len;
+	int32_t result = 0;
+	buffer_t* buffer = buffer_create();
+	TEST_ASSERT_NOT_EQUAL(buffer, 0);
+	if (buffer == 0) {
+		return 0;
+	}
+	result = buffer_write(buffer, data, data_len);
+	TEST_ASSERT_EQUAL(result, (int32_t)data_len);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (left > 0) {
+		result = buffer_read(buffer, 0, chunk_len);
+		if (result <= 0) {
+			break;
+		}
+		left -= result;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	TEST_ASSERT_EQUAL(left, 0);
+	buffer_destroy(buffer);
+	return ((stop.tv_sec - start.tv_sec) * 1e9)
+		+ (stop.tv_nsec - start.tv_nsec);
+}
+
+void buffer_benchmark()
+{
+	size_t small_len = 1024 * 1024;
+	size_t large_len = 16 * small_len;
+	size_t chunk_len = 512;
+	double small_ns = 0;
+	double large_ns = 0;
+	char *data = malloc(large_len);
+	if (data == 0) {
+		return;
+	}
+	memset(data, 0x5a, large_len);
+	fastcgi_set_allocator(fastcgi_system_allocator());
+
+	/* Reading consumes by offset, draining 16 times the data shall take
+	 * about 16 times as long, not 256 times as with a memmove per read.
+	 */
+	small_ns = buffer_drain_time(data, small_len, chunk_len);
+	large_ns = buffer_drain_time(data, large_len, chunk_len);
+	printf("buffer drain %zu bytes in %zu byte reads: %.0f ns\n"
+		, small_len, chunk_len, small_ns);
+	printf("buffer drain %zu bytes in %zu byte reads: %.0f ns\n"
+		, large_len, chunk_len, large_ns);
+	TEST_ASSERT_LT(large_ns, 64 * (small_ns + 1000));
+
+	fastcgi_set_allocator(0);
+	free(data);
+}
@@ -0,0 +1,152 @@
+#include "testcase.h"
+#include "bufferlist.h"
+#include "slab.h"
+#include "errorcodes.h"
+#include "test_bufferlist.h"
+
+void bufferlist_test()
+{
+	int32_t result = 0;
+	int32_t i = 0;
+	size_t data_len = 10000;
+	size_t offset = 0;
+	size_t room_len = 0;
+	char *room = 0;
+	struct iovec iov[8];
+	char *data1 = malloc(data_len);
+	char *data2 = malloc(data_len);
+	slab_pool_t *pool = 0;
+	slab_stats_t stats;
+	bufferlist_t *list = 0;
+
+	if (data1 == 0 || data2 == 0) {
+		free(data1);
+		free(data2);
+		return;
+	}
+	for (i = 0; i < (int32_t)data_len; i++) {
+		data1[i] = (char)(i % 251);
+	}
+
+	pool = slab_pool_create(1024 * 1024);
+	TEST_ASSERT_NOT_EQUAL(pool, 0);
+	list = bufferlist_create(pool);
+	TEST_ASSERT_NOT_EQUAL(list, 0);
+	if (list != 0) {
+		TEST_ASSERT_EQUAL(bufferlist_used(list), 0);
+
+		result = bufferlist_read(list, data2, 100);
+		TEST_ASSERT_EQUAL(result, 0);
+
+		/* Writes are spread over segments */
+		result = bufferlist_write(list, data1, 3000);
+		TEST_ASSERT_EQUAL(result, 3000);
+		result = bufferlist_write(list, data1 + 3000, data_len - 3000);
+		TEST_ASSERT_EQUAL(result, (int32_t)(data_len - 3000));
+		TEST_ASSERT_EQUAL(bufferlist_used(list), data_len);
+
+		/* Segments grow, the first segment is the smallest slab that fits */
+		slab_pool_stats(pool, &stats);
+		TEST_ASSERT_EQUAL(stats.slabs_in_use, 2);
+		TEST_ASSERT_EQUAL(list->head->size + sizeof(bufferlist_segment_t)
+			, slab_size(pool, 3000 + sizeof(bufferlist_segment_t)));
+		TEST_ASSERT_GT(list->tail->size, list->head->size);
+
+		/* The iovecs cover the requested bytes in order */
+		result = bufferlist_iov(list, iov, 8, 5000);
+		TEST_ASSERT_EQUAL(result, 2);
+		offset = 0;
+		for (i = 0; i < result; i++) {
+			TEST_ASSERT_EQUAL(memcmp(iov[i].iov_base, data1 + offset
+				, iov[i].iov_len), 0);
+			offset += iov[i].iov_len;
+		}
+		TEST_ASSERT_EQUAL(offset, 5000);
+
+		/* An offset may start in the middle of a segment */
+		offset = list->head->end - list->head->start - 100;
+		result = bufferlist_iov_at(list, offset, iov, 8, 200);
+		TEST_ASSERT_EQUAL(result, 2);
+		TEST_ASSERT_EQUAL(memcmp(iov[0].iov_base, data1 + offset
+			, iov[0].iov_len), 0);
+		TEST_ASSERT_EQUAL(iov[0].iov_len, 100);
+		TEST_ASSERT_EQUAL(iov[0].iov_len + iov[1].iov_len, 200);
+
+		/* Reading releases drained segments to the pool */
+		result = bufferlist_read(list, data2, 5000);
+		TEST_ASSERT_EQUAL(result, 5000);
+		TEST_ASSERT_EQUAL(memcmp(data1, data2, 5000), 0);
+		slab_pool_stats(pool, &stats);
+		TEST_ASSERT_EQUAL(stats.slabs_in_use, 1);
+		TEST_ASSERT_EQUAL(stats.slabs_free, 1);
+
+		result = bufferlist_read(list, 0, 500);
+		TEST_ASSERT_EQUAL(result, 500);
+
+		result = bufferlist_read(list, data2, data_len);
+		TEST_ASSERT_EQUAL(result, (int32_t)(data_len - 5500));
+		TEST_ASSERT_EQUAL(memcmp(data1 + 5500, data2, data_len - 5500), 0);
+		TEST_ASSERT_EQUAL(bufferlist_used(list), 0);
+		slab_pool_stats(pool, &stats);
+		TEST_ASSERT_EQUAL(stats.slabs_in_use, 0);
+		TEST_ASSERT_EQUAL(stats.slabs_free, 2);
+
+		/* Segments come back from the pool */
+		result = bufferlist_write(list, data1, 3000);
+		TEST_ASSERT_EQUAL(result, 3000);
+		slab_pool_stats(pool, &stats);
+		TEST_ASSERT_EQUAL(stats.slabs_free, 1);
+		TEST_ASSERT_EQUAL(stats.misses, 2);
+		bufferlist_clear(list);
+		TEST_ASSERT_EQUAL(bufferlist_used(list), 0);
+		slab_pool_stats(pool, &stats);
+		TEST_ASSERT_EQUAL(stats.slabs_free, 2);
+
+		bufferlist_destroy(list);
+	}
+	slab_pool_destroy(pool);
+
+	/* Without a pool */
+	list = bufferlist_create(0);
+	TEST_ASSERT_NOT_EQUAL(list, 0);
+	if (list != 0) {
+		result = bufferlist_write(list, data1, data_len);
+		TEST_ASSERT_EQUAL(result, (int32_t)data_len);
+		result = bufferlist_read(list, data2, data_len);
+		TEST_ASSERT_EQUAL(result, (int32_t)data_len);
+		TEST_ASSERT_EQUAL(memcmp(data1, data2, data_len), 0);
+		bufferlist_destroy(list);
+	}
+
+	/* Data generated in place */
+	list = bufferlist_create(0);
+	TEST_ASSERT_NOT_EQUAL(list, 0);
+	if (list != 0) {
+		room = bufferlist_reserve(list, 100, &room_len);
+		TEST_ASSERT_NOT_EQUAL(room, 0);
+		TEST_ASSERT_GTE(room_len, 100);
+		memcpy(room, data1, 60);
+		result = bufferlist_commit(list, 60);
+		TEST_ASSERT_EQUAL(result, 60);
+		TEST_ASSERT_EQUAL(bufferlist_used(list), 60);
+		result = bufferlist_commit(list, room_len);
+		TEST_ASSERT_EQUAL(result, E_INVALID_SIZE);
+		/* The rest of the room is used before a new segment is added */
+		offset = room_len - 60;
+		TEST_ASSERT_EQUAL(bufferlist_reserve(list, offset, &room_len)
+			, room + 60);
+		TEST_ASSERT_EQUAL(room_len, offset);
+		room = bufferlist_reserve(list, offset + 1, &room_len);
+		TEST_ASSERT_NOT_EQUAL(room, 0);
+		TEST_ASSERT_GT(room_len, offset);
+		memcpy(room, data1 + 60, 40);
+		result = bufferlist_commit(list, 40);
+		TEST_ASSERT_EQUAL(result, 40);
+		result = bufferlist_read(list, data2, 1000);
+		TEST_ASSERT_EQUAL(result, 100);
+		TEST_ASSERT_EQUAL(memcmp(data1, data2, 100), 0);
+		bufferlist_destroy(list);
+	}
+	free(data1);
+	free(data2);
+}
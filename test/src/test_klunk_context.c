@@ -4,12 +4,24 @@
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#endif
 
 #include "testcase.h"
 #include "fastcgi.h"
 #include "request.h"
 #include "parameter.h"
 #include "errorcodes.h"
+#include "contextpool.h"
+#include "connection.h"
 #include "test_klunk_context.h"
 
 typedef struct {
@@ -69,7 +81,7 @@ const char* type_as_string(uint8_t type)
 
 }
 
-uint16_t size8b(const uint16_t size)
+static uint16_t size8b(const uint16_t size)
 {
 	uint16_t s;
 	if ((size % 8) == 0) {
@@ -165,7 +177,9 @@ int32_t generate_param(uint8_t *data, const int32_t len, uint16_t request_id
 	}
 	uint8_t padding = (uint8_t)(size - (params_len + 8));
 	int32_t pos = generate_record_header(data, len, 4, request_id, params_len, padding);
-	memcpy(data + pos, params, params_len);
+	if (params_len > 0) {
+		memcpy(data + pos, params, params_len);
+	}
 	memset(data + (pos + params_len), 0, padding);
 	return size;
 }
@@ -180,7 +194,9 @@ int32_t generate_stdin(uint8_t *data, const int32_t len, uint16_t request_id
 	}
 	uint8_t padding = (uint8_t)(size - (stdin_len + 8));
 	int32_t pos = generate_record_header(data, len, 5, request_id, stdin_len, padding);
-	memcpy(data + pos, stdin, stdin_len);
+	if (stdin_len > 0) {
+		memcpy(data + pos, stdin, stdin_len);
+	}
 	memset(data + (pos + stdin_len), 0, padding);
 	return size;
 }
@@ -226,6 +242,52 @@ int32_t print_record(fcgi_record *rec)
 	return E_SUCCESS;
 }
 
+/* Allocator counting the live allocations in user */
+void* counting_malloc(size_t size, void *user)
+{
+	(*(int32_t*)user)++;
+	return malloc(size);
+}
+
+void* counting_realloc(void *ptr, size_t size, void *user)
+{
+	if (ptr == 0) {
+		(*(int32_t*)user)++;
+	}
+	return realloc(ptr, size);
+}
+
+void counting_free(void *ptr, void *user)
+{
+	(*(int32_t*)user)--;
+	free(ptr);
+}
+
+/* Allocator failing as many allocations as user says, then using malloc */
+void* refusing_malloc(size_t size, void *user)
+{
+	if (*(int32_t*)user > 0) {
+		(*(int32_t*)user)--;
+		return 0;
+	}
+	return malloc(size);
+}
+
+void* refusing_realloc(void *ptr, size_t size, void *user)
+{
+	if (*(int32_t*)user > 0) {
+		(*(int32_t*)user)--;
+		return 0;
+	}
+	return realloc(ptr, size);
+}
+
+void refusing_free(void *ptr, void *user)
+{
+	(void)user;
+	free(ptr);
+}
+
 void klunk_context_test()
 {
 	int32_t result = E_SUCCESS;
@@ -314,6 +376,13 @@ void klunk_context_test()
 		result = fastcgi_request_state(ctx, request_id);
 		TEST_ASSERT_EQUAL(result, FASTCGI_RS_NEW);
 
+		/* Nothing is allocated for the request until it is used */
+		request = fastcgi_find_request(ctx, request_id);
+		TEST_ASSERT_EQUAL(request->params, 0);
+		TEST_ASSERT_EQUAL(request->content, 0);
+		TEST_ASSERT_EQUAL(request->output, 0);
+		TEST_ASSERT_EQUAL(request->error, 0);
+
 		/* Run the same begin request again */
 
 		result = fastcgi_read(ctx, data, data_size);
@@ -499,3 +568,2103 @@ void klunk_context_test()
 	free(data);
 	free(params);
 }
+
+void klunk_context_output_policy_test()
+{
+	int32_t result = E_SUCCESS;
+	int32_t data_size = 0;
+	int32_t offset = 0;
+	uint16_t request_id = 1;
+	char data[1024];
+	fcgi_record rec;
+	fastcgi_context_t *ctx = 0;
+	fastcgi_output_policy_t policy = {
+		.flush_bytes = 64,
+		.flush_usec = 0,
+		.pack_records = 1
+	};
+
+	ctx = fastcgi_create();
+	TEST_ASSERT_NOT_EQUAL(ctx, 0);
+	if (ctx == 0) {
+		return;
+	}
+	result = fastcgi_set_output_policy(ctx, &policy);
+	TEST_ASSERT_EQUAL(result, E_SUCCESS);
+
+	data_size = generate_begin((uint8_t*)data, 1024, request_id);
+	result = fastcgi_read(ctx, data, data_size);
+	TEST_ASSERT_EQUAL(result, data_size);
+
+	/* Small fragments are held back */
+	result = fastcgi_write_output(ctx, request_id, "Status: 200\r\n", 13);
+	TEST_ASSERT_EQUAL(result, 13);
+	result = fastcgi_write_output(ctx, request_id, "\r\nhello", 7);
+	TEST_ASSERT_EQUAL(result, 7);
+	result = fastcgi_write(ctx, data, 1024, request_id);
+	TEST_ASSERT_EQUAL(result, 0);
+	result = fastcgi_flush_timeout(ctx, request_id);
+	TEST_ASSERT_EQUAL(result, 0x7fffffff);
+
+	/* Finishing flushes everything in one go */
+	result = fastcgi_finish(ctx, request_id);
+	TEST_ASSERT_EQUAL(result, E_SUCCESS);
+	data_size = fastcgi_write(ctx, data, 1024, request_id);
+	TEST_ASSERT_EQUAL(data_size, (8 + 24) + 8 + 16);
+
+	result = parse_record(data + offset, data_size - offset, &rec);
+	TEST_ASSERT_EQUAL(rec.header.type, FCGI_STDOUT);
+	TEST_ASSERT_EQUAL(rec.header.content_len, 20);
+	offset += result;
+	result = parse_record(data + offset, data_size - offset, &rec);
+	TEST_ASSERT_EQUAL(rec.header.type, FCGI_STDOUT);
+	TEST_ASSERT_EQUAL(rec.header.content_len, 0);
+	offset += result;
+	result = parse_record(data + offset, data_size - offset, &rec);
+	TEST_ASSERT_EQUAL(rec.header.type, FCGI_END_REQUEST);
+
+	result = fastcgi_request_state(ctx, request_id);
+	TEST_ASSERT_EQUAL(result, E_REQUEST_NOT_FOUND);
+
+	fastcgi_destroy(ctx);
+}
+
+void klunk_context_record_policy_test()
+{
+	int32_t result = E_SUCCESS;
+	int32_t data_size = 0;
+	uint16_t request_id = 1;
+	size_t body_len = 200000;
+	size_t output_len = 256 * 1024;
+	char *body = 0;
+	char *output = 0;
+	fcgi_record rec;
+	fastcgi_context_t *ctx = 0;
+	fastcgi_record_policy_t policy = {
+		.sndbuf = 0,
+		.mss = 1448,
+		.page_size = 0,
+		.no_padding = 1
+	};
+
+	body = malloc(body_len);
+	output = malloc(output_len);
+	assert(body != 0 && output != 0);
+	memset(body, 'x', body_len);
+
+	ctx = fastcgi_create();
+	TEST_ASSERT_NOT_EQUAL(ctx, 0);
+	if (ctx != 0) {
+		result = fastcgi_set_record_policy(ctx, &policy);
+		TEST_ASSERT_EQUAL(result, E_SUCCESS);
+		TEST_ASSERT_EQUAL(ctx->record_size, (45 * 1448) - 8);
+
+		data_size = generate_begin((uint8_t*)output, 1024, request_id);
+		result = fastcgi_read(ctx, output, data_size);
+		TEST_ASSERT_EQUAL(result, data_size);
+
+		result = fastcgi_write_output(ctx, request_id, body, body_len);
+		TEST_ASSERT_EQUAL(result, (int32_t)body_len);
+
+		/* The record is sized by the policy, not the output buffer */
+		data_size = fastcgi_write(ctx, output, output_len, request_id);
+		TEST_ASSERT_EQUAL(data_size, 45 * 1448);
+		result = parse_record(output, data_size, &rec);
+		TEST_ASSERT_EQUAL(result, data_size);
+		TEST_ASSERT_EQUAL(rec.header.type, FCGI_STDOUT);
+		TEST_ASSERT_EQUAL(rec.header.content_len, (45 * 1448) - 8);
+		TEST_ASSERT_EQUAL(rec.header.padding_len, 0);
+
+		/* A small output buffer still limits the record */
+		data_size = fastcgi_write(ctx, output, 1001, request_id);
+		TEST_ASSERT_EQUAL(data_size, 1001);
+		result = parse_record(output, data_size, &rec);
+		TEST_ASSERT_EQUAL(rec.header.content_len, 993);
+		TEST_ASSERT_EQUAL(rec.header.padding_len, 0);
+
+		fastcgi_destroy(ctx);
+	}
+	free(body);
+	free(output);
+}
+
+void klunk_context_respond_test()
+{
+	int32_t result = E_SUCCESS;
+	int32_t data_size = 0;
+	int32_t offset = 0;
+	int32_t i = 0;
+	uint16_t request_id = 1;
+	const char *headers = "Status: 200\r\n\r\n";
+	const char *body = "hello";
+	char data[1024];
+	char gathered[1024];
+	char scratch[64];
+	struct iovec iov[8];
+	fastcgi_iovec_t vec = {
+		.iov = iov,
+		.iov_count = 8,
+		.iov_used = 0,
+		.scratch = scratch,
+		.scratch_len = sizeof(scratch)
+	};
+	fcgi_record rec;
+	fastcgi_context_t *ctx = 0;
+
+	ctx = fastcgi_create();
+	TEST_ASSERT_NOT_EQUAL(ctx, 0);
+	if (ctx == 0) {
+		return;
+	}
+
+	data_size = generate_begin((uint8_t*)data, 1024, request_id);
+	result = fastcgi_read(ctx, data, data_size);
+	TEST_ASSERT_EQUAL(result, data_size);
+
+	result = fastcgi_respond_size(ctx, request_id, 20);
+	TEST_ASSERT_EQUAL(result, (8 + 24) + 8 + 16);
+
+	result = fastcgi_respond(ctx, request_id, headers, 15, body, 5, 0, data, 55);
+	TEST_ASSERT_EQUAL(result, E_INVALID_SIZE);
+
+	data_size = fastcgi_respond(ctx, request_id, headers, 15, body, 5, 0
+		, data, 1024);
+	TEST_ASSERT_EQUAL(data_size, (8 + 24) + 8 + 16);
+
+	result = parse_record(data, data_size, &rec);
+	TEST_ASSERT_EQUAL(rec.header.type, FCGI_STDOUT);
+	TEST_ASSERT_EQUAL(rec.header.content_len, 20);
+	TEST_ASSERT_EQUAL(rec.header.padding_len, 4);
+	TEST_ASSERT_EQUAL(memcmp(rec.content, "Status: 200\r\n\r\nhello", 20), 0);
+	offset += result;
+	result = parse_record(data + offset, data_size - offset, &rec);
+	TEST_ASSERT_EQUAL(rec.header.type, FCGI_STDOUT);
+	TEST_ASSERT_EQUAL(rec.header.content_len, 0);
+	offset += result;
+	result = parse_record(data + offset, data_size - offset, &rec);
+	TEST_ASSERT_EQUAL(rec.header.type, FCGI_END_REQUEST);
+	offset += result;
+	TEST_ASSERT_EQUAL(offset, data_size);
+
+	/* The request went straight back to the pool */
+	result = fastcgi_request_state(ctx, request_id);
+	TEST_ASSERT_EQUAL(result, E_REQUEST_NOT_FOUND);
+
+	/* The iovec variant describes the same bytes */
+	result = generate_begin((uint8_t*)gathered, 1024, request_id);
+	result = fastcgi_read(ctx, gathered, result);
+	TEST_ASSERT_EQUAL(result, 16);
+
+	result = fastcgi_respond_iov(ctx, request_id, headers, 15, body, 5, 0, &vec);
+	TEST_ASSERT_EQUAL(result, data_size);
+	TEST_ASSERT_EQUAL(vec.iov_used, 4);
+	offset = 0;
+	for (i = 0; i < vec.iov_used; i++) {
+		memcpy(gathered + offset, iov[i].iov_base, iov[i].iov_len);
+		offset += iov[i].iov_len;
+	}
+	TEST_ASSERT_EQUAL(memcmp(data, gathered, data_size), 0);
+
+	fastcgi_destroy(ctx);
+}
+
+void klunk_context_write_iov_test()
+{
+	int32_t result = E_SUCCESS;
+	int32_t data_size = 0;
+	int32_t offset = 0;
+	int32_t i = 0;
+	uint16_t request_id = 1;
+	char data[1024];
+	char scratch[64];
+	struct iovec iov[8];
+	fastcgi_iovec_t vec = {
+		.iov = iov,
+		.iov_count = 8,
+		.iov_used = 0,
+		.scratch = scratch,
+		.scratch_len = sizeof(scratch)
+	};
+	fcgi_record rec;
+	fastcgi_request_t *request = 0;
+	fastcgi_context_t *ctx = 0;
+
+	ctx = fastcgi_create();
+	TEST_ASSERT_NOT_EQUAL(ctx, 0);
+	if (ctx == 0) {
+		return;
+	}
+
+	data_size = generate_begin((uint8_t*)data, 1024, request_id);
+	result = fastcgi_read(ctx, data, data_size);
+	TEST_ASSERT_EQUAL(result, data_size);
+
+	result = fastcgi_write_output(ctx, request_id, "hello world", 11);
+	TEST_ASSERT_EQUAL(result, 11);
+	result = fastcgi_write_error(ctx, request_id, "oops", 4);
+	TEST_ASSERT_EQUAL(result, 4);
+	result = fastcgi_finish(ctx, request_id);
+	TEST_ASSERT_EQUAL(result, E_SUCCESS);
+	request = fastcgi_find_request(ctx, request_id);
+
+	data_size = fastcgi_write_iov(ctx, &vec, request_id);
+	TEST_ASSERT_EQUAL(data_size, (8 + 8) + (8 + 16) + 8 + 8 + 16);
+
+	/* Content is referenced in the output segments, not copied */
+	TEST_ASSERT_EQUAL(vec.iov_used, 5);
+	TEST_ASSERT_EQUAL(iov[1].iov_base, request->error->head->data
+		+ request->error->head->start);
+	TEST_ASSERT_EQUAL(iov[3].iov_base, request->output->head->data
+		+ request->output->head->start);
+	for (i = 0; i < vec.iov_used; i++) {
+		memcpy(data + offset, iov[i].iov_base, iov[i].iov_len);
+		offset += iov[i].iov_len;
+	}
+	TEST_ASSERT_EQUAL(offset, data_size);
+
+	offset = parse_record(data, data_size, &rec);
+	TEST_ASSERT_EQUAL(rec.header.type, FCGI_STDERR);
+	TEST_ASSERT_EQUAL(memcmp(rec.content, "oops", 4), 0);
+	offset += parse_record(data + offset, data_size - offset, &rec);
+	TEST_ASSERT_EQUAL(rec.header.type, FCGI_STDOUT);
+	TEST_ASSERT_EQUAL(memcmp(rec.content, "hello world", 11), 0);
+	offset += parse_record(data + offset, data_size - offset, &rec);
+	TEST_ASSERT_EQUAL(rec.header.type, FCGI_STDERR);
+	TEST_ASSERT_EQUAL(rec.header.content_len, 0);
+	offset += parse_record(data + offset, data_size - offset, &rec);
+	TEST_ASSERT_EQUAL(rec.header.type, FCGI_STDOUT);
+	TEST_ASSERT_EQUAL(rec.header.content_len, 0);
+	offset += parse_record(data + offset, data_size - offset, &rec);
+	TEST_ASSERT_EQUAL(rec.header.type, FCGI_END_REQUEST);
+	TEST_ASSERT_EQUAL(offset, data_size);
+
+	/* Nothing is removed until the description is consumed */
+	TEST_ASSERT_EQUAL(bufferlist_used(request->output), 11);
+	result = fastcgi_write_iov(ctx, &vec, request_id);
+	TEST_ASSERT_EQUAL(result, E_INVALID_ARGUMENT);
+	result = fastcgi_write_consume(ctx, request_id, data_size - 1);
+	TEST_ASSERT_EQUAL(result, E_INVALID_SIZE);
+
+	result = fastcgi_write_consume(ctx, request_id, data_size);
+	TEST_ASSERT_EQUAL(result, E_SUCCESS);
+	TEST_ASSERT_EQUAL(ctx->buffered, 0);
+	result = fastcgi_request_state(ctx, request_id);
+	TEST_ASSERT_EQUAL(result, E_REQUEST_NOT_FOUND);
+
+	/* An abort waits for described output to be consumed, the described
+	 * END_REQUEST is not sent twice */
+	for (request_id = 2; request_id <= 3; request_id++) {
+		data_size = generate_begin((uint8_t*)data, 1024, request_id);
+		result = fastcgi_read(ctx, data, data_size);
+		TEST_ASSERT_EQUAL(result, data_size);
+		result = fastcgi_write_output(ctx, request_id, "hello world", 11);
+		TEST_ASSERT_EQUAL(result, 11);
+		if (request_id == 2) {
+			fastcgi_finish(ctx, request_id);
+		}
+		data_size = fastcgi_write_iov(ctx, &vec, request_id);
+		TEST_ASSERT_GT(data_size, 0);
+		result = generate_record_header((uint8_t*)data, 1024
+			, FCGI_ABORT_REQUEST, request_id, 0, 0);
+		result = fastcgi_read(ctx, data, result);
+		TEST_ASSERT_EQUAL(result, 8);
+		TEST_ASSERT_EQUAL(fastcgi_control_pending(ctx)
+			, (request_id == 2 ? 0 : 16));
+		result = fastcgi_request_state(ctx, request_id);
+		TEST_ASSERT_GT(result, 0);
+		TEST_ASSERT_EQUAL((result & FASTCGI_RS_ABORT), FASTCGI_RS_ABORT);
+		request = fastcgi_find_request(ctx, request_id);
+		TEST_ASSERT_EQUAL(bufferlist_used(request->output), 11);
+		result = fastcgi_write(ctx, data, 1024, request_id);
+		TEST_ASSERT_EQUAL(result, 0);
+		result = fastcgi_write_consume(ctx, request_id, data_size);
+		TEST_ASSERT_EQUAL(result, E_SUCCESS);
+		result = fastcgi_request_state(ctx, request_id);
+		TEST_ASSERT_EQUAL(result, E_REQUEST_NOT_FOUND);
+		fastcgi_write_control(ctx, data, 1024);
+	}
+	TEST_ASSERT_EQUAL(ctx->buffered, 0);
+
+	fastcgi_destroy(ctx);
+}
+
+void klunk_context_arena_test()
+{
+	int32_t result = E_SUCCESS;
+	int32_t data_size = 0;
+	int32_t params_size = 0;
+	uint16_t request_id = 1;
+	char data[1024];
+	char params[1024];
+	char *ptr = 0;
+	fastcgi_request_t *request = 0;
+	fastcgi_parameter_t *param = 0;
+	fastcgi_context_t *ctx = 0;
+
+	ctx = fastcgi_create();
+	TEST_ASSERT_NOT_EQUAL(ctx, 0);
+	if (ctx == 0) {
+		return;
+	}
+	result = fastcgi_set_request_arena(ctx, 4096);
+	TEST_ASSERT_EQUAL(result, E_SUCCESS);
+
+	data_size = generate_begin((uint8_t*)data, 1024, request_id);
+	result = fastcgi_read(ctx, data, data_size);
+	TEST_ASSERT_EQUAL(result, data_size);
+
+	params_size = add_param(params, 1024, "hello", "world");
+	params_size += add_param(params + params_size, 1024 - params_size
+		, "goodbye", "moon");
+	data_size = generate_param((uint8_t*)data, 1024, request_id
+		, params, params_size);
+	result = fastcgi_read(ctx, data, data_size);
+	TEST_ASSERT_EQUAL(result, data_size);
+
+	/* The parameters are taken from the arena */
+	request = fastcgi_find_request(ctx, request_id);
+	TEST_ASSERT_NOT_EQUAL(request->arena, 0);
+	TEST_ASSERT_GT(arena_used(request->arena), 0);
+	param = (fastcgi_parameter_t*)(request->params->items->next->data);
+	TEST_ASSERT_EQUAL(strcmp(param->name, "goodbye"), 0);
+	TEST_ASSERT_EQUAL(strcmp(param->value, "moon"), 0);
+
+	ptr = fastcgi_request_alloc(request, 100);
+	TEST_ASSERT_NOT_EQUAL(ptr, 0);
+	memset(ptr, 0, 100);
+
+	/* Responding recycles the request and releases the arena */
+	data_size = fastcgi_respond(ctx, request_id, "\r\n", 2, 0, 0, 0
+		, data, 1024);
+	TEST_ASSERT_GT(data_size, 0);
+	TEST_ASSERT_EQUAL(arena_used(request->arena), 0);
+	TEST_ASSERT_EQUAL(llist_begin(request->params), 0);
+
+	/* The recycled request builds its parameters in the same arena */
+	data_size = generate_begin((uint8_t*)data, 1024, request_id);
+	result = fastcgi_read(ctx, data, data_size);
+	TEST_ASSERT_EQUAL(result, data_size);
+	TEST_ASSERT_EQUAL(fastcgi_find_request(ctx, request_id), request);
+
+	fastcgi_destroy(ctx);
+}
+
+void klunk_context_allocator_test()
+{
+	int32_t result = E_SUCCESS;
+	int32_t data_size = 0;
+	int32_t params_size = 0;
+	int32_t live = 0;
+	uint16_t request_id = 1;
+	char data[1024];
+	char params[1024];
+	fastcgi_allocator_t alloc = {
+		.malloc = counting_malloc,
+		.realloc = counting_realloc,
+		.free = counting_free,
+		.user = &live
+	};
+	fastcgi_context_t *ctx = 0;
+	buffer_t *buffer = 0;
+
+	ctx = fastcgi_create_with_allocator(&alloc);
+	TEST_ASSERT_NOT_EQUAL(ctx, 0);
+	if (ctx == 0) {
+		return;
+	}
+	TEST_ASSERT_GT(live, 0);
+
+	data_size = generate_begin((uint8_t*)data, 1024, request_id);
+	result = fastcgi_read(ctx, data, data_size);
+	TEST_ASSERT_EQUAL(result, data_size);
+	params_size = add_param(params, 1024, "hello", "world");
+	data_size = generate_param((uint8_t*)data, 1024, request_id
+		, params, params_size);
+	result = fastcgi_read(ctx, data, data_size);
+	TEST_ASSERT_EQUAL(result, data_size);
+	data_size = generate_stdin((uint8_t*)data, 1024, request_id, params, 500);
+	result = fastcgi_read(ctx, data, data_size);
+	TEST_ASSERT_EQUAL(result, data_size);
+
+	result = fastcgi_write_output(ctx, request_id, params, 300);
+	TEST_ASSERT_EQUAL(result, 300);
+	result = fastcgi_finish(ctx, request_id);
+	TEST_ASSERT_EQUAL(result, E_SUCCESS);
+	result = fastcgi_write(ctx, data, 1024, request_id);
+	TEST_ASSERT_GT(result, 300);
+
+	/* Everything went through the allocator and was given back to it */
+	fastcgi_destroy(ctx);
+	TEST_ASSERT_EQUAL(live, 0);
+
+	/* The default allocator is used by objects created after it is set */
+	result = fastcgi_set_allocator(&alloc);
+	TEST_ASSERT_EQUAL(result, E_SUCCESS);
+	buffer = buffer_create();
+	result = fastcgi_set_allocator(0);
+	TEST_ASSERT_EQUAL(result, E_SUCCESS);
+	TEST_ASSERT_EQUAL(live, 2);
+	buffer_destroy(buffer);
+	TEST_ASSERT_EQUAL(live, 0);
+
+	alloc.free = 0;
+	result = fastcgi_set_allocator(&alloc);
+	TEST_ASSERT_EQUAL(result, E_INVALID_ARGUMENT);
+}
+
+void klunk_context_limits_test()
+{
+	int32_t result = E_SUCCESS;
+	int32_t data_size = 0;
+	int32_t params_size = 0;
+	char data[1024];
+	char params[1024];
+	fcgi_record rec;
+	fastcgi_context_t *ctx = 0;
+
+	ctx = fastcgi_create();
+	TEST_ASSERT_NOT_EQUAL(ctx, 0);
+	if (ctx == 0) {
+		return;
+	}
+#ifdef FASTCGI_STATIC
+	TEST_ASSERT_EQUAL(ctx->alloc, fastcgi_static_allocator());
+	TEST_ASSERT_GT(fastcgi_static_used(), 0);
+#endif
+	ctx->limits.max_requests = 1;
+	ctx->limits.max_params = 1;
+	ctx->limits.max_content = 100;
+	ctx->limits.max_output = 100;
+
+	/* A request over the concurrency limit is turned away */
+	data_size = generate_begin((uint8_t*)data, 1024, 1);
+	result = fastcgi_read(ctx, data, data_size);
+	TEST_ASSERT_EQUAL(result, data_size);
+	data_size = generate_begin((uint8_t*)data, 1024, 2);
+	result = fastcgi_read(ctx, data, data_size);
+	TEST_ASSERT_EQUAL(result, data_size);
+	result = fastcgi_request_state(ctx, 2);
+	TEST_ASSERT_EQUAL(result, E_REQUEST_NOT_FOUND);
+	result = fastcgi_control_pending(ctx);
+	TEST_ASSERT_EQUAL(result, 16);
+
+	/* Only whole control records are written */
+	result = fastcgi_write_control(ctx, data, 15);
+	TEST_ASSERT_EQUAL(result, 0);
+	data_size = fastcgi_write_control(ctx, data, 1024);
+	TEST_ASSERT_EQUAL(data_size, 16);
+	parse_record(data, data_size, &rec);
+	TEST_ASSERT_EQUAL(rec.header.type, FCGI_END_REQUEST);
+	TEST_ASSERT_EQUAL(rec.header.request_id, 2);
+	TEST_ASSERT_EQUAL((uint8_t)rec.content[4], FCGI_OVERLOADED);
+	TEST_ASSERT_EQUAL(fastcgi_control_pending(ctx), 0);
+
+	/* Records still arriving for the rejected request are ignored */
+	params_size = add_param(params, 1024, "hello", "world");
+	data_size = generate_param((uint8_t*)data, 1024, 2, params, params_size);
+	result = fastcgi_read(ctx, data, data_size);
+	TEST_ASSERT_EQUAL(result, data_size);
+
+	/* Too many parameters end the request */
+	params_size += add_param(params + params_size, 1024 - params_size
+		, "goodbye", "moon");
+	data_size = generate_param((uint8_t*)data, 1024, 1, params, params_size);
+	result = fastcgi_read(ctx, data, data_size);
+	TEST_ASSERT_EQUAL(result, data_size);
+	result = fastcgi_request_state(ctx, 1);
+	TEST_ASSERT_EQUAL(result, E_REQUEST_NOT_FOUND);
+	data_size = fastcgi_write_control(ctx, data, 1024);
+	TEST_ASSERT_EQUAL(data_size, 16);
+	parse_record(data, data_size, &rec);
+	TEST_ASSERT_EQUAL(rec.header.request_id, 1);
+	TEST_ASSERT_EQUAL((uint8_t)rec.content[4], FCGI_OVERLOADED);
+
+	/* Too much STDIN ends the request */
+	data_size = generate_begin((uint8_t*)data, 1024, 3);
+	result = fastcgi_read(ctx, data, data_size);
+	TEST_ASSERT_EQUAL(result, data_size);
+	result = fastcgi_request_state(ctx, 3);
+	TEST_ASSERT_EQUAL(result, FASTCGI_RS_NEW);
+	data_size = generate_stdin((uint8_t*)data, 1024, 3, params, 101);
+	result = fastcgi_read(ctx, data, data_size);
+	TEST_ASSERT_EQUAL(result, data_size);
+	result = fastcgi_request_state(ctx, 3);
+	TEST_ASSERT_EQUAL(result, E_REQUEST_NOT_FOUND);
+	TEST_ASSERT_EQUAL(fastcgi_control_pending(ctx), 16);
+	fastcgi_write_control(ctx, data, 1024);
+
+	/* Too much buffered output ends the request */
+	data_size = generate_begin((uint8_t*)data, 1024, 4);
+	result = fastcgi_read(ctx, data, data_size);
+	TEST_ASSERT_EQUAL(result, data_size);
+	result = fastcgi_write_output(ctx, 4, params, 60);
+	TEST_ASSERT_EQUAL(result, 60);
+	result = fastcgi_write_error(ctx, 4, params, 41);
+	TEST_ASSERT_EQUAL(result, E_REQUEST_LIMIT);
+	result = fastcgi_request_state(ctx, 4);
+	TEST_ASSERT_EQUAL(result, E_REQUEST_NOT_FOUND);
+	TEST_ASSERT_EQUAL(fastcgi_control_pending(ctx), 16);
+	fastcgi_write_control(ctx, data, 1024);
+
+	fastcgi_destroy(ctx);
+}
+
+void klunk_context_exhaustion_test()
+{
+#ifdef FASTCGI_STATIC
+	const int32_t ids = FASTCGI_MAX_REQUESTS;
+	size_t used = 0;
+#else
+	const int32_t ids = 64;
+#endif
+	int32_t result = E_SUCCESS;
+	int32_t data_size = 0;
+	int32_t params_size = 0;
+	int32_t refuse = 0;
+	int32_t round = 0;
+	int32_t id = 0;
+	char data[1024];
+	char params[1024];
+	fastcgi_allocator_t alloc = {
+		.malloc = refusing_malloc,
+		.realloc = refusing_realloc,
+		.free = refusing_free,
+		.user = &refuse
+	};
+	fcgi_record rec;
+	fastcgi_context_t *ctx = 0;
+
+	ctx = fastcgi_create_with_allocator(&alloc);
+	TEST_ASSERT_NOT_EQUAL(ctx, 0);
+	if (ctx == 0) {
+		return;
+	}
+	params_size = add_param(params, 1024, "hello", "world");
+
+	/* A request that cannot be allocated is turned away as overloaded */
+	refuse = 1;
+	data_size = generate_begin((uint8_t*)data, 1024, 1);
+	result = fastcgi_read(ctx, data, data_size);
+	TEST_ASSERT_EQUAL(result, data_size);
+	TEST_ASSERT_EQUAL(refuse, 0);
+	result = fastcgi_request_state(ctx, 1);
+	TEST_ASSERT_EQUAL(result, E_REQUEST_NOT_FOUND);
+	data_size = fastcgi_write_control(ctx, data, 1024);
+	TEST_ASSERT_EQUAL(data_size, 16);
+	parse_record(data, data_size, &rec);
+	TEST_ASSERT_EQUAL(rec.header.type, FCGI_END_REQUEST);
+	TEST_ASSERT_EQUAL(rec.header.request_id, 1);
+	TEST_ASSERT_EQUAL((uint8_t)rec.content[4], FCGI_OVERLOADED);
+
+	/* Running out while decoding parameters only ends that request */
+	for (id = 2; id <= 3; id++) {
+		data_size = generate_begin((uint8_t*)data, 1024, id);
+		result = fastcgi_read(ctx, data, data_size);
+		TEST_ASSERT_EQUAL(result, data_size);
+	}
+	refuse = 1;
+	data_size = generate_param((uint8_t*)data, 1024, 2, params, params_size);
+	result = fastcgi_read(ctx, data, data_size);
+	TEST_ASSERT_EQUAL(result, data_size);
+	TEST_ASSERT_EQUAL(refuse, 0);
+	result = fastcgi_request_state(ctx, 2);
+	TEST_ASSERT_EQUAL(result, E_REQUEST_NOT_FOUND);
+	result = fastcgi_request_state(ctx, 3);
+	TEST_ASSERT_GT(result, 0);
+	data_size = fastcgi_write_control(ctx, data, 1024);
+	TEST_ASSERT_EQUAL(data_size, 16);
+	parse_record(data, data_size, &rec);
+	TEST_ASSERT_EQUAL(rec.header.request_id, 2);
+	TEST_ASSERT_EQUAL((uint8_t)rec.content[4], FCGI_OVERLOADED);
+
+	/* The connection goes on once memory is available again */
+	data_size = generate_begin((uint8_t*)data, 1024, 2);
+	result = fastcgi_read(ctx, data, data_size);
+	TEST_ASSERT_EQUAL(result, data_size);
+	result = fastcgi_request_state(ctx, 2);
+	TEST_ASSERT_GT(result, 0);
+
+	/* Output is only charged once it has been buffered */
+	refuse = 1;
+	result = fastcgi_write_output(ctx, 2, "hello", 5);
+	TEST_ASSERT_EQUAL(result, E_MEMORY_ALLOCATION_FAILED);
+	TEST_ASSERT_EQUAL(refuse, 0);
+	TEST_ASSERT_EQUAL(ctx->buffered, 0);
+	result = fastcgi_write_output(ctx, 2, "hello", 5);
+	TEST_ASSERT_EQUAL(result, 5);
+	TEST_ASSERT_EQUAL(ctx->buffered, 5);
+	fastcgi_destroy(ctx);
+
+	/* Filling the context to its limits and draining it again keeps taking
+	 * the same memory, with FASTCGI_STATIC from the static region.
+	 */
+	ctx = fastcgi_create();
+	TEST_ASSERT_NOT_EQUAL(ctx, 0);
+	if (ctx == 0) {
+		return;
+	}
+	for (round = 0; round < 4; round++) {
+		for (id = 1; id <= ids; id++) {
+			data_size = generate_begin((uint8_t*)data, 1024, id);
+			data_size += generate_param((uint8_t*)data + data_size
+				, 1024 - data_size, id, params, params_size);
+			data_size += generate_param((uint8_t*)data + data_size
+				, 1024 - data_size, id, 0, 0);
+			result = fastcgi_read(ctx, data, data_size);
+			TEST_ASSERT_EQUAL(result, data_size);
+			data_size = generate_stdin((uint8_t*)data, 1024, id, params, 500);
+			result = fastcgi_read(ctx, data, data_size);
+			TEST_ASSERT_EQUAL(result, data_size);
+		}
+		TEST_ASSERT_EQUAL(ctx->request_count, (uint32_t)ids);
+		TEST_ASSERT_EQUAL(fastcgi_control_pending(ctx), 0);
+		for (id = 1; id <= ids; id++) {
+			result = fastcgi_respond(ctx, id, "\r\n", 2, 0, 0, 0, data, 1024);
+			TEST_ASSERT_GT(result, 0);
+		}
+		TEST_ASSERT_EQUAL(ctx->request_count, 0);
+		TEST_ASSERT_EQUAL(ctx->buffered, 0);
+#ifdef FASTCGI_STATIC
+		if (round == 0) {
+			used = fastcgi_static_used();
+		}
+		TEST_ASSERT_EQUAL(fastcgi_static_used(), used);
+#endif
+	}
+	fastcgi_destroy(ctx);
+}
+
+void klunk_context_quota_test()
+{
+	int32_t result = E_SUCCESS;
+	int32_t data_size = 0;
+	char data[1024];
+	char content[1024];
+	fcgi_record rec;
+	fastcgi_limits_t limits = {0};
+	fastcgi_context_t *ctx = 0;
+
+	ctx = fastcgi_create();
+	TEST_ASSERT_NOT_EQUAL(ctx, 0);
+	if (ctx == 0) {
+		return;
+	}
+	result = fastcgi_set_limits(ctx, 0);
+	TEST_ASSERT_EQUAL(result, E_INVALID_ARGUMENT);
+	limits.max_param_length = 100;
+	limits.max_buffered = 300;
+	result = fastcgi_set_limits(ctx, &limits);
+	TEST_ASSERT_EQUAL(result, E_SUCCESS);
+	memset(content, 'x', sizeof(content));
+
+	/* A long parameter is refused as soon as its length is decoded */
+	data_size = generate_begin((uint8_t*)data, 1024, 1);
+	result = fastcgi_read(ctx, data, data_size);
+	TEST_ASSERT_EQUAL(result, data_size);
+	content[0] = (char)0x80;
+	content[1] = 0;
+	content[2] = 0x10;
+	content[3] = 0;
+	content[4] = 1;
+	data_size = generate_param((uint8_t*)data, 1024, 1, content, 16);
+	result = fastcgi_read(ctx, data, data_size);
+	TEST_ASSERT_EQUAL(result, data_size);
+	result = fastcgi_request_state(ctx, 1);
+	TEST_ASSERT_EQUAL(result, E_REQUEST_NOT_FOUND);
+	data_size = fastcgi_write_control(ctx, data, 1024);
+	TEST_ASSERT_EQUAL(data_size, 16);
+	parse_record(data, data_size, &rec);
+	TEST_ASSERT_EQUAL(rec.header.request_id, 1);
+	TEST_ASSERT_EQUAL((uint8_t)rec.content[4], FCGI_OVERLOADED);
+	memset(content, 'x', sizeof(content));
+
+	/* The context quota ends the request going over it, not the others */
+	data_size = generate_begin((uint8_t*)data, 1024, 2);
+	result = fastcgi_read(ctx, data, data_size);
+	TEST_ASSERT_EQUAL(result, data_size);
+	data_size = generate_begin((uint8_t*)data, 1024, 3);
+	result = fastcgi_read(ctx, data, data_size);
+	TEST_ASSERT_EQUAL(result, data_size);
+	data_size = generate_stdin((uint8_t*)data, 1024, 2, content, 200);
+	result = fastcgi_read(ctx, data, data_size);
+	TEST_ASSERT_EQUAL(result, data_size);
+	TEST_ASSERT_EQUAL(ctx->buffered, 200);
+	data_size = generate_stdin((uint8_t*)data, 1024, 3, content, 200);
+	result = fastcgi_read(ctx, data, data_size);
+	TEST_ASSERT_EQUAL(result, data_size);
+	result = fastcgi_request_state(ctx, 3);
+	TEST_ASSERT_EQUAL(result, E_REQUEST_NOT_FOUND);
+	result = fastcgi_request_state(ctx, 2);
+	TEST_ASSERT_EQUAL(result, (FASTCGI_RS_NEW | FASTCGI_RS_STDIN));
+	TEST_ASSERT_EQUAL(fastcgi_control_pending(ctx), 16);
+	fastcgi_write_control(ctx, data, 1024);
+
+	/* Written output is given back to the quota */
+	result = fastcgi_write_output(ctx, 2, content, 100);
+	TEST_ASSERT_EQUAL(result, 100);
+	TEST_ASSERT_EQUAL(ctx->buffered, 300);
+	result = fastcgi_write(ctx, data, 1024, 2);
+	TEST_ASSERT_GT(result, 100);
+	TEST_ASSERT_EQUAL(ctx->buffered, 200);
+	result = fastcgi_write_output(ctx, 2, content, 100);
+	TEST_ASSERT_EQUAL(result, 100);
+
+	/* Recycling the request gives back the rest */
+	result = fastcgi_finish(ctx, 2);
+	TEST_ASSERT_EQUAL(result, E_SUCCESS);
+	do {
+		result = fastcgi_write(ctx, data, 1024, 2);
+	} while (result > 0);
+	TEST_ASSERT_EQUAL(fastcgi_request_state(ctx, 2), E_REQUEST_NOT_FOUND);
+	TEST_ASSERT_EQUAL(ctx->buffered, 0);
+
+	fastcgi_destroy(ctx);
+}
+
+/* Feed a request and a partial record to the context */
+int32_t feed_connection(fastcgi_context_t *ctx)
+{
+	int32_t result = E_SUCCESS;
+	int32_t data_size = 0;
+	int32_t params_size = 0;
+	char data[1024];
+	char params[1024];
+
+	data_size = generate_begin((uint8_t*)data, 1024, 1);
+	params_size = add_param(params, 1024, "hello", "world");
+	data_size += generate_param((uint8_t*)data + data_size, 1024 - data_size
+		, 1, params, params_size);
+	data_size += generate_stdin((uint8_t*)data + data_size, 1024 - data_size
+		, 1, params, 500);
+	result = fastcgi_read(ctx, data, data_size - 100);
+	return result;
+}
+
+void klunk_context_reset_test()
+{
+	int32_t result = E_SUCCESS;
+	int32_t live = 0;
+	int32_t live_used = 0;
+	fastcgi_allocator_t alloc = {
+		.malloc = counting_malloc,
+		.realloc = counting_realloc,
+		.free = counting_free,
+		.user = &live
+	};
+	fastcgi_context_pool_t *pool = 0;
+	fastcgi_context_t *ctx = 0;
+	fastcgi_context_t *reused = 0;
+
+	result = fastcgi_context_reset(0);
+	TEST_ASSERT_EQUAL(result, E_INVALID_OBJECT);
+
+	pool = fastcgi_context_pool_create_with_allocator(1, &alloc);
+	TEST_ASSERT_NOT_EQUAL(pool, 0);
+	if (pool == 0) {
+		return;
+	}
+	ctx = fastcgi_context_acquire(pool);
+	TEST_ASSERT_NOT_EQUAL(ctx, 0);
+	if (ctx == 0) {
+		fastcgi_context_pool_destroy(pool);
+		return;
+	}
+	result = feed_connection(ctx);
+	TEST_ASSERT_GT(result, 0);
+	TEST_ASSERT_EQUAL(fastcgi_request_state(ctx, 1)
+		, (FASTCGI_RS_NEW | FASTCGI_RS_PARAMS));
+	TEST_ASSERT_EQUAL(ctx->read_state, 1);
+	live_used = live;
+
+	/* A released context comes back pristine */
+	fastcgi_context_release(pool, ctx);
+	TEST_ASSERT_EQUAL(pool->free_count, 1);
+	reused = fastcgi_context_acquire(pool);
+	TEST_ASSERT_EQUAL(reused, ctx);
+	TEST_ASSERT_EQUAL(fastcgi_request_state(ctx, 1), E_REQUEST_NOT_FOUND);
+	TEST_ASSERT_EQUAL(ctx->read_state, 0);
+	TEST_ASSERT_EQUAL(ctx->request_count, 0);
+	TEST_ASSERT_EQUAL(ctx->buffered, 0);
+	TEST_ASSERT_EQUAL(buffer_used(&ctx->input), 0);
+	TEST_ASSERT_EQUAL(fastcgi_current_request_id(ctx), 0);
+
+	/* Serving the same traffic again needs no more memory */
+	result = feed_connection(ctx);
+	TEST_ASSERT_GT(result, 0);
+	TEST_ASSERT_EQUAL(fastcgi_request_state(ctx, 1)
+		, (FASTCGI_RS_NEW | FASTCGI_RS_PARAMS));
+	TEST_ASSERT_EQUAL(live, live_used);
+
+	/* Contexts beyond the pool size are destroyed on release */
+	reused = fastcgi_context_acquire(pool);
+	TEST_ASSERT_NOT_EQUAL(reused, 0);
+	TEST_ASSERT_NOT_EQUAL(reused, ctx);
+	fastcgi_context_release(pool, ctx);
+	fastcgi_context_release(pool, reused);
+	TEST_ASSERT_EQUAL(pool->free_count, 1);
+
+	fastcgi_context_pool_destroy(pool);
+	TEST_ASSERT_EQUAL(live, 0);
+}
+
+/* Start counting the cache misses of this thread, -1 if unavailable */
+int32_t start_cache_miss_counter()
+{
+	int32_t counter = -1;
+#ifdef __linux__
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.size = sizeof(attr);
+	attr.config = PERF_COUNT_HW_CACHE_MISSES;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	counter = (int32_t)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+	if (counter >= 0) {
+		ioctl(counter, PERF_EVENT_IOC_RESET, 0);
+		ioctl(counter, PERF_EVENT_IOC_ENABLE, 0);
+	}
+#endif
+	return counter;
+}
+
+/* Stop and close the counter, returns the number of cache misses */
+uint64_t stop_cache_miss_counter(int32_t counter)
+{
+	uint64_t misses = 0;
+#ifdef __linux__
+	ioctl(counter, PERF_EVENT_IOC_DISABLE, 0);
+	if (read(counter, &misses, sizeof(misses)) != sizeof(misses)) {
+		misses = 0;
+	}
+	close(counter);
+#endif
+	return misses;
+}
+
+/* Parse records for many connections, one record per connection in turn so
+ * the parse state of each context is cold when its record arrives. Only
+ * reports the numbers, the wall time is too noisy to assert on.
+ */
+void klunk_context_layout_benchmark()
+{
+	const int32_t connections = 4096;
+	const int32_t rounds = 32;
+	int32_t result = E_SUCCESS;
+	int32_t data_size = 0;
+	int32_t n = 0;
+	int32_t round = 0;
+	int32_t counter = -1;
+	uint64_t misses = 0;
+	struct timespec start;
+	struct timespec stop;
+	double elapsed_ns = 0;
+	double records = (double)connections * rounds;
+	char data[1024];
+	char content[64];
+	fastcgi_context_t **ctx = 0;
+
+	ctx = calloc(connections, sizeof(fastcgi_context_t*));
+	if (ctx == 0) {
+		return;
+	}
+	fastcgi_set_allocator(fastcgi_system_allocator());
+	memset(content, 'x', sizeof(content));
+	data_size = generate_begin((uint8_t*)data, 1024, 1);
+	for (n = 0; n < connections; n++) {
+		ctx[n] = fastcgi_create();
+		TEST_ASSERT_NOT_EQUAL(ctx[n], 0);
+		if (ctx[n] == 0) {
+			break;
+		}
+		fastcgi_read(ctx[n], data, data_size);
+	}
+	if (n == connections) {
+		data_size = generate_stdin((uint8_t*)data, 1024, 1, content
+			, sizeof(content));
+		counter = start_cache_miss_counter();
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (round = 0; round < rounds; round++) {
+			for (n = 0; n < connections; n++) {
+				result = fastcgi_read(ctx[n], data, data_size);
+				if (result != data_size) {
+					TEST_ASSERT_EQUAL(result, data_size);
+					break;
+				}
+			}
+		}
+		clock_gettime(CLOCK_MONOTONIC, &stop);
+		elapsed_ns = (stop.tv_sec - start.tv_sec) * 1e9
+			+ (stop.tv_nsec - start.tv_nsec);
+		if (counter >= 0) {
+			misses = stop_cache_miss_counter(counter);
+		}
+		printf("parse %d connections x %d records: %.1f ns/record"
+			, connections, rounds, elapsed_ns / records);
+		if (counter >= 0) {
+			printf(", %.2f cache misses/record", misses / records);
+		}
+		else {
+			printf(", cache misses not counted, no hardware counters");
+		}
+		printf("\n");
+	}
+	for (n = 0; n < connections; n++) {
+		fastcgi_destroy(ctx[n]);
+	}
+	fastcgi_set_allocator(0);
+	free(ctx);
+}
+
+void klunk_context_spill_test()
+{
+	int32_t result = E_SUCCESS;
+	int32_t data_size = 0;
+	int32_t fd = -1;
+	int32_t n = 0;
+	size_t len = 0;
+	const char *view = 0;
+	char data[1024];
+	size_t buffered = 0;
+	char content[600];
+	char check[1800];
+	struct rlimit limit;
+	struct rlimit no_files;
+	fcgi_record rec;
+	fastcgi_context_t *ctx = 0;
+	fastcgi_request_t *request = 0;
+
+	ctx = fastcgi_create();
+	TEST_ASSERT_NOT_EQUAL(ctx, 0);
+	if (ctx == 0) {
+		return;
+	}
+	result = fastcgi_set_spill_threshold(ctx, 1000);
+	TEST_ASSERT_EQUAL(result, E_SUCCESS);
+	data_size = generate_begin((uint8_t*)data, 1024, 1);
+	result = fastcgi_read(ctx, data, data_size);
+	TEST_ASSERT_EQUAL(result, data_size);
+	request = fastcgi_find_request(ctx, 1);
+	TEST_ASSERT_NOT_EQUAL(request, 0);
+	if (request == 0) {
+		fastcgi_destroy(ctx);
+		return;
+	}
+
+	/* Content stays in memory up to the threshold */
+	for (n = 0; n < 3; n++) {
+		memset(content, 'a' + n, sizeof(content));
+		data_size = generate_stdin((uint8_t*)data, 1024, 1, content
+			, sizeof(content));
+		result = fastcgi_read(ctx, data, data_size);
+		TEST_ASSERT_EQUAL(result, data_size);
+		if (n == 0) {
+			TEST_ASSERT_EQUAL(request->content_spill.fd, -1);
+			TEST_ASSERT_EQUAL(ctx->buffered, 600);
+		}
+	}
+	TEST_ASSERT_GTE(request->content_spill.fd, 0);
+	TEST_ASSERT_EQUAL(buffer_size(request->content), 0);
+	TEST_ASSERT_EQUAL(ctx->buffered, 0);
+	TEST_ASSERT_EQUAL(fastcgi_request_content_length(request), 1800);
+	data_size = generate_stdin((uint8_t*)data, 1024, 1, content, 0);
+	result = fastcgi_read(ctx, data, data_size);
+	TEST_ASSERT_EQUAL(result, data_size);
+	TEST_ASSERT_EQUAL(fastcgi_request_state(ctx, 1)
+		, (FASTCGI_RS_NEW | FASTCGI_RS_STDIN | FASTCGI_RS_STDIN_DONE));
+
+	/* The whole body is available as a view and through the descriptor */
+	result = fastcgi_request_content_view(request, &view, &len);
+	TEST_ASSERT_EQUAL(result, E_SUCCESS);
+	TEST_ASSERT_EQUAL(len, 1800);
+	TEST_ASSERT_NOT_EQUAL(view, 0);
+	if (view != 0 && len == 1800) {
+		TEST_ASSERT_EQUAL(view[0], 'a');
+		TEST_ASSERT_EQUAL(view[600], 'b');
+		TEST_ASSERT_EQUAL(view[1799], 'c');
+	}
+	fd = fastcgi_request_content_fd(request);
+	TEST_ASSERT_EQUAL(fd, request->content_spill.fd);
+	result = (int32_t)pread(fd, check, sizeof(check), 0);
+	TEST_ASSERT_EQUAL(result, 1800);
+	TEST_ASSERT_EQUAL(memcmp(check + 1200, view + 1200, 600), 0);
+
+	/* Recycling the request closes the file */
+	fastcgi_finish(ctx, 1);
+	do {
+		result = fastcgi_write(ctx, data, 1024, 1);
+	} while (result > 0);
+	TEST_ASSERT_EQUAL(request->content_spill.fd, -1);
+	TEST_ASSERT_EQUAL(request->content_spill.map, 0);
+	TEST_ASSERT_EQUAL(fastcgi_request_content_length(request), 0);
+
+	/* Small content is spilled on demand for the descriptor */
+	data_size = generate_begin((uint8_t*)data, 1024, 2);
+	result = fastcgi_read(ctx, data, data_size);
+	TEST_ASSERT_EQUAL(result, data_size);
+	request = fastcgi_find_request(ctx, 2);
+	data_size = generate_stdin((uint8_t*)data, 1024, 2, content, 10);
+	result = fastcgi_read(ctx, data, data_size);
+	TEST_ASSERT_EQUAL(result, data_size);
+	result = fastcgi_request_content_view(request, &view, &len);
+	TEST_ASSERT_EQUAL(result, E_SUCCESS);
+	TEST_ASSERT_EQUAL(len, 10);
+	TEST_ASSERT_EQUAL(view, buffer_peek(request->content));
+	buffered = ctx->buffered;
+	fd = fastcgi_request_content_fd(request);
+	TEST_ASSERT_GTE(fd, 0);
+	TEST_ASSERT_EQUAL(fastcgi_request_content_length(request), 10);
+	/* The spilled content is no longer charged */
+	TEST_ASSERT_EQUAL(ctx->buffered, buffered - 10);
+	TEST_ASSERT_EQUAL(request->buffered, 0);
+	result = (int32_t)pread(fd, check, sizeof(check), 0);
+	TEST_ASSERT_EQUAL(result, 10);
+
+	/* Content that cannot be spilled ends the request as overloaded and
+	 * leaves the quota as it was */
+	data_size = generate_begin((uint8_t*)data, 1024, 3);
+	result = fastcgi_read(ctx, data, data_size);
+	TEST_ASSERT_EQUAL(result, data_size);
+	buffered = ctx->buffered;
+	data_size = generate_stdin((uint8_t*)data, 1024, 3, content
+		, sizeof(content));
+	result = fastcgi_read(ctx, data, data_size);
+	TEST_ASSERT_EQUAL(result, data_size);
+	TEST_ASSERT_EQUAL(ctx->buffered, buffered + 600);
+	getrlimit(RLIMIT_NOFILE, &limit);
+	no_files = limit;
+	no_files.rlim_cur = 0;
+	setrlimit(RLIMIT_NOFILE, &no_files);
+	result = fastcgi_read(ctx, data, data_size);
+	setrlimit(RLIMIT_NOFILE, &limit);
+	TEST_ASSERT_EQUAL(result, data_size);
+	result = fastcgi_request_state(ctx, 3);
+	TEST_ASSERT_EQUAL(result, E_REQUEST_NOT_FOUND);
+	TEST_ASSERT_EQUAL(ctx->buffered, buffered);
+	data_size = fastcgi_write_control(ctx, data, 1024);
+	TEST_ASSERT_EQUAL(data_size, 16);
+	parse_record(data, data_size, &rec);
+	TEST_ASSERT_EQUAL(rec.header.request_id, 3);
+	TEST_ASSERT_EQUAL((uint8_t)rec.content[4], FCGI_OVERLOADED);
+
+	fastcgi_destroy(ctx);
+}
+
+void klunk_context_values_test()
+{
+	int32_t result = E_SUCCESS;
+	int32_t data_size = 0;
+	int32_t query_size = 0;
+	char data[1024];
+	char query[1024];
+	fcgi_record rec;
+	fastcgi_values_t values = {
+		.max_conns = 10,
+		.max_reqs = 250,
+		.mpxs_conns = 1
+	};
+	fastcgi_context_t *ctx = 0;
+
+	ctx = fastcgi_create();
+	TEST_ASSERT_NOT_EQUAL(ctx, 0);
+	if (ctx == 0) {
+		return;
+	}
+	result = fastcgi_set_values(ctx, 0);
+	TEST_ASSERT_EQUAL(result, E_INVALID_ARGUMENT);
+	result = fastcgi_set_values(ctx, &values);
+	TEST_ASSERT_EQUAL(result, E_SUCCESS);
+
+	/* A free request must not take the management record */
+	data_size = generate_begin((uint8_t*)data, 1024, 1);
+	fastcgi_read(ctx, data, data_size);
+	fastcgi_finish(ctx, 1);
+	do {
+		result = fastcgi_write(ctx, data, 1024, 1);
+	} while (result > 0);
+
+	/* Only the queried names known to us are answered */
+	query_size = add_param(query, 1024, FCGI_MPXS_CONNS, "");
+	query_size += add_param(query + query_size, 1024 - query_size
+		, "FCGI_UNKNOWN", "");
+	query_size += add_param(query + query_size, 1024 - query_size
+		, FCGI_MAX_REQS, "");
+	data_size = generate_param((uint8_t*)data, 1024, 0, query, query_size);
+	data[1] = FCGI_GET_VALUES;
+	result = fastcgi_read(ctx, data, data_size);
+	TEST_ASSERT_EQUAL(result, data_size);
+	data_size = fastcgi_write_control(ctx, data, 1024);
+	TEST_ASSERT_GT(data_size, 0);
+	TEST_ASSERT_EQUAL(data_size % 8, 0);
+	result = parse_record(data, data_size, &rec);
+	TEST_ASSERT_EQUAL(result, data_size);
+	TEST_ASSERT_EQUAL(rec.header.type, FCGI_GET_VALUES_RESULT);
+	TEST_ASSERT_EQUAL(rec.header.request_id, 0);
+	query_size = add_param(query, 1024, FCGI_MPXS_CONNS, "1");
+	query_size += add_param(query + query_size, 1024 - query_size
+		, FCGI_MAX_REQS, "250");
+	TEST_ASSERT_EQUAL(rec.header.content_len, query_size);
+	TEST_ASSERT_EQUAL(memcmp(rec.content, query, query_size), 0);
+
+	/* Other management records are answered with FCGI_UNKNOWN_TYPE */
+	data_size = generate_record_header((uint8_t*)data, 1024, 12, 0, 0, 0);
+	result = fastcgi_read(ctx, data, data_size);
+	TEST_ASSERT_EQUAL(result, data_size);
+	data_size = fastcgi_write_control(ctx, data, 1024);
+	TEST_ASSERT_EQUAL(data_size, 16);
+	parse_record(data, data_size, &rec);
+	TEST_ASSERT_EQUAL(rec.header.type, FCGI_UNKNOWN_TYPE);
+	TEST_ASSERT_EQUAL((uint8_t)rec.content[0], 12);
+
+	fastcgi_destroy(ctx);
+}
+
+/* Abort handler recording the state of the aborted request */
+void record_abort(fastcgi_context_t *ctx, fastcgi_request_t *request
+	, void *user_data)
+{
+	(void)ctx;
+	*(int32_t*)user_data = request->state;
+}
+
+void klunk_context_abort_test()
+{
+	int32_t result = E_SUCCESS;
+	int32_t data_size = 0;
+	int32_t aborted = 0;
+	char data[1024];
+	char content[200];
+	fcgi_record rec;
+	fastcgi_context_t *ctx = 0;
+
+	ctx = fastcgi_create();
+	TEST_ASSERT_NOT_EQUAL(ctx, 0);
+	if (ctx == 0) {
+		return;
+	}
+	result = fastcgi_set_abort_handler(ctx, record_abort, &aborted);
+	TEST_ASSERT_EQUAL(result, E_SUCCESS);
+	memset(content, 'x', sizeof(content));
+	data_size = generate_begin((uint8_t*)data, 1024, 1);
+	data_size += generate_stdin((uint8_t*)data + data_size, 1024 - data_size
+		, 1, content, sizeof(content));
+	result = fastcgi_read(ctx, data, data_size);
+	TEST_ASSERT_EQUAL(result, data_size);
+	result = fastcgi_write_output(ctx, 1, content, 100);
+	TEST_ASSERT_EQUAL(result, 100);
+	TEST_ASSERT_EQUAL(ctx->buffered, 300);
+
+	/* The abort reaches the handler and ends the request at once */
+	data_size = generate_record_header((uint8_t*)data, 1024
+		, FCGI_ABORT_REQUEST, 1, 0, 0);
+	result = fastcgi_read(ctx, data, data_size);
+	TEST_ASSERT_EQUAL(result, data_size);
+	TEST_ASSERT_EQUAL(aborted
+		, (FASTCGI_RS_NEW | FASTCGI_RS_STDIN | FASTCGI_RS_ABORT));
+	TEST_ASSERT_EQUAL(fastcgi_request_state(ctx, 1), E_REQUEST_NOT_FOUND);
+	TEST_ASSERT_EQUAL(ctx->request_count, 0);
+	TEST_ASSERT_EQUAL(ctx->buffered, 0);
+	data_size = fastcgi_write_control(ctx, data, 1024);
+	TEST_ASSERT_EQUAL(data_size, 16);
+	parse_record(data, data_size, &rec);
+	TEST_ASSERT_EQUAL(rec.header.type, FCGI_END_REQUEST);
+	TEST_ASSERT_EQUAL(rec.header.request_id, 1);
+	TEST_ASSERT_EQUAL((uint8_t)rec.content[4], FCGI_REQUEST_COMPLETE);
+
+	/* Input still in flight is not stored and the handler gets an error */
+	data_size = generate_stdin((uint8_t*)data, 1024, 1, content
+		, sizeof(content));
+	result = fastcgi_read(ctx, data, data_size);
+	TEST_ASSERT_EQUAL(result, data_size);
+	TEST_ASSERT_EQUAL(ctx->buffered, 0);
+	result = fastcgi_write_output(ctx, 1, content, 100);
+	TEST_ASSERT_EQUAL(result, E_REQUEST_NOT_FOUND);
+	TEST_ASSERT_EQUAL(fastcgi_control_pending(ctx), 0);
+
+	/* The handler belongs to the connection and is gone after a reset */
+	result = fastcgi_context_reset(ctx);
+	TEST_ASSERT_EQUAL(result, E_SUCCESS);
+	aborted = 0;
+	data_size = generate_begin((uint8_t*)data, 1024, 1);
+	data_size += generate_record_header((uint8_t*)data + data_size
+		, 1024 - data_size, FCGI_ABORT_REQUEST, 1, 0, 0);
+	result = fastcgi_read(ctx, data, data_size);
+	TEST_ASSERT_EQUAL(result, data_size);
+	TEST_ASSERT_EQUAL(aborted, 0);
+	TEST_ASSERT_EQUAL(fastcgi_request_state(ctx, 1), E_REQUEST_NOT_FOUND);
+
+	fastcgi_destroy(ctx);
+}
+
+void klunk_context_keep_conn_test()
+{
+	int32_t result = E_SUCCESS;
+	int32_t data_size = 0;
+	char data[1024];
+	fastcgi_context_t *ctx = 0;
+
+	ctx = fastcgi_create();
+	TEST_ASSERT_NOT_EQUAL(ctx, 0);
+	if (ctx == 0) {
+		return;
+	}
+	TEST_ASSERT_EQUAL(fastcgi_should_close(0), E_INVALID_OBJECT);
+	TEST_ASSERT_EQUAL(fastcgi_should_close(ctx), 0);
+	TEST_ASSERT_EQUAL(fastcgi_idle_timeout(ctx), 0x7fffffff);
+
+	/* Requests with FCGI_KEEP_CONN leave the connection open */
+	data_size = generate_begin((uint8_t*)data, 1024, 1);
+	data[8 + 2] = FCGI_KEEP_CONN;
+	data_size += generate_begin((uint8_t*)data + data_size, 1024 - data_size
+		, 2);
+	result = fastcgi_read(ctx, data, data_size);
+	TEST_ASSERT_EQUAL(result, data_size);
+	fastcgi_finish(ctx, 1);
+	do {
+		result = fastcgi_write(ctx, data, 1024, 1);
+	} while (result > 0);
+	TEST_ASSERT_EQUAL(fastcgi_should_close(ctx), 0);
+
+	/* The connection closes once the last live request has ended */
+	fastcgi_finish(ctx, 2);
+	TEST_ASSERT_EQUAL(fastcgi_should_close(ctx), 0);
+	do {
+		result = fastcgi_write(ctx, data, 1024, 2);
+	} while (result > 0);
+	TEST_ASSERT_EQUAL(fastcgi_should_close(ctx), 1);
+	fastcgi_context_reset(ctx);
+	TEST_ASSERT_EQUAL(fastcgi_should_close(ctx), 0);
+
+	/* Idle connections are reaped, live requests keep them open */
+	result = fastcgi_set_idle_timeout(ctx, 2000);
+	TEST_ASSERT_EQUAL(result, E_SUCCESS);
+	result = fastcgi_idle_timeout(ctx);
+	TEST_ASSERT_GT(result, 0);
+	TEST_ASSERT_LTE(result, 2000);
+	data_size = generate_begin((uint8_t*)data, 1024, 3);
+	data[8 + 2] = FCGI_KEEP_CONN;
+	result = fastcgi_read(ctx, data, data_size);
+	TEST_ASSERT_EQUAL(result, data_size);
+	usleep(3000);
+	TEST_ASSERT_EQUAL(fastcgi_idle_timeout(ctx), 0x7fffffff);
+	TEST_ASSERT_EQUAL(fastcgi_should_close(ctx), 0);
+	fastcgi_finish(ctx, 3);
+	do {
+		result = fastcgi_write(ctx, data, 1024, 3);
+	} while (result > 0);
+	TEST_ASSERT_EQUAL(fastcgi_should_close(ctx), 0);
+	usleep(3000);
+	TEST_ASSERT_EQUAL(fastcgi_idle_timeout(ctx), 0);
+	TEST_ASSERT_EQUAL(fastcgi_should_close(ctx), 1);
+
+	/* An idle connection stays open until its control records are out */
+	data_size = generate_record_header((uint8_t*)data, 1024, 12, 0, 0, 0);
+	result = fastcgi_read(ctx, data, data_size);
+	TEST_ASSERT_EQUAL(result, data_size);
+	usleep(3000);
+	TEST_ASSERT_EQUAL(fastcgi_idle_timeout(ctx), 0);
+	TEST_ASSERT_EQUAL(fastcgi_should_close(ctx), 0);
+	data_size = fastcgi_write_control(ctx, data, 1024);
+	TEST_ASSERT_EQUAL(data_size, 16);
+	TEST_ASSERT_EQUAL(fastcgi_should_close(ctx), 1);
+
+	fastcgi_destroy(ctx);
+}
+
+void klunk_context_connection_test()
+{
+	int32_t result = E_SUCCESS;
+	int32_t data_size = 0;
+	int32_t n = 0;
+	int32_t offset = 0;
+	char data[1024];
+	struct iovec iov[4];
+	fcgi_record rec;
+	fastcgi_limits_t limits;
+	fastcgi_manager_t *manager = 0;
+	fastcgi_connection_t *conn[3] = {0, 0, 0};
+
+	manager = fastcgi_manager_create(2, 2);
+	TEST_ASSERT_NOT_EQUAL(manager, 0);
+	if (manager == 0) {
+		return;
+	}
+	conn[0] = fastcgi_connection_open(manager);
+	conn[1] = fastcgi_connection_open(manager);
+	conn[2] = fastcgi_connection_open(manager);
+	TEST_ASSERT_NOT_EQUAL(conn[0], 0);
+	TEST_ASSERT_NOT_EQUAL(conn[1], 0);
+	TEST_ASSERT_EQUAL(conn[2], 0);
+	if (conn[0] == 0 || conn[1] == 0) {
+		fastcgi_manager_destroy(manager);
+		return;
+	}
+	TEST_ASSERT_NOT_EQUAL(conn[0]->ctx, conn[1]->ctx);
+	TEST_ASSERT_EQUAL(fastcgi_connection_find(manager, conn[1]->slot)
+		, conn[1]);
+	/* The contexts share the slab pool of the manager */
+	TEST_ASSERT_EQUAL(conn[0]->ctx->pool, manager->slabs);
+	TEST_ASSERT_EQUAL(conn[1]->ctx->pool, manager->slabs);
+	TEST_ASSERT_EQUAL(conn[0]->ctx->owns_pool, 0);
+
+	/* The same request id on two connections are two requests */
+	for (n = 0; n < 2; n++) {
+		data_size = generate_begin((uint8_t*)data, 1024, 1);
+		data_size += generate_stdin((uint8_t*)data + data_size
+			, 1024 - data_size, 1, n == 0 ? "first" : "second!", n == 0 ? 5 : 7);
+		result = fastcgi_connection_read(conn[n], data, data_size);
+		TEST_ASSERT_EQUAL(result, data_size);
+	}
+	for (n = 0; n < 2; n++) {
+		TEST_ASSERT_EQUAL(fastcgi_request_content_length(
+			fastcgi_find_request(conn[n]->ctx, 1)), (size_t)(n == 0 ? 5 : 7));
+		result = fastcgi_write_output(conn[n]->ctx, 1, "ok", 2);
+		TEST_ASSERT_EQUAL(result, 2);
+		fastcgi_finish(conn[n]->ctx, 1);
+		result = fastcgi_connection_queue(conn[n], 1);
+		TEST_ASSERT_GT(result, 0);
+		TEST_ASSERT_EQUAL(fastcgi_connection_pending(conn[n]), result);
+	}
+
+	/* Queued records are sent with writev and consumed */
+	result = fastcgi_connection_iov(conn[0], iov, 4, 1024);
+	TEST_ASSERT_EQUAL(result, 1);
+	parse_record(iov[0].iov_base, iov[0].iov_len, &rec);
+	TEST_ASSERT_EQUAL(rec.header.type, FCGI_STDOUT);
+	TEST_ASSERT_EQUAL(rec.header.request_id, 1);
+	TEST_ASSERT_EQUAL(fastcgi_connection_should_close(conn[0]), 0);
+	result = fastcgi_connection_consume(conn[0], iov[0].iov_len);
+	TEST_ASSERT_EQUAL(result, (int32_t)iov[0].iov_len);
+	TEST_ASSERT_EQUAL(fastcgi_connection_pending(conn[0]), 0);
+	TEST_ASSERT_EQUAL(fastcgi_connection_should_close(conn[0]), 1);
+
+	/* Output larger than a segment is queued as whole records */
+	data_size = generate_begin((uint8_t*)data, 1024, 2);
+	result = fastcgi_connection_read(conn[0], data, data_size);
+	TEST_ASSERT_EQUAL(result, data_size);
+	memset(data, 'x', 1024);
+	for (n = 0; n < 40; n++) {
+		result = fastcgi_write_output(conn[0]->ctx, 2, data, 1024);
+		TEST_ASSERT_EQUAL(result, 1024);
+	}
+	fastcgi_finish(conn[0]->ctx, 2);
+	result = fastcgi_connection_queue(conn[0], 2);
+	TEST_ASSERT_GT(result, 40 * 1024);
+	TEST_ASSERT_EQUAL(fastcgi_connection_pending(conn[0]), result);
+	data_size = 0;
+	while (fastcgi_connection_pending(conn[0]) > 0) {
+		result = fastcgi_connection_iov(conn[0], iov, 1, 0x10000);
+		TEST_ASSERT_EQUAL(result, 1);
+		/* Every segment holds whole records */
+		for (offset = 0; offset < (int32_t)iov[0].iov_len; offset += result) {
+			result = parse_record((char*)iov[0].iov_base + offset
+				, iov[0].iov_len - offset, &rec);
+			TEST_ASSERT_GT(result, 0);
+			if (result <= 0) {
+				break;
+			}
+			TEST_ASSERT_EQUAL(rec.header.request_id, 2);
+			if (rec.header.type == FCGI_STDOUT) {
+				data_size += rec.header.content_len;
+			}
+		}
+		TEST_ASSERT_EQUAL(offset, (int32_t)iov[0].iov_len);
+		fastcgi_connection_consume(conn[0], iov[0].iov_len);
+	}
+	TEST_ASSERT_EQUAL(data_size, 40 * 1024);
+
+	/* Control records go to the queue of their connection */
+	data_size = generate_record_header((uint8_t*)data, 1024, 12, 0, 0, 0);
+	result = fastcgi_connection_read(conn[1], data, data_size);
+	TEST_ASSERT_EQUAL(result, data_size);
+	TEST_ASSERT_EQUAL(fastcgi_control_pending(conn[1]->ctx), 0);
+	TEST_ASSERT_GT(fastcgi_connection_pending(conn[1]), 16);
+	fastcgi_connection_consume(conn[1], fastcgi_connection_pending(conn[1]));
+
+	/* A request ended by the output limit still gets its END_REQUEST */
+	data_size = generate_begin((uint8_t*)data, 1024, 3);
+	result = fastcgi_connection_read(conn[1], data, data_size);
+	TEST_ASSERT_EQUAL(result, data_size);
+	limits = conn[1]->ctx->limits;
+	conn[1]->ctx->limits.max_output = 4;
+	result = fastcgi_write_output(conn[1]->ctx, 3, "too long", 8);
+	TEST_ASSERT_EQUAL(result, E_REQUEST_LIMIT);
+	conn[1]->ctx->limits = limits;
+	result = fastcgi_connection_queue(conn[1], 3);
+	TEST_ASSERT_EQUAL(result, 16);
+	TEST_ASSERT_EQUAL(fastcgi_connection_pending(conn[1]), 16);
+	TEST_ASSERT_EQUAL(fastcgi_control_pending(conn[1]->ctx), 0);
+	result = fastcgi_connection_iov(conn[1], iov, 4, 1024);
+	TEST_ASSERT_EQUAL(result, 1);
+	parse_record(iov[0].iov_base, iov[0].iov_len, &rec);
+	TEST_ASSERT_EQUAL(rec.header.type, FCGI_END_REQUEST);
+	TEST_ASSERT_EQUAL(rec.header.request_id, 3);
+
+	/* A closed slot is reused */
+	n = (int32_t)conn[0]->slot;
+	fastcgi_connection_close(manager, conn[0]);
+	TEST_ASSERT_EQUAL(fastcgi_connection_find(manager, n), 0);
+	TEST_ASSERT_EQUAL(manager->open_count, 1);
+	conn[2] = fastcgi_connection_open(manager);
+	TEST_ASSERT_EQUAL(conn[2], conn[0]);
+	TEST_ASSERT_EQUAL(fastcgi_connection_pending(conn[2]), 0);
+	TEST_ASSERT_EQUAL(fastcgi_request_state(conn[2]->ctx, 1)
+		, E_REQUEST_NOT_FOUND);
+
+	fastcgi_manager_destroy(manager);
+}
+
+/* Drive thousands of concurrent requests over one socket, the records of
+ * the requests are interleaved as a web server multiplexing them would.
+ */
+void klunk_context_multiplex_benchmark()
+{
+#ifdef FASTCGI_STATIC
+	const int32_t ids = FASTCGI_MAX_REQUESTS;
+#else
+	const int32_t ids = 4096;
+#endif
+	const int32_t chunks = 4;
+	int32_t result = E_SUCCESS;
+	int32_t wire_len = 0;
+	int32_t params_size = 0;
+	int32_t id = 0;
+	int32_t chunk = 0;
+	int32_t sent = 0;
+	int32_t received = 0;
+	int32_t records = 0;
+	int32_t sock[2] = {-1, -1};
+	size_t n = 0;
+	size_t len = 0;
+	const char *view = 0;
+	struct timespec start;
+	struct timespec stop;
+	double elapsed_ns = 0;
+	char params[64];
+	char value[8];
+	char content[64];
+	char data[32768];
+	char *wire = 0;
+	fastcgi_context_t *ctx = 0;
+	fastcgi_request_t *request = 0;
+
+	wire = malloc((size_t)ids * 512);
+	ctx = fastcgi_create();
+	result = socketpair(AF_UNIX, SOCK_STREAM, 0, sock);
+	TEST_ASSERT_NOT_EQUAL(wire, 0);
+	TEST_ASSERT_NOT_EQUAL(ctx, 0);
+	TEST_ASSERT_EQUAL(result, 0);
+	if (wire == 0 || ctx == 0 || result != 0) {
+		free(wire);
+		fastcgi_destroy(ctx);
+		return;
+	}
+
+	/* Every request begins, then the streams of all of them take turns */
+	for (id = 1; id <= ids; id++) {
+		wire_len += generate_begin((uint8_t*)wire + wire_len, 16, id);
+	}
+	for (id = 1; id <= ids; id++) {
+		snprintf(value, sizeof(value), "%d", id);
+		params_size = add_param(params, sizeof(params), "REQUEST", value);
+		wire_len += generate_param((uint8_t*)wire + wire_len, 64, id
+			, params, params_size);
+	}
+	for (id = 1; id <= ids; id++) {
+		wire_len += generate_param((uint8_t*)wire + wire_len, 8, id, params, 0);
+	}
+	for (chunk = 0; chunk < chunks; chunk++) {
+		for (id = 1; id <= ids; id++) {
+			memset(content, 'a' + id % 26, sizeof(content));
+			wire_len += generate_stdin((uint8_t*)wire + wire_len, 72, id
+				, content, sizeof(content));
+		}
+	}
+	for (id = 1; id <= ids; id++) {
+		wire_len += generate_stdin((uint8_t*)wire + wire_len, 8, id
+			, content, 0);
+	}
+	records = ids * (chunks + 4);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (sent < wire_len) {
+		result = write(sock[0], wire + sent, wire_len - sent > 32768
+			? 32768 : wire_len - sent);
+		if (result <= 0) {
+			break;
+		}
+		sent += result;
+		while (received < sent) {
+			result = read(sock[1], data, sizeof(data));
+			if (result <= 0 || fastcgi_read(ctx, data, result) != result) {
+				TEST_ASSERT_GT(result, 0);
+				break;
+			}
+			received += result;
+		}
+		if (received < sent) {
+			break;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	TEST_ASSERT_EQUAL(received, wire_len);
+	elapsed_ns = (stop.tv_sec - start.tv_sec) * 1e9
+		+ (stop.tv_nsec - start.tv_nsec);
+	printf("multiplex %d ids x %d records: %.1f ns/record\n", ids
+		, chunks + 4, elapsed_ns / records);
+
+	/* Each request got its own parameters and content */
+	TEST_ASSERT_EQUAL(ctx->request_count, (uint32_t)ids);
+	for (id = 1; id <= ids; id++) {
+		request = fastcgi_find_request(ctx, id);
+		if (request == 0) {
+			TEST_ASSERT_NOT_EQUAL(request, 0);
+			break;
+		}
+		TEST_ASSERT_EQUAL(fastcgi_request_get_state(request
+			, FASTCGI_RS_STDIN_DONE), FASTCGI_RS_STDIN_DONE);
+		TEST_ASSERT_EQUAL(request->param_count, 1);
+		result = fastcgi_request_content_view(request, &view, &len);
+		TEST_ASSERT_EQUAL(len, (size_t)chunks * sizeof(content));
+		for (n = 0; n < len && view[n] == 'a' + id % 26; n++) {
+		}
+		TEST_ASSERT_EQUAL(n, len);
+		result = fastcgi_respond(ctx, id, "Status: 200\r\n\r\n", 15
+			, "ok", 2, 0, data, sizeof(data));
+		TEST_ASSERT_GT(result, 0);
+	}
+	TEST_ASSERT_EQUAL(ctx->request_count, 0);
+	TEST_ASSERT_EQUAL(ctx->free_count, FASTCGI_FREE_REQUESTS);
+
+	/* The highest id has a slot too */
+	result = generate_begin((uint8_t*)data, 16, 0xffff);
+	TEST_ASSERT_EQUAL(fastcgi_read(ctx, data, result), result);
+	request = fastcgi_find_request(ctx, 0xffff);
+	TEST_ASSERT_NOT_EQUAL(request, 0);
+	TEST_ASSERT_EQUAL(fastcgi_find_request(ctx, 0xfffe), 0);
+	TEST_ASSERT_EQUAL(ctx->free_count, FASTCGI_FREE_REQUESTS - 1);
+
+	close(sock[0]);
+	close(sock[1]);
+	fastcgi_destroy(ctx);
+	free(wire);
+}
+
+void klunk_context_filter_test()
+{
+	int32_t result = E_SUCCESS;
+	int32_t data_size = 0;
+	int32_t n = 0;
+	size_t len = 0;
+	const char *view = 0;
+	char data[1024];
+	char content[600];
+	fastcgi_context_t *ctx = 0;
+	fastcgi_request_t *request = 0;
+
+	ctx = fastcgi_create();
+	TEST_ASSERT_NOT_EQUAL(ctx, 0);
+	if (ctx == 0) {
+		return;
+	}
+	fastcgi_set_spill_threshold(ctx, 1000);
+
+	/* A filter request gets STDIN and the file as FCGI_DATA */
+	data_size = generate_begin((uint8_t*)data, 1024, 1);
+	data[8+1] = FCGI_FILTER;
+	data_size += generate_param((uint8_t*)data + data_size, 1024 - data_size
+		, 1, content, 0);
+	data_size += generate_stdin((uint8_t*)data + data_size, 1024 - data_size
+		, 1, "in", 2);
+	data_size += generate_stdin((uint8_t*)data + data_size, 1024 - data_size
+		, 1, content, 0);
+	result = fastcgi_read(ctx, data, data_size);
+	TEST_ASSERT_EQUAL(result, data_size);
+	request = fastcgi_find_request(ctx, 1);
+	TEST_ASSERT_NOT_EQUAL(request, 0);
+	if (request == 0) {
+		fastcgi_destroy(ctx);
+		return;
+	}
+	TEST_ASSERT_EQUAL(request->role, FCGI_FILTER);
+	for (n = 0; n < 3; n++) {
+		memset(content, 'a' + n, sizeof(content));
+		data_size = generate_stdin((uint8_t*)data, 1024, 1, content
+			, sizeof(content));
+		data[1] = FCGI_DATA;
+		result = fastcgi_read(ctx, data, data_size);
+		TEST_ASSERT_EQUAL(result, data_size);
+		if (n == 0) {
+			TEST_ASSERT_EQUAL(fastcgi_request_get_state(request
+				, FASTCGI_RS_DATA | FASTCGI_RS_DATA_DONE), FASTCGI_RS_DATA);
+			TEST_ASSERT_EQUAL(ctx->buffered, 602);
+		}
+	}
+
+	/* Large data is spilled like content, the content stays in memory */
+	TEST_ASSERT_GTE(request->data_spill.fd, 0);
+	TEST_ASSERT_EQUAL(request->content_spill.fd, -1);
+	TEST_ASSERT_EQUAL(ctx->buffered, 2);
+	TEST_ASSERT_EQUAL(fastcgi_request_data_length(request), 1800);
+	data_size = generate_stdin((uint8_t*)data, 1024, 1, content, 0);
+	data[1] = FCGI_DATA;
+	result = fastcgi_read(ctx, data, data_size);
+	TEST_ASSERT_EQUAL(result, data_size);
+	TEST_ASSERT_EQUAL(fastcgi_request_get_state(request
+		, FASTCGI_RS_STDIN_DONE | FASTCGI_RS_DATA_DONE)
+		, (FASTCGI_RS_STDIN_DONE | FASTCGI_RS_DATA_DONE));
+	result = fastcgi_request_data_view(request, &view, &len);
+	TEST_ASSERT_EQUAL(result, E_SUCCESS);
+	TEST_ASSERT_EQUAL(len, 1800);
+	if (view != 0 && len == 1800) {
+		TEST_ASSERT_EQUAL(view[0], 'a');
+		TEST_ASSERT_EQUAL(view[1799], 'c');
+	}
+	result = fastcgi_request_content_view(request, &view, &len);
+	TEST_ASSERT_EQUAL(len, 2);
+	TEST_ASSERT_EQUAL(memcmp(view, "in", 2), 0);
+	TEST_ASSERT_EQUAL(fastcgi_request_data_fd(request)
+		, request->data_spill.fd);
+
+	/* Recycling the request closes the data file */
+	fastcgi_finish(ctx, 1);
+	do {
+		result = fastcgi_write(ctx, data, 1024, 1);
+	} while (result > 0);
+	TEST_ASSERT_EQUAL(request->data_spill.fd, -1);
+	TEST_ASSERT_EQUAL(fastcgi_request_data_length(request), 0);
+
+	/* FCGI_DATA of a responder is ignored */
+	data_size = generate_begin((uint8_t*)data, 1024, 2);
+	data_size += generate_stdin((uint8_t*)data + data_size, 1024 - data_size
+		, 2, content, 100);
+	data[16+1] = FCGI_DATA;
+	result = fastcgi_read(ctx, data, data_size);
+	TEST_ASSERT_EQUAL(result, data_size);
+	TEST_ASSERT_EQUAL(fastcgi_request_state(ctx, 2), FASTCGI_RS_NEW);
+	TEST_ASSERT_EQUAL(ctx->buffered, 0);
+
+	fastcgi_destroy(ctx);
+}
+
+void klunk_context_early_response_test()
+{
+	int32_t result = E_SUCCESS;
+	int32_t data_size = 0;
+	int32_t params_size = 0;
+	size_t buffered = 0;
+	char data[1024];
+	char params[1024];
+	char content[500];
+	char output[256];
+	fastcgi_context_t *ctx = 0;
+	fastcgi_request_t *request = 0;
+
+	ctx = fastcgi_create();
+	TEST_ASSERT_NOT_EQUAL(ctx, 0);
+	if (ctx == 0) {
+		return;
+	}
+	memset(content, 'x', sizeof(content));
+
+	/* The handler starts at PARAMS_DONE and skips the body */
+	data_size = generate_begin((uint8_t*)data, 1024, 1);
+	params_size = add_param(params, 1024, "hello", "world");
+	data_size += generate_param((uint8_t*)data + data_size, 1024 - data_size
+		, 1, params, params_size);
+	data_size += generate_param((uint8_t*)data + data_size, 1024 - data_size
+		, 1, params, 0);
+	result = fastcgi_read(ctx, data, data_size);
+	TEST_ASSERT_EQUAL(result, data_size);
+	TEST_ASSERT_EQUAL(fastcgi_request_state(ctx, 1)
+		, (FASTCGI_RS_NEW | FASTCGI_RS_PARAMS | FASTCGI_RS_PARAMS_DONE));
+	request = fastcgi_find_request(ctx, 1);
+	buffered = ctx->buffered;
+	data_size = generate_stdin((uint8_t*)data, 1024, 1, content
+		, sizeof(content));
+	result = fastcgi_read(ctx, data, data_size);
+	TEST_ASSERT_EQUAL(result, data_size);
+	TEST_ASSERT_EQUAL(ctx->buffered, buffered + sizeof(content));
+	result = fastcgi_discard_input(ctx, 1);
+	TEST_ASSERT_EQUAL(result, E_SUCCESS);
+	TEST_ASSERT_EQUAL(ctx->buffered, buffered);
+	TEST_ASSERT_EQUAL(fastcgi_request_content_length(request), 0);
+
+	/* The rest of the body is not copied anywhere */
+	result = fastcgi_read(ctx, data, 108);
+	TEST_ASSERT_EQUAL(result, 108);
+	TEST_ASSERT_EQUAL(buffer_used(&ctx->input), 0);
+	data_size += generate_stdin((uint8_t*)data + data_size, 1024 - data_size
+		, 1, content, 0);
+	result = fastcgi_read(ctx, data + 108, data_size - 108);
+	TEST_ASSERT_EQUAL(result, data_size - 108);
+	TEST_ASSERT_EQUAL(fastcgi_request_content_length(request), 0);
+	TEST_ASSERT_EQUAL(ctx->buffered, buffered);
+	TEST_ASSERT_EQUAL(fastcgi_request_get_state(request
+		, FASTCGI_RS_STDIN_DONE | FASTCGI_RS_DISCARD)
+		, (FASTCGI_RS_STDIN_DONE | FASTCGI_RS_DISCARD));
+	result = fastcgi_respond(ctx, 1, "Status: 204\r\n\r\n", 15, 0, 0, 0
+		, output, sizeof(output));
+	TEST_ASSERT_GT(result, 0);
+
+	/* A response sent before the body has arrived ends the request */
+	data_size = generate_begin((uint8_t*)data, 1024, 2);
+	data_size += generate_param((uint8_t*)data + data_size, 1024 - data_size
+		, 2, params, 0);
+	data_size += generate_stdin((uint8_t*)data + data_size, 1024 - data_size
+		, 2, content, sizeof(content));
+	result = fastcgi_read(ctx, data, 100);
+	TEST_ASSERT_EQUAL(result, 100);
+	result = fastcgi_respond(ctx, 2, "Status: 413\r\n\r\n", 15, 0, 0, 0
+		, output, sizeof(output));
+	TEST_ASSERT_GT(result, 0);
+	TEST_ASSERT_EQUAL(ctx->buffered, 0);
+	data_size += generate_stdin((uint8_t*)data + data_size, 1024 - data_size
+		, 2, content, 0);
+	result = fastcgi_read(ctx, data + 100, data_size - 100);
+	TEST_ASSERT_EQUAL(result, data_size - 100);
+	TEST_ASSERT_EQUAL(buffer_used(&ctx->input), 0);
+	TEST_ASSERT_EQUAL(ctx->read_state, 0);
+	TEST_ASSERT_EQUAL(fastcgi_request_state(ctx, 2), E_REQUEST_NOT_FOUND);
+
+	fastcgi_destroy(ctx);
+}
+
+void klunk_context_flow_test()
+{
+	int32_t result = E_SUCCESS;
+	int32_t data_size = 0;
+	int32_t n = 0;
+	char data[4096];
+	char content[600];
+	char output[256];
+	fastcgi_flow_policy_t policy = {
+		.max_requests = 2,
+		.max_buffered = 1000
+	};
+	fastcgi_context_t *ctx = 0;
+
+	ctx = fastcgi_create();
+	TEST_ASSERT_NOT_EQUAL(ctx, 0);
+	if (ctx == 0) {
+		return;
+	}
+	result = fastcgi_set_flow_policy(ctx, &policy);
+	TEST_ASSERT_EQUAL(result, E_SUCCESS);
+	memset(content, 'x', sizeof(content));
+
+	/* The third request waits for one of the first two to end */
+	data_size = generate_begin((uint8_t*)data, 4096, 1);
+	data_size += generate_begin((uint8_t*)data + data_size, 4096 - data_size, 2);
+	data_size += generate_begin((uint8_t*)data + data_size, 4096 - data_size, 3);
+	result = fastcgi_read(ctx, data, data_size);
+	TEST_ASSERT_EQUAL(result, 32);
+	TEST_ASSERT_EQUAL(fastcgi_paused(ctx), 1);
+	TEST_ASSERT_EQUAL(fastcgi_request_state(ctx, 3), E_REQUEST_NOT_FOUND);
+	result = fastcgi_respond(ctx, 1, "Status: 200\r\n\r\n", 15, 0, 0, 0
+		, output, sizeof(output));
+	TEST_ASSERT_GT(result, 0);
+	TEST_ASSERT_EQUAL(fastcgi_paused(ctx), 0);
+	result = fastcgi_read(ctx, data + 32, data_size - 32);
+	TEST_ASSERT_EQUAL(result, 16);
+	TEST_ASSERT_EQUAL(fastcgi_request_state(ctx, 3), FASTCGI_RS_NEW);
+
+	/* Input stops once the buffered bytes reach the bound */
+	data_size = 0;
+	for (n = 0; n < 3; n++) {
+		data_size += generate_stdin((uint8_t*)data + data_size
+			, 4096 - data_size, n == 0 ? 3 : 2, content, sizeof(content));
+	}
+	data_size += generate_record_header((uint8_t*)data + data_size
+		, 4096 - data_size, FCGI_ABORT_REQUEST, 3, 0, 0);
+	result = fastcgi_read(ctx, data, data_size);
+	TEST_ASSERT_EQUAL(result, 2 * 608);
+	TEST_ASSERT_EQUAL(ctx->buffered, 1200);
+	TEST_ASSERT_EQUAL(fastcgi_paused(ctx), 1);
+
+	/* Discarding drains the input, records ending work always pass */
+	result = fastcgi_discard_input(ctx, 2);
+	TEST_ASSERT_EQUAL(fastcgi_paused(ctx), 0);
+	result = fastcgi_read(ctx, data + 2 * 608, data_size - 2 * 608);
+	TEST_ASSERT_EQUAL(result, data_size - 2 * 608);
+	TEST_ASSERT_EQUAL(ctx->buffered, 0);
+	TEST_ASSERT_EQUAL(fastcgi_request_state(ctx, 3), E_REQUEST_NOT_FOUND);
+
+	/* A request holding every buffered byte may be waiting for the rest of
+	 * its input, holding it back would never drain */
+	data_size = generate_begin((uint8_t*)data, 4096, 4);
+	for (n = 0; n < 3; n++) {
+		data_size += generate_stdin((uint8_t*)data + data_size
+			, 4096 - data_size, 4, content, sizeof(content));
+	}
+	data_size += generate_stdin((uint8_t*)data + data_size
+		, 4096 - data_size, 4, "", 0);
+	result = fastcgi_read(ctx, data, data_size);
+	TEST_ASSERT_EQUAL(result, data_size);
+	TEST_ASSERT_EQUAL(ctx->buffered, 1800);
+	TEST_ASSERT_EQUAL(fastcgi_paused(ctx), 0);
+	TEST_ASSERT_EQUAL(fastcgi_request_content_length(
+		fastcgi_find_request(ctx, 4)), 1800);
+
+	/* Records of an unknown request are never held back */
+	data_size = generate_param((uint8_t*)data, 4096, 9, "\x01\x01" "AB", 4);
+	result = fastcgi_read(ctx, data, data_size);
+	TEST_ASSERT_EQUAL(result, data_size);
+	TEST_ASSERT_EQUAL(fastcgi_paused(ctx), 0);
+	TEST_ASSERT_EQUAL(fastcgi_request_state(ctx, 9), E_REQUEST_NOT_FOUND);
+
+	fastcgi_destroy(ctx);
+}
+
+/* Turn filter requests away */
+uint8_t admit_responders(fastcgi_context_t *ctx, const uint16_t request_id
+	, const uint16_t role, void *user_data)
+{
+	(void)ctx;
+	(void)request_id;
+	(*(int32_t*)user_data)++;
+	return role == FCGI_FILTER ? FCGI_OVERLOADED : FCGI_REQUEST_COMPLETE;
+}
+
+/* Begin request_id and return the protocol status of the END_REQUEST queued
+ * for it, -1 if it was admitted.
+ */
+int32_t begin_status(fastcgi_context_t *ctx, uint16_t request_id
+	, uint16_t role)
+{
+	int32_t data_size = 0;
+	char data[64];
+	fcgi_record rec;
+
+	data_size = generate_begin((uint8_t*)data, 64, request_id);
+	data[8+1] = (char)role;
+	if (fastcgi_read(ctx, data, data_size) != data_size) {
+		return E_INVALID_SIZE;
+	}
+	if (fastcgi_control_pending(ctx) == 0) {
+		return -1;
+	}
+	data_size = fastcgi_write_control(ctx, data, 64);
+	parse_record(data, data_size, &rec);
+	if (rec.header.type != FCGI_END_REQUEST
+		|| rec.header.request_id != request_id) {
+		return E_INVALID_ARGUMENT;
+	}
+	return (uint8_t)rec.content[4];
+}
+
+void klunk_context_admission_test()
+{
+	int32_t result = E_SUCCESS;
+	int32_t calls = 0;
+	char output[256];
+	fastcgi_values_t values = {
+		.max_conns = 1,
+		.max_reqs = 1,
+		.mpxs_conns = 0
+	};
+	fastcgi_admission_policy_t policy = {
+		.target_usec = 0,
+		.interval_usec = 0,
+		.admit_func = admit_responders,
+		.admit_user_data = &calls
+	};
+	fastcgi_context_t *ctx = 0;
+
+	ctx = fastcgi_create();
+	TEST_ASSERT_NOT_EQUAL(ctx, 0);
+	if (ctx == 0) {
+		return;
+	}
+
+	/* Without multiplexing a second request is turned away */
+	fastcgi_set_values(ctx, &values);
+	TEST_ASSERT_EQUAL(begin_status(ctx, 1, FCGI_RESPONDER), -1);
+	TEST_ASSERT_EQUAL(begin_status(ctx, 2, FCGI_RESPONDER), FCGI_CANT_MPX_CONN);
+	TEST_ASSERT_EQUAL(fastcgi_request_state(ctx, 2), E_REQUEST_NOT_FOUND);
+	TEST_ASSERT_EQUAL(ctx->request_count, 1);
+	result = fastcgi_respond(ctx, 1, "Status: 200\r\n\r\n", 15, 0, 0, 0
+		, output, sizeof(output));
+	TEST_ASSERT_GT(result, 0);
+	values.mpxs_conns = 1;
+	fastcgi_set_values(ctx, &values);
+
+	/* The callback sees every request passing the built in checks */
+	fastcgi_set_admission_policy(ctx, &policy);
+	TEST_ASSERT_EQUAL(begin_status(ctx, 3, FCGI_FILTER), FCGI_OVERLOADED);
+	TEST_ASSERT_EQUAL(begin_status(ctx, 4, FCGI_RESPONDER), -1);
+	TEST_ASSERT_EQUAL(calls, 2);
+	fastcgi_respond(ctx, 4, "Status: 200\r\n\r\n", 15, 0, 0, 0
+		, output, sizeof(output));
+
+	/* A target needs an interval to be measured over */
+	policy.target_usec = 2000;
+	policy.admit_func = 0;
+	result = fastcgi_set_admission_policy(ctx, &policy);
+	TEST_ASSERT_EQUAL(result, E_INVALID_ARGUMENT);
+
+	/* A request waiting longer than the target for its handler over an
+	 * interval sheds new ones */
+	policy.interval_usec = 20000;
+	result = fastcgi_set_admission_policy(ctx, &policy);
+	TEST_ASSERT_EQUAL(result, E_SUCCESS);
+	TEST_ASSERT_EQUAL(begin_status(ctx, 5, FCGI_RESPONDER), -1);
+	usleep(30000);
+	result = fastcgi_write_output(ctx, 5, "ok", 2);
+	TEST_ASSERT_EQUAL(result, 2);
+	TEST_ASSERT_EQUAL(ctx->overloaded, 1);
+	TEST_ASSERT_EQUAL(begin_status(ctx, 6, FCGI_RESPONDER), FCGI_OVERLOADED);
+	fastcgi_respond(ctx, 5, "Status: 200\r\n\r\n", 15, 0, 0, 0
+		, output, sizeof(output));
+
+	/* An interval without a sample admits again */
+	usleep(30000);
+	TEST_ASSERT_EQUAL(begin_status(ctx, 7, FCGI_RESPONDER), -1);
+	TEST_ASSERT_EQUAL(ctx->overloaded, 0);
+
+	/* A request running long after its handler picked it up is no queue */
+	result = fastcgi_write_output(ctx, 7, "ok", 2);
+	TEST_ASSERT_EQUAL(result, 2);
+	usleep(30000);
+	TEST_ASSERT_EQUAL(begin_status(ctx, 8, FCGI_RESPONDER), -1);
+	TEST_ASSERT_EQUAL(ctx->overloaded, 0);
+	fastcgi_respond(ctx, 8, "Status: 200\r\n\r\n", 15, 0, 0, 0
+		, output, sizeof(output));
+
+	fastcgi_destroy(ctx);
+}
+
+/* Begin an authorizer request carrying a single parameter */
+int32_t generate_authorizer(char *data, const int32_t len, uint16_t request_id)
+{
+	int32_t data_size = 0;
+	int32_t params_size = 0;
+	char params[64];
+
+	data_size = generate_begin((uint8_t*)data, len, request_id);
+	data[8+1] = FCGI_AUTHORIZER;
+	params_size = add_param(params, sizeof(params), "REMOTE_USER", "bob");
+	data_size += generate_param((uint8_t*)data + data_size, len - data_size
+		, request_id, params, params_size);
+	data_size += generate_param((uint8_t*)data + data_size, len - data_size
+		, request_id, params, 0);
+	return data_size;
+}
+
+void klunk_context_authorizer_test()
+{
+	int32_t result = E_SUCCESS;
+	int32_t data_size = 0;
+	size_t buffered = 0;
+	const char *grant = "Variable-USER: bob\r\n";
+	char data[1024];
+	char output[1024];
+	fcgi_record rec;
+	fastcgi_context_t *ctx = 0;
+	fastcgi_request_t *request = 0;
+
+	ctx = fastcgi_create();
+	TEST_ASSERT_NOT_EQUAL(ctx, 0);
+	if (ctx == 0) {
+		return;
+	}
+
+	/* The request is ready once the parameters are in */
+	data_size = generate_authorizer(data, 1024, 1);
+	result = fastcgi_read(ctx, data, data_size);
+	TEST_ASSERT_EQUAL(result, data_size);
+	request = fastcgi_find_request(ctx, 1);
+	TEST_ASSERT_NOT_EQUAL(request, 0);
+	if (request == 0) {
+		fastcgi_destroy(ctx);
+		return;
+	}
+	TEST_ASSERT_EQUAL(request->role, FCGI_AUTHORIZER);
+	TEST_ASSERT_EQUAL(request->param_count, 1);
+	TEST_ASSERT_EQUAL(fastcgi_request_state(ctx, 1), (FASTCGI_RS_NEW
+		| FASTCGI_RS_PARAMS | FASTCGI_RS_PARAMS_DONE | FASTCGI_RS_STDIN_DONE));
+
+	/* A STDIN stream is dropped without a buffer */
+	buffered = ctx->buffered;
+	data_size = generate_stdin((uint8_t*)data, 1024, 1, "body", 4);
+	result = fastcgi_read(ctx, data, data_size);
+	TEST_ASSERT_EQUAL(result, data_size);
+	TEST_ASSERT_EQUAL(request->content, 0);
+	TEST_ASSERT_EQUAL(request->output, 0);
+	TEST_ASSERT_EQUAL(request->error, 0);
+	TEST_ASSERT_EQUAL(ctx->buffered, buffered);
+
+	/* The answer is one STDOUT record, the empty STDOUT and END_REQUEST */
+	result = fastcgi_authorize(ctx, 1, 200, grant, strlen(grant), output
+		, sizeof(output));
+	TEST_ASSERT_EQUAL(result, 8 + 40 + 8 + 16);
+	parse_record(output, result, &rec);
+	TEST_ASSERT_EQUAL(rec.header.type, FCGI_STDOUT);
+	TEST_ASSERT_EQUAL(rec.header.content_len, 35);
+	TEST_ASSERT_EQUAL(memcmp(rec.content
+		, "Status: 200\r\nVariable-USER: bob\r\n\r\n", 35), 0);
+	parse_record(output + 48, result - 48, &rec);
+	TEST_ASSERT_EQUAL(rec.header.type, FCGI_STDOUT);
+	TEST_ASSERT_EQUAL(rec.header.content_len, 0);
+	parse_record(output + 56, result - 56, &rec);
+	TEST_ASSERT_EQUAL(rec.header.type, FCGI_END_REQUEST);
+	TEST_ASSERT_EQUAL(fastcgi_request_state(ctx, 1), E_REQUEST_NOT_FOUND);
+
+	/* A denial without headers, a too small output is refused */
+	data_size = generate_authorizer(data, 1024, 2);
+	result = fastcgi_read(ctx, data, data_size);
+	TEST_ASSERT_EQUAL(result, data_size);
+	result = fastcgi_authorize(ctx, 2, 403, 0, 0, output, 40);
+	TEST_ASSERT_EQUAL(result, E_INVALID_SIZE);
+	result = fastcgi_authorize(ctx, 2, 99, 0, 0, output, sizeof(output));
+	TEST_ASSERT_EQUAL(result, E_INVALID_ARGUMENT);
+	result = fastcgi_authorize(ctx, 2, 403, 0, 0, output, sizeof(output));
+	TEST_ASSERT_EQUAL(result, 8 + 16 + 8 + 16);
+	parse_record(output, result, &rec);
+	TEST_ASSERT_EQUAL(rec.header.content_len, 15);
+	TEST_ASSERT_EQUAL(memcmp(rec.content, "Status: 403\r\n\r\n", 15), 0);
+
+	fastcgi_destroy(ctx);
+}
+
+void klunk_context_authorizer_benchmark()
+{
+	const int32_t rounds = 200000;
+	int32_t result = E_SUCCESS;
+	int32_t data_size = 0;
+	int32_t n = 0;
+	struct timespec start;
+	struct timespec stop;
+	double elapsed_ns = 0;
+	const char *grant = "Variable-USER: bob\r\n";
+	char data[1024];
+	char output[256];
+	fastcgi_context_t *ctx = 0;
+
+	ctx = fastcgi_create();
+	TEST_ASSERT_NOT_EQUAL(ctx, 0);
+	if (ctx == 0) {
+		return;
+	}
+	data_size = generate_authorizer(data, 1024, 1);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (n = 0; n < rounds; n++) {
+		result = fastcgi_read(ctx, data, data_size);
+		if (result == data_size) {
+			result = fastcgi_authorize(ctx, 1, 200, grant, 20, output
+				, sizeof(output));
+		}
+		if (result <= 0) {
+			TEST_ASSERT_GT(result, 0);
+			break;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	elapsed_ns = (stop.tv_sec - start.tv_sec) * 1e9
+		+ (stop.tv_nsec - start.tv_nsec);
+	printf("authorize %d requests: %.1f ns/request, %.0f requests/s\n"
+		, rounds, elapsed_ns / rounds, rounds * 1e9 / elapsed_ns);
+
+	fastcgi_destroy(ctx);
+}
@@ -3,6 +3,29 @@
 #include "errorcodes.h"
 #include "test_llist.h"
 
+static int32_t llist_frees = 0;
+
+void* llist_test_malloc(size_t size, void *user)
+{
+	(void)user;
+	return malloc(size);
+}
+
+void* llist_test_realloc(void *ptr, size_t size, void *user)
+{
+	(void)user;
+	return realloc(ptr, size);
+}
+
+void llist_test_free(void *ptr, void *user)
+{
+	(void)user;
+	if (ptr != 0) {
+		llist_frees++;
+	}
+	free(ptr);
+}
+
 int32_t item_match(const void* data, const void *key)
 {
 	return ((struct item*)data)->number == *((uint32_t*)key);
@@ -21,7 +44,7 @@ void llist_test()
 		ll_item = llist_begin(list);
 		TEST_ASSERT_EQUAL(ll_item, 0);
 		
-		struct item *i1 = malloc(sizeof(struct item));
+		struct item *i1 = fastcgi_malloc(list->alloc, sizeof(struct item));
 		i1->number = 1;
 		i1->character = '1';
 		
@@ -53,7 +76,7 @@ void llist_test()
 		TEST_ASSERT_EQUAL(an_item->number, 1);
 		TEST_ASSERT_EQUAL(an_item->character, '1');
 		
-		struct item *i2 = malloc(sizeof(struct item));
+		struct item *i2 = fastcgi_malloc(list->alloc, sizeof(struct item));
 		i2->number = 2;
 		i2->character = '2';
 
@@ -67,7 +90,7 @@ void llist_test()
 		TEST_ASSERT_EQUAL(an_item->number, 2);
 		TEST_ASSERT_EQUAL(an_item->character, '2');
 
-		struct item *i3 = malloc(sizeof(struct item));
+		struct item *i3 = fastcgi_malloc(list->alloc, sizeof(struct item));
 		i3->number = 3;
 		i3->character = '3';
 
@@ -121,7 +144,73 @@ void llist_test()
 
 		ll_item = llist_begin(list);
 		TEST_ASSERT_EQUAL(ll_item->data, i2);
+		TEST_ASSERT_EQUAL(list->tail, ll_item);
+
+		/* appending after removing the last item */
+		struct item *i4 = fastcgi_malloc(list->alloc, sizeof(struct item));
+		i4->number = 4;
+		i4->character = '4';
 
+		result = llist_add(list, i4, sizeof(struct item));
+		TEST_ASSERT_EQUAL(result, E_SUCCESS);
+		TEST_ASSERT_EQUAL(ll_item->next, list->tail);
+		TEST_ASSERT_EQUAL(list->tail->data, i4);
+
+		llist_destroy(list);
+	}
+
+	/* Items owned by the caller */
+	struct item owned[2] = {{1, '1'}, {2, '2'}};
+	llist_item_t owned_items[2];
+	list = llist_create(sizeof(struct item));
+	TEST_ASSERT_NOT_EQUAL(list, 0);
+	if (list != 0) {
+		owned_items[0].data = &owned[0];
+		owned_items[1].data = &owned[1];
+		result = llist_add_item(list, &owned_items[0]);
+		TEST_ASSERT_EQUAL(result, E_SUCCESS);
+		result = llist_add_item(list, &owned_items[1]);
+		TEST_ASSERT_EQUAL(result, E_SUCCESS);
+
+		ll_item = llist_begin(list);
+		TEST_ASSERT_EQUAL(ll_item, &owned_items[0]);
+		TEST_ASSERT_EQUAL(ll_item->next, &owned_items[1]);
+		TEST_ASSERT_EQUAL(list->tail, &owned_items[1]);
+
+		key = 2;
+		ll_item = llist_find_item_match(list, item_match, &key);
+		TEST_ASSERT_EQUAL(ll_item->data, &owned[1]);
+
+		llist_release(list);
+		ll_item = llist_begin(list);
+		TEST_ASSERT_EQUAL(ll_item, 0);
+		TEST_ASSERT_EQUAL(list->tail, 0);
+
+		result = llist_add_item(list, &owned_items[1]);
+		TEST_ASSERT_EQUAL(result, E_SUCCESS);
+		TEST_ASSERT_EQUAL(llist_begin(list), &owned_items[1]);
+		llist_release(list);
+		llist_destroy(list);
+	}
+
+	/* Item data is freed through the allocator of the list */
+	fastcgi_allocator_t alloc = {
+		.malloc = llist_test_malloc,
+		.realloc = llist_test_realloc,
+		.free = llist_test_free,
+		.user = 0
+	};
+	list = llist_create_with_allocator(sizeof(struct item), &alloc);
+	TEST_ASSERT_NOT_EQUAL(list, 0);
+	if (list != 0) {
+		an_item = fastcgi_malloc(&alloc, sizeof(struct item));
+		result = llist_add(list, an_item, sizeof(struct item));
+		TEST_ASSERT_EQUAL(result, E_SUCCESS);
+		llist_frees = 0;
+		result = llist_remove(list, an_item);
+		TEST_ASSERT_EQUAL(result, E_SUCCESS);
+		/* The data and the list item */
+		TEST_ASSERT_EQUAL(llist_frees, 2);
 		llist_destroy(list);
 	}
 }
@@ -0,0 +1,92 @@
+#include "testcase.h"
+#include "slab.h"
+#include "buffer.h"
+#include "errorcodes.h"
+#include "test_slab.h"
+
+void slab_test()
+{
+	int32_t result = 0;
+	char chunk[1000];
+	void *slab1 = 0;
+	void *slab2 = 0;
+	slab_stats_t stats;
+	slab_pool_t *pool = 0;
+	buffer_t *buffer = 0;
+
+	memset(chunk, 0x5a, sizeof(chunk));
+
+	pool = slab_pool_create(SLAB_MIN_SIZE * 4);
+	TEST_ASSERT_NOT_EQUAL(pool, 0);
+	if (pool == 0) {
+		return;
+	}
+
+	/* Sizes are rounded up to the size class */
+	TEST_ASSERT_EQUAL(slab_size(pool, 1), SLAB_MIN_SIZE);
+	TEST_ASSERT_EQUAL(slab_size(pool, SLAB_MIN_SIZE), SLAB_MIN_SIZE);
+	TEST_ASSERT_EQUAL(slab_size(pool, SLAB_MIN_SIZE + 1), SLAB_MIN_SIZE * 4);
+	TEST_ASSERT_EQUAL(slab_size(pool, SLAB_MAX_SIZE), SLAB_MAX_SIZE);
+	TEST_ASSERT_EQUAL(slab_size(pool, SLAB_MAX_SIZE + 1), 0);
+	TEST_ASSERT_EQUAL(slab_alloc(pool, SLAB_MAX_SIZE + 1), 0);
+
+	/* Returned slabs are reused */
+	slab1 = slab_alloc(pool, 100);
+	TEST_ASSERT_NOT_EQUAL(slab1, 0);
+	slab_free(pool, slab1, 100);
+	slab2 = slab_alloc(pool, 200);
+	TEST_ASSERT_EQUAL(slab1, slab2);
+	slab_pool_stats(pool, &stats);
+	TEST_ASSERT_EQUAL(stats.allocs, 2);
+	TEST_ASSERT_EQUAL(stats.misses, 1);
+	TEST_ASSERT_EQUAL(stats.slabs_in_use, 1);
+	TEST_ASSERT_EQUAL(stats.bytes_in_use, SLAB_MIN_SIZE);
+
+	/* Slabs beyond the free budget go back to the system */
+	slab1 = slab_alloc(pool, SLAB_MIN_SIZE * 4);
+	slab_free(pool, slab1, SLAB_MIN_SIZE * 4);
+	slab_free(pool, slab2, 200);
+	slab_pool_stats(pool, &stats);
+	TEST_ASSERT_EQUAL(stats.slabs_in_use, 0);
+	TEST_ASSERT_EQUAL(stats.slabs_free, 1);
+	TEST_ASSERT_EQUAL(stats.bytes_free, SLAB_MIN_SIZE * 4);
+
+	result = slab_pool_stats(pool, 0);
+	TEST_ASSERT_EQUAL(result, E_INVALID_ARGUMENT);
+	result = slab_pool_stats(0, &stats);
+	TEST_ASSERT_EQUAL(result, E_INVALID_OBJECT);
+
+	/* Pooled buffers borrow a slab on the first write and return it on reset */
+	buffer = buffer_create_pooled(pool);
+	TEST_ASSERT_NOT_EQUAL(buffer, 0);
+	if (buffer != 0) {
+		TEST_ASSERT_EQUAL(buffer_size(buffer), 0);
+		TEST_ASSERT_EQUAL(buffer_peek(buffer), 0);
+		result = buffer_write(buffer, chunk, sizeof(chunk));
+		TEST_ASSERT_EQUAL(result, (int32_t)sizeof(chunk));
+		TEST_ASSERT_TRUE((buffer->flags & BUFFER_POOLED) != 0);
+		slab_pool_stats(pool, &stats);
+		TEST_ASSERT_EQUAL(stats.slabs_in_use, 1);
+
+		/* Growing past the largest slab leaves the pool */
+		result = buffer_reserve(buffer, SLAB_MAX_SIZE + 1);
+		TEST_ASSERT_GT(result, SLAB_MAX_SIZE);
+		TEST_ASSERT_EQUAL((buffer->flags & BUFFER_POOLED), 0);
+		TEST_ASSERT_EQUAL(memcmp(buffer_peek(buffer), chunk, sizeof(chunk)), 0);
+		slab_pool_stats(pool, &stats);
+		TEST_ASSERT_EQUAL(stats.slabs_in_use, 0);
+
+		result = buffer_reset(buffer);
+		TEST_ASSERT_EQUAL(result, 0);
+		TEST_ASSERT_EQUAL(buffer_size(buffer), 0);
+
+		result = buffer_write(buffer, chunk, sizeof(chunk));
+		TEST_ASSERT_EQUAL(result, (int32_t)sizeof(chunk));
+		result = buffer_reset(buffer);
+		TEST_ASSERT_EQUAL(result, 0);
+		slab_pool_stats(pool, &stats);
+		TEST_ASSERT_EQUAL(stats.slabs_in_use, 0);
+		buffer_destroy(buffer);
+	}
+	slab_pool_destroy(pool);
+}